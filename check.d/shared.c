@@ -0,0 +1,352 @@
+/* Translated by um2c from check.d/shared.um */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "um.h"
+
+/* Instructions fall through from case to case, and not every chunk uses
+ * every label and local, nor every file every helper
+ */
+#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
+#pragma GCC diagnostic ignored "-Wunused-label"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+/* How a chunk stopped */
+enum { GO, OUT, HALT };
+
+/* A translated program, and which of its words stores to segment 0 have
+ * changed from it. Each instruction's block runs to the next halt or
+ * load_program, and stale counts the changed words of the block ending
+ * at each instruction.
+ */
+typedef struct code {
+        const uint32_t *words;
+        uint32_t length;
+        uint32_t *ends;
+        uint32_t *stale;
+        unsigned char *changed;
+        uint32_t changes;
+} code;
+
+/* Hands the machine to the interpreter at instruction n */
+#define EXIT(n) do { *pc = (n); goto out; } while (0)
+
+/* Leaves the chunk to carry on at instruction n */
+#define NEXT(n) do { *pc = (n); goto next; } while (0)
+
+/* Goes to instruction t, whose block ends at e, unless a store has
+ * changed an instruction from t to e
+ */
+#define JUMP(t, e)                                                      \
+        do {                                                            \
+                if (__builtin_expect(p->stale[e] != 0, 0) &&            \
+                    stale_from(p, t))                                   \
+                        EXIT(t);                                        \
+                target = (t);                                           \
+                goto enter;                                             \
+        } while (0)
+
+/* Goes to instruction t, in this chunk or another, checking it as JUMP
+ * does
+ */
+#define DISPATCH(t) do { target = (t); goto dispatch; } while (0)
+
+/* Stores to a segment other than 0 */
+#define STORE(a, b, c)                                                  \
+        do {                                                            \
+                s = seg[a];                                             \
+                if (__builtin_expect(s[0] > 1, 0))                      \
+                        s = um_own(m, a);                               \
+                s[(b) + 2] = (c);                                       \
+        } while (0)
+
+#define SAVE()                                                          \
+        do {                                                            \
+                r[0] = r0; r[1] = r1; r[2] = r2; r[3] = r3;             \
+                r[4] = r4; r[5] = r5; r[6] = r6; r[7] = r7;             \
+        } while (0)
+
+/* Sets a program up to run with none of its words changed */
+static void code_reset(code *p)
+{
+        if (p->ends == NULL) {
+                uint32_t end = p->length - 1;
+
+                p->ends = malloc(sizeof(uint32_t) * p->length);
+                p->stale = malloc(sizeof(uint32_t) * p->length);
+                p->changed = malloc(p->length);
+                if (p->ends == NULL || p->stale == NULL ||
+                    p->changed == NULL) {
+                        fprintf(stderr, "Error: out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+                for (uint32_t i = p->length; i-- > 0; ) {
+                        if (p->words[i] >> 28 == 7 ||
+                            p->words[i] >> 28 == 12)
+                                end = i;
+                        p->ends[i] = end;
+                }
+        }
+
+        memset(p->stale, 0, sizeof(uint32_t) * p->length);
+        memset(p->changed, 0, p->length);
+        p->changes = 0;
+}
+
+__attribute__((noinline))
+static bool stale_from(const code *p, uint32_t pc)
+{
+        for (uint32_t i = pc; i <= p->ends[pc]; i++)
+                if (p->changed[i])
+                        return true;
+        return false;
+}
+
+/* Stores to segment 0 from the instruction at pc. Returns true if the
+ * store changed an instruction later in the running block, which must
+ * then be left.
+ */
+static inline bool store0(um_machine *m, uint32_t *const *seg, code *p,
+    uint32_t offset, uint32_t value, uint32_t pc)
+{
+        uint32_t *s = seg[0];
+        bool changed = value != p->words[offset];
+
+        if (__builtin_expect(s[0] > 1, 0))
+                s = um_own(m, 0);
+        s[offset + 2] = value;
+
+        if (__builtin_expect(changed != p->changed[offset], 0)) {
+                p->changed[offset] = changed;
+                if (changed) {
+                        p->stale[p->ends[offset]]++;
+                        p->changes++;
+                } else {
+                        p->stale[p->ends[offset]]--;
+                        p->changes--;
+                }
+        }
+        return changed && offset > pc && p->ends[offset] == p->ends[pc];
+}
+
+/* Brings the interpreter up to date with the words native code changed,
+ * before handing it the machine
+ */
+static void code_sync(um_machine *m, const code *p)
+{
+        for (uint32_t i = 0; p->changes != 0 && i < p->length; i++)
+                if (p->changed[i])
+                        um_stored(m, i);
+}
+
+__attribute__((unused))
+static uint32_t read_byte(void)
+{
+        int c;
+
+        fflush(stdout);
+        c = getchar();
+        return c == EOF ? ~0u : (uint32_t)c;
+}
+
+static int io_input(void *context)
+{
+        (void)context;
+        fflush(stdout);
+        int c = getchar();
+        return c == EOF ? UM_INPUT_EOF : c;
+}
+
+static void io_output(void *context, unsigned char byte)
+{
+        (void)context;
+        putchar(byte);
+}
+
+static void past_end(void)
+{
+        fflush(stdout);
+        fprintf(stderr, "Error: ran past the end of segment 0\n");
+        exit(EXIT_FAILURE);
+}
+
+#define PROGRAMS 1
+#define CHUNK 1024
+
+static const uint32_t image[] = {
+        0x314e4d55u, 27u,
+        0xd0000000u, 0xdc000000u, 0x600001b6u, 0xde00001bu, 0x80000017u, 0x300001feu,
+        0x10000047u, 0x200000b9u, 0xd8000005u, 0xd600000cu, 0x000000e7u, 0xc0000003u,
+        0xd200000eu, 0xc0000011u, 0xde00001au, 0xd200000au, 0x200000b9u, 0x10000047u,
+        0xa0000001u, 0xd200006bu, 0x20000039u, 0x10000047u, 0xa0000001u, 0x10000057u,
+        0xa0000001u, 0x70000000u, 0x0000006fu,
+};
+
+static code codes[PROGRAMS] = {
+        { image + 2, 27u, NULL, NULL, NULL, 0 },
+};
+
+static int run0_0(um_machine *m, uint32_t r[8], uint32_t *pc)
+{
+        code *const p = &codes[0];
+        uint32_t *const *seg = um_segments(m);
+        uint32_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3];
+        uint32_t r4 = r[4], r5 = r[5], r6 = r[6], r7 = r[7];
+        uint32_t target = *pc, *s;
+
+dispatch:
+        if (target - 0u > 26u)
+                NEXT(target);
+        if (__builtin_expect(p->stale[p->ends[target]] != 0, 0) &&
+            stale_from(p, target))
+                EXIT(target);
+enter:
+        switch (target) {
+        case 0:      r0 = 0x0u;
+        case 1:      r6 = 0x0u;
+        case 2:      r6 = ~(r6 & r6);
+        case 3:      r7 = 0x1bu;
+        case 4:      r2 = um_map(m, r7); seg = um_segments(m);
+        case 5:      r7 = r7 + r6;
+        case 6:      r1 = seg[r0][r7 + 2];
+        case 7:      if (r2 != 0) STORE(r2, r7, r1); else if (r7 >= 27) EXIT(7); else if (store0(m, seg, p, r7, r1, 7)) EXIT(8);
+                     r4 = 0x5u;
+                     r3 = 0xcu;
+                     if (r7) r3 = r4;
+                     if (r0 != 0) EXIT(11);
+                     if (r7) JUMP(5, 11);
+                     JUMP(12, 13);
+        case 8:      r4 = 0x5u;
+                     r3 = 0xcu;
+                     if (r7) r3 = r4;
+                     if (r0 != 0) EXIT(11);
+                     if (r7) JUMP(5, 11);
+                     JUMP(12, 13);
+        case 9:      r3 = 0xcu;
+        case 10:     if (r7) r3 = r4;
+        case 11:     if (r0 != 0 || r3 >= 27) EXIT(11); DISPATCH(r3);
+        case 12:     r1 = 0xeu;
+                     if (r2 != 0) EXIT(13);
+                     JUMP(14, 25);
+        case 13:     if (r2 != 0 || r1 >= 27) EXIT(13); DISPATCH(r1);
+        case 14:     r7 = 0x1au;
+        case 15:     r1 = 0xau;
+        case 16:     if (r2 != 0) STORE(r2, r7, r1); else if (r7 >= 27) EXIT(16); else if (store0(m, seg, p, r7, r1, 16)) EXIT(17);
+        case 17:     r1 = seg[r0][r7 + 2];
+        case 18:     putchar((unsigned char)r1);
+        case 19:     r1 = 0x6bu;
+        case 20:     if (r0 != 0) STORE(r0, r7, r1); else if (r7 >= 27) EXIT(20); else if (store0(m, seg, p, r7, r1, 20)) EXIT(21);
+        case 21:     r1 = seg[r0][r7 + 2];
+        case 22:     putchar((unsigned char)r1);
+        case 23:     r1 = seg[r2][r7 + 2];
+        case 24:     putchar((unsigned char)r1);
+        case 25:     goto halt;
+        case 26:     if (r7) r1 = r5;
+        }
+        past_end();
+halt:
+        SAVE();
+        return HALT;
+out:
+        SAVE();
+        return OUT;
+next:
+        SAVE();
+        return GO;
+}
+
+/* check.d/shared.um: 27 words */
+static bool run0(um_machine *m, uint32_t r[8], uint32_t *pc)
+{
+        static int (*const chunks[])(um_machine *, uint32_t [8], uint32_t *) = {
+                run0_0,
+        };
+        int how;
+
+        do
+                how = chunks[*pc / CHUNK](m, r, pc);
+        while (how == GO);
+
+        if (how == OUT)
+                code_sync(m, &codes[0]);
+        return how == HALT;
+}
+
+static bool (*const run[PROGRAMS])(um_machine *, uint32_t [8], uint32_t *) = {
+        run0,
+};
+
+/* Interpreter runs grow to this many instructions between checks of
+ * segment 0
+ */
+#define MAX_BUDGET (1u << 20)
+
+/* Runs the machine in the interpreter from the given state until it
+ * halts, or until segment 0 holds a translated program again, whose
+ * number is returned with the state to carry on from
+ */
+static int interpret(um_machine *m, uint32_t r[8], uint32_t *pc)
+{
+        const uint32_t *checked = um_segments(m)[0];
+        uint64_t budget = 1;
+        um_status status;
+
+        um_set_state(m, r, *pc);
+        while ((status = um_run(m, budget)) == UM_BUDGET) {
+                const uint32_t *prog = um_segments(m)[0];
+
+                if (prog != checked) {
+                        checked = prog;
+                        um_get_state(m, r, pc);
+                        for (int k = 0; k < PROGRAMS; k++) {
+                                code *p = &codes[k];
+
+                                if (prog[1] == p->length &&
+                                    *pc < p->length &&
+                                    memcmp(prog + 2, p->words,
+                                    sizeof(uint32_t) * p->length) == 0) {
+                                        code_reset(p);
+                                        return k;
+                                }
+                        }
+                }
+                if (budget < MAX_BUDGET)
+                        budget *= 2;
+        }
+
+        if (status != UM_HALTED) {
+                fflush(stdout);
+                fprintf(stderr, "Error: %s\n", um_last_error(m)->message);
+                exit(EXIT_FAILURE);
+        }
+        return -1;
+}
+
+int main(void)
+{
+        um_io io = { io_input, io_output, NULL };
+        um_error error;
+        um_machine *m = um_create(image, sizeof(image), &io, &error);
+        uint32_t r[8] = { 0 };
+        uint32_t pc = 0;
+        int k = 0;
+
+        if (m == NULL) {
+                fprintf(stderr, "Error: %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        code_reset(&codes[0]);
+        while (k >= 0 && !run[k](m, r, &pc))
+                k = interpret(m, r, &pc);
+
+        fflush(stdout);
+        um_free(m);
+        return EXIT_SUCCESS;
+}
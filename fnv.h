@@ -0,0 +1,12 @@
+/* fnv.h: 64-bit FNV-1a, the hash um keys its decode cache by and the
+ * digest um, umbench and um-batch take of a program's output, so their
+ * digests can be compared.
+ */
+
+#ifndef FNV_H
+#define FNV_H
+
+#define FNV_SEED 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+#endif
@@ -0,0 +1,45 @@
+/* listener.c: the listening socket shared by um-server and um-pool */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "listener.h"
+
+/* Function: open_listener
+ * Does: Binds a Unix domain socket at the given path, replacing a stale
+ *       socket file left there, and listens on it
+ * Paramters: const char*, int, const char*
+ * Returns: the socket
+ */
+int open_listener(const char *path, int flags, const char *prog)
+{
+        struct sockaddr_un addr;
+        int fd = socket(AF_UNIX, SOCK_STREAM | flags, 0);
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "%s: socket path too long\n", prog);
+                exit(EXIT_FAILURE);
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        struct stat sb;
+        if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+                unlink(path);
+
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(fd, SOMAXCONN) != 0) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+
+        return fd;
+}
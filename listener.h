@@ -0,0 +1,14 @@
+/* listener.h: the Unix domain socket um-server and um-pool take
+ * connections on.
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/* Binds a socket at path, replacing a stale socket file left there, and
+ * listens on it. flags are added to the socket type, such as
+ * SOCK_NONBLOCK. On failure prints a message naming prog and exits.
+ */
+int open_listener(const char *path, int flags, const char *prog);
+
+#endif
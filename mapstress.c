@@ -0,0 +1,131 @@
+/* mapstress: writes a UM program that stresses map_segment and
+ * unmap_segment. Each round maps LIVE segments of 1 to 8 words, keeping
+ * their identifiers in a table segment, then unmaps them all, so the
+ * program maps and unmaps LIVE * ROUNDS segments with up to LIVE of them
+ * live at once.
+ *
+ * Usage: mapstress [live [rounds]] > mapstress.um
+ *        time ./um --pool-stats mapstress.um
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define DEFAULT_LIVE 1000000
+#define DEFAULT_ROUNDS 20
+
+/* Largest value a load_value instruction can hold */
+#define MAX_LVALUE 0x1ffffff
+
+static uint32_t prog[64];
+static unsigned prog_len = 0;
+
+static inline void emit(uint32_t opcode, unsigned a, unsigned b, unsigned c)
+{
+        prog[prog_len++] = (opcode << 28) | (a << 6) | (b << 3) | c;
+}
+
+static inline void emit_value(unsigned a, uint32_t value)
+{
+        prog[prog_len++] = (13u << 28) | (a << 25) | value;
+}
+
+/* Function: emit_loop
+ * Does: Emits a jump to target while register test is nonzero, and to the
+ *       instruction following the jump otherwise. Uses r3 and r4.
+ * Paramters: unsigned, uint32_t
+ * Returns: None
+ */
+static inline void emit_loop(unsigned test, uint32_t target)
+{
+        emit_value(4, prog_len + 4);
+        emit_value(3, target);
+        emit(0, 4, 3, test);
+        emit(12, 0, 0, 4);
+}
+
+/* Function: parse_count
+ * Does: Reads a positive count that fits in a load_value instruction
+ * Paramters: char*, char*
+ * Returns: uint32_t
+ */
+static uint32_t parse_count(char *arg, char *prog_name)
+{
+        char *end;
+        unsigned long value = strtoul(arg, &end, 10);
+
+        if (*end != '\0' || value == 0 || value > MAX_LVALUE) {
+                fprintf(stderr, "%s: counts must be between 1 and %u\n",
+                    prog_name, MAX_LVALUE);
+                exit(EXIT_FAILURE);
+        }
+
+        return (uint32_t)value;
+}
+
+int main(int argc, char *argv[])
+{
+        uint32_t live = DEFAULT_LIVE;
+        uint32_t rounds = DEFAULT_ROUNDS;
+
+        if (argc > 3) {
+                fprintf(stderr, "usage: %s [live [rounds]]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+        if (argc > 1)
+                live = parse_count(argv[1], argv[0]);
+        if (argc > 2)
+                rounds = parse_count(argv[2], argv[0]);
+
+        /* r0 = 0, r6 = -1, r2 = table of live identifiers, r7 = rounds */
+        emit_value(0, 0);
+        emit_value(6, 0);
+        emit(6, 6, 6, 6);
+        emit_value(5, live);
+        emit(8, 0, 2, 5);
+        emit_value(7, rounds);
+
+        /* Maps segments of (i & 7) + 1 words, for i counting down in r1 */
+        uint32_t round = prog_len;
+        emit_value(1, live);
+        uint32_t fill = prog_len;
+        emit(3, 1, 1, 6);
+        emit_value(5, 7);
+        emit(6, 5, 1, 5);
+        emit(6, 5, 5, 5);
+        emit_value(3, 1);
+        emit(3, 5, 5, 3);
+        emit(8, 0, 3, 5);
+        emit(2, 2, 1, 3);
+        emit_loop(1, fill);
+
+        /* Unmaps them in the order they were mapped */
+        emit_value(1, live);
+        uint32_t drain = prog_len;
+        emit(3, 1, 1, 6);
+        emit(1, 3, 2, 1);
+        emit(9, 0, 0, 3);
+        emit_loop(1, drain);
+
+        emit(3, 7, 7, 6);
+        emit_loop(7, round);
+
+        emit_value(5, 'o');
+        emit(10, 0, 0, 5);
+        emit_value(5, 'k');
+        emit(10, 0, 0, 5);
+        emit_value(5, '\n');
+        emit(10, 0, 0, 5);
+        emit(7, 0, 0, 0);
+
+        /* UM images are big-endian */
+        for (unsigned i = 0; i < prog_len; i++) {
+                putchar(prog[i] >> 24);
+                putchar((prog[i] >> 16) & 0xff);
+                putchar((prog[i] >> 8) & 0xff);
+                putchar(prog[i] & 0xff);
+        }
+
+        return EXIT_SUCCESS;
+}
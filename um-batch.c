@@ -0,0 +1,665 @@
+/* um-batch: runs many UM jobs at once over a pool of worker threads. Each
+ * line of the job list names an image and, optionally, an input file. Jobs
+ * run in time slices of a fixed number of instructions through libum. Every
+ * worker keeps its jobs in a deque; it takes from its own bottom, and an
+ * idle worker steals from the top of another's. A job whose input is not
+ * ready is parked and does not hold a worker until the input is readable.
+ * A tab-separated line is written for each job and a summary goes to
+ * standard error.
+ *
+ * Usage: um-batch [-j threads] [-s slice] [-o outdir] joblist
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "um.h"
+#include "fnv.h"
+
+#define DEFAULT_SLICE 1000000
+#define MAX_LINE 4096
+#define IN_BYTES 4096
+#define OUT_BYTES 65536
+
+/* How often an idle worker looks at parked jobs' input, in nanoseconds */
+#define IDLE_NS 200000
+
+typedef enum job_state { JOB_READY, JOB_HALTED, JOB_FAILED } job_state;
+
+typedef struct job {
+        unsigned index;
+        char *image;
+        char *input;
+        um_machine *machine;
+        job_state state;
+        char message[128];
+
+        /* The buffers are allocated when the job starts */
+        int infd;
+        unsigned char *inbuf;
+        size_t inpos;
+        size_t inlen;
+
+        int outfd;
+        unsigned char *outbuf;
+        size_t outlen;
+        uint64_t digest;
+
+        uint64_t instructions;
+        double seconds;
+        unsigned slices;
+} job;
+
+/* A work-stealing deque of jobs in a ring of a power-of-two size that holds
+ * every job, so it never fills. Slices run for milliseconds, so a lock per
+ * operation costs nothing that shows.
+ */
+typedef struct deque {
+        pthread_mutex_t lock;
+        job **slots;
+        size_t mask;
+        size_t top;
+        size_t bottom;
+} deque;
+
+typedef struct worker {
+        pthread_t thread;
+        unsigned id;
+        deque jobs;
+        uint64_t steals;
+        uint64_t slices;
+} worker;
+
+typedef struct scheduler {
+        worker *workers;
+        unsigned nworkers;
+        uint64_t slice;
+        const char *outdir;
+
+        atomic_uint remaining;
+
+        /* Idle workers wait on wake until wakeups moves past what they saw
+         * before looking for a job */
+        pthread_mutex_t idlelock;
+        pthread_cond_t wake;
+        unsigned wakeups;
+        unsigned idle;
+
+        /* Jobs waiting for input */
+        pthread_mutex_t parklock;
+        job **parked;
+        unsigned nparked;
+} scheduler;
+
+static scheduler sched;
+
+/* Function: deque_push
+ * Does: Adds a job at the owner's end of a deque
+ * Paramters: deque*, job*
+ * Returns: None
+ */
+static void deque_push(deque *d, job *j)
+{
+        pthread_mutex_lock(&d->lock);
+        d->slots[d->bottom++ & d->mask] = j;
+        pthread_mutex_unlock(&d->lock);
+}
+
+/* Function: deque_requeue
+ * Does: Adds a job at the far end of a deque, so the owner runs every
+ *       other job first and thieves see it first
+ * Paramters: deque*, job*
+ * Returns: None
+ */
+static void deque_requeue(deque *d, job *j)
+{
+        pthread_mutex_lock(&d->lock);
+        d->slots[--d->top & d->mask] = j;
+        pthread_mutex_unlock(&d->lock);
+}
+
+/* Function: deque_pop
+ * Does: Takes a job from the owner's end of a deque
+ * Paramters: deque*
+ * Returns: the job, or NULL if the deque is empty
+ */
+static job *deque_pop(deque *d)
+{
+        job *j = NULL;
+
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom != d->top)
+                j = d->slots[--d->bottom & d->mask];
+        pthread_mutex_unlock(&d->lock);
+
+        return j;
+}
+
+/* Function: deque_steal
+ * Does: Takes a job from the far end of another worker's deque
+ * Paramters: deque*
+ * Returns: the job, or NULL if the deque is empty
+ */
+static job *deque_steal(deque *d)
+{
+        job *j = NULL;
+
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom != d->top)
+                j = d->slots[d->top++ & d->mask];
+        pthread_mutex_unlock(&d->lock);
+
+        return j;
+}
+
+/* Function: wake_workers
+ * Does: Tells idle workers there may be a job to run or that the last job
+ *       is done: one of them, or all
+ * Paramters: bool
+ * Returns: None
+ */
+static void wake_workers(bool all)
+{
+        pthread_mutex_lock(&sched.idlelock);
+        sched.wakeups++;
+        if (all)
+                pthread_cond_broadcast(&sched.wake);
+        else if (sched.idle != 0)
+                pthread_cond_signal(&sched.wake);
+        pthread_mutex_unlock(&sched.idlelock);
+}
+
+/* Function: job_input
+ * Does: Hands the machine the next byte of the job's input, reading
+ *       without blocking
+ * Paramters: void*
+ * Returns: the byte, UM_INPUT_EOF, or UM_INPUT_BLOCKED if none is ready
+ */
+static int job_input(void *context)
+{
+        job *j = context;
+
+        if (j->inpos == j->inlen) {
+                if (j->infd < 0)
+                        return UM_INPUT_EOF;
+
+                ssize_t n = read(j->infd, j->inbuf, IN_BYTES);
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR))
+                        return UM_INPUT_BLOCKED;
+                if (n <= 0) {
+                        close(j->infd);
+                        j->infd = -1;
+                        return UM_INPUT_EOF;
+                }
+                j->inpos = 0;
+                j->inlen = n;
+        }
+
+        return j->inbuf[j->inpos++];
+}
+
+/* Function: job_flush
+ * Does: Writes the job's buffered output to its output file, if it has one
+ * Paramters: job*
+ * Returns: None
+ */
+static void job_flush(job *j)
+{
+        size_t done = 0;
+
+        while (j->outfd >= 0 && done < j->outlen) {
+                ssize_t n = write(j->outfd, j->outbuf + done,
+                    j->outlen - done);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0)
+                        break;
+                done += n;
+        }
+
+        j->outlen = 0;
+}
+
+static void job_output(void *context, unsigned char byte)
+{
+        job *j = context;
+
+        j->digest = (j->digest ^ byte) * FNV_PRIME;
+        if (j->outbuf == NULL)
+                return;
+        j->outbuf[j->outlen++] = byte;
+        if (j->outlen == OUT_BYTES)
+                job_flush(j);
+}
+
+/* Function: job_start
+ * Does: Maps the job's image, makes its machine, and opens its input and
+ *       output files with their buffers
+ * Paramters: job*
+ * Returns: false, with the job failed, if any of that goes wrong
+ */
+static bool job_start(job *j)
+{
+        int fd = open(j->image, O_RDONLY);
+        struct stat sb;
+
+        if (fd < 0 || fstat(fd, &sb) != 0) {
+                snprintf(j->message, sizeof(j->message), "Could not open %s",
+                    j->image);
+                if (fd >= 0)
+                        close(fd);
+                return false;
+        }
+
+        void *image = sb.st_size == 0 ? NULL : mmap(NULL, sb.st_size,
+            PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (image == MAP_FAILED) {
+                snprintf(j->message, sizeof(j->message), "Could not map %s",
+                    j->image);
+                return false;
+        }
+
+        um_io io = { job_input, job_output, j };
+        um_error error;
+
+        j->machine = um_create(image, sb.st_size, &io, &error);
+        if (image != NULL)
+                munmap(image, sb.st_size);
+        if (j->machine == NULL) {
+                memcpy(j->message, error.message, sizeof(j->message));
+                return false;
+        }
+
+        if (j->input != NULL && (j->infd = open(j->input,
+            O_RDONLY | O_NONBLOCK)) < 0) {
+                snprintf(j->message, sizeof(j->message), "Could not open %s",
+                    j->input);
+                return false;
+        }
+        if (j->infd >= 0)
+                j->inbuf = malloc(IN_BYTES);
+
+        if (sched.outdir != NULL) {
+                char path[MAX_LINE];
+
+                snprintf(path, sizeof(path), "%s/%u.out", sched.outdir,
+                    j->index);
+                j->outfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (j->outfd < 0) {
+                        snprintf(j->message, sizeof(j->message), "Could not "
+                            "write %.100s", path);
+                        return false;
+                }
+                j->outbuf = malloc(OUT_BYTES);
+        }
+
+        return true;
+}
+
+/* Function: job_finish
+ * Does: Records how the job ended and releases its machine and files
+ * Paramters: job*, job_state
+ * Returns: None
+ */
+static void job_finish(job *j, job_state state)
+{
+        j->state = state;
+
+        /* A job that failed before its machine ran keeps its own message */
+        if (state == JOB_FAILED && j->machine != NULL &&
+            um_last_error(j->machine)->code != UM_ERROR_NONE)
+                memcpy(j->message, um_last_error(j->machine)->message,
+                    sizeof(j->message));
+
+        job_flush(j);
+        if (j->machine != NULL)
+                j->instructions = um_instructions(j->machine);
+        um_free(j->machine);
+        j->machine = NULL;
+
+        if (j->infd >= 0)
+                close(j->infd);
+        if (j->outfd >= 0)
+                close(j->outfd);
+        j->infd = j->outfd = -1;
+        free(j->inbuf);
+        free(j->outbuf);
+        j->inbuf = j->outbuf = NULL;
+
+        if (atomic_fetch_sub(&sched.remaining, 1) == 1)
+                wake_workers(true);
+}
+
+static double thread_seconds(void)
+{
+        struct timespec t;
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+        return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Function: run_slice
+ * Does: Runs one time slice of a job on the given worker and puts the job
+ *       wherever its status sends it
+ * Paramters: worker*, job*
+ * Returns: None
+ */
+static void run_slice(worker *w, job *j)
+{
+        if (j->machine == NULL && !job_start(j)) {
+                job_finish(j, JOB_FAILED);
+                return;
+        }
+
+        double start = thread_seconds();
+        um_status status = um_run(j->machine, sched.slice);
+
+        j->seconds += thread_seconds() - start;
+        j->slices++;
+        w->slices++;
+
+        switch (status) {
+        case UM_BUDGET:
+                deque_requeue(&w->jobs, j);
+                wake_workers(false);
+                break;
+        case UM_BLOCKED:
+                pthread_mutex_lock(&sched.parklock);
+                sched.parked[sched.nparked++] = j;
+                pthread_mutex_unlock(&sched.parklock);
+                break;
+        case UM_HALTED:
+                job_finish(j, JOB_HALTED);
+                break;
+        case UM_FAILED:
+                job_finish(j, JOB_FAILED);
+                break;
+        }
+}
+
+/* Function: unpark
+ * Does: Moves parked jobs whose input has become readable to the worker's
+ *       deque. Only one worker polls at a time.
+ * Paramters: worker*
+ * Returns: whether any job was moved
+ */
+static bool unpark(worker *w)
+{
+        bool moved = false;
+
+        if (pthread_mutex_trylock(&sched.parklock) != 0)
+                return false;
+
+        for (unsigned i = 0; i < sched.nparked; ) {
+                job *j = sched.parked[i];
+                struct pollfd p = { j->infd, POLLIN, 0 };
+
+                if (poll(&p, 1, 0) != 0) {
+                        sched.parked[i] = sched.parked[--sched.nparked];
+                        deque_push(&w->jobs, j);
+                        moved = true;
+                } else {
+                        i++;
+                }
+        }
+
+        pthread_mutex_unlock(&sched.parklock);
+        if (moved)
+                wake_workers(false);
+        return moved;
+}
+
+/* Function: find_job
+ * Does: Picks the worker's next job: its own newest, else the oldest job
+ *       of another worker, else a parked job whose input is ready
+ * Paramters: worker*
+ * Returns: the job, or NULL if there is none to run now
+ */
+static job *find_job(worker *w)
+{
+        job *j = deque_pop(&w->jobs);
+
+        for (unsigned i = 1; j == NULL && i < sched.nworkers; i++) {
+                j = deque_steal(&sched.workers[(w->id + i) %
+                    sched.nworkers].jobs);
+                if (j != NULL)
+                        w->steals++;
+        }
+
+        if (j == NULL && unpark(w))
+                j = deque_pop(&w->jobs);
+
+        return j;
+}
+
+/* Function: wait_for_work
+ * Does: Blocks a worker that found no job until another is woken for it
+ *       after it looked. While jobs are parked it wakes every IDLE_NS to
+ *       look at their input, since nothing else will.
+ * Paramters: unsigned
+ * Returns: None
+ */
+static void wait_for_work(unsigned seen)
+{
+        pthread_mutex_lock(&sched.parklock);
+        bool parked = sched.nparked != 0;
+        pthread_mutex_unlock(&sched.parklock);
+
+        pthread_mutex_lock(&sched.idlelock);
+        if (sched.wakeups == seen && atomic_load(&sched.remaining) != 0) {
+                sched.idle++;
+                if (parked) {
+                        struct timespec until;
+
+                        clock_gettime(CLOCK_REALTIME, &until);
+                        until.tv_nsec += IDLE_NS;
+                        if (until.tv_nsec >= 1000000000) {
+                                until.tv_sec++;
+                                until.tv_nsec -= 1000000000;
+                        }
+                        pthread_cond_timedwait(&sched.wake, &sched.idlelock,
+                            &until);
+                } else {
+                        pthread_cond_wait(&sched.wake, &sched.idlelock);
+                }
+                sched.idle--;
+        }
+        pthread_mutex_unlock(&sched.idlelock);
+}
+
+static void *work(void *arg)
+{
+        worker *w = arg;
+
+        while (atomic_load(&sched.remaining) != 0) {
+                pthread_mutex_lock(&sched.idlelock);
+                unsigned seen = sched.wakeups;
+                pthread_mutex_unlock(&sched.idlelock);
+
+                job *j = find_job(w);
+
+                if (j == NULL)
+                        wait_for_work(seen);
+                else
+                        run_slice(w, j);
+        }
+
+        return NULL;
+}
+
+/* Function: read_jobs
+ * Does: Reads the job list: one job per line, an image and an optional
+ *       input file; blank lines and lines starting with # are skipped
+ * Paramters: const char*, unsigned*
+ * Returns: the jobs
+ */
+static job *read_jobs(const char *filename, unsigned *count)
+{
+        FILE *list = fopen(filename, "r");
+        char line[MAX_LINE];
+        job *jobs = NULL;
+        unsigned n = 0, capacity = 0;
+
+        if (list == NULL) {
+                perror(filename);
+                exit(EXIT_FAILURE);
+        }
+
+        while (fgets(line, sizeof(line), list) != NULL) {
+                char *image = strtok(line, " \t\n");
+                char *input = image == NULL ? NULL : strtok(NULL, " \t\n");
+
+                if (image == NULL || image[0] == '#')
+                        continue;
+
+                if (n == capacity) {
+                        capacity = capacity == 0 ? 64 : 2 * capacity;
+                        jobs = realloc(jobs, sizeof(job) * capacity);
+                }
+
+                job *j = &jobs[n];
+                memset(j, 0, sizeof(*j));
+                j->index = n++;
+                j->image = strdup(image);
+                j->input = input == NULL ? NULL : strdup(input);
+                j->infd = j->outfd = -1;
+                j->digest = FNV_SEED;
+        }
+
+        fclose(list);
+        *count = n;
+        return jobs;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-j threads] [-s slice] [-o outdir] "
+            "joblist\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        long long slice = DEFAULT_SLICE;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "j:s:o:")) != -1) {
+                switch (opt) {
+                case 'j':
+                        threads = atol(optarg);
+                        break;
+                case 's':
+                        slice = atoll(optarg);
+                        break;
+                case 'o':
+                        sched.outdir = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (optind + 1 != argc || threads < 1 || slice < 1)
+                usage(argv[0]);
+
+        unsigned njobs;
+        job *jobs = read_jobs(argv[optind], &njobs);
+        size_t ring = 1;
+
+        while (ring < njobs)
+                ring *= 2;
+
+        sched.nworkers = threads;
+        sched.slice = slice;
+        sched.workers = calloc(threads, sizeof(worker));
+        sched.parked = malloc(sizeof(job *) * (njobs + 1));
+        sched.nparked = 0;
+        pthread_mutex_init(&sched.parklock, NULL);
+        pthread_mutex_init(&sched.idlelock, NULL);
+        pthread_cond_init(&sched.wake, NULL);
+        atomic_init(&sched.remaining, njobs);
+
+        /* Deals the jobs out round-robin */
+        for (unsigned i = 0; i < sched.nworkers; i++) {
+                worker *w = &sched.workers[i];
+
+                w->id = i;
+                pthread_mutex_init(&w->jobs.lock, NULL);
+                w->jobs.slots = malloc(sizeof(job *) * ring);
+                w->jobs.mask = ring - 1;
+        }
+        for (unsigned i = 0; i < njobs; i++)
+                deque_push(&sched.workers[i % sched.nworkers].jobs, &jobs[i]);
+
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (unsigned i = 0; i < sched.nworkers; i++) {
+                if (pthread_create(&sched.workers[i].thread, NULL, work,
+                    &sched.workers[i]) != 0) {
+                        perror("um-batch: pthread_create");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        for (unsigned i = 0; i < sched.nworkers; i++)
+                pthread_join(sched.workers[i].thread, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        double wall = (stop.tv_sec - start.tv_sec) +
+            (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+        uint64_t total = 0, steals = 0;
+        unsigned failed = 0;
+
+        printf("# job\timage\tstatus\tinstructions\tcpu_s\tMinst/s\tslices\t"
+            "digest\tmessage\n");
+        for (unsigned i = 0; i < njobs; i++) {
+                job *j = &jobs[i];
+
+                printf("%u\t%s\t%s\t%llu\t%.3f\t%.1f\t%u\t%016llx\t%s\n",
+                    j->index, j->image,
+                    j->state == JOB_HALTED ? "halted" : "failed",
+                    (unsigned long long)j->instructions, j->seconds,
+                    j->seconds > 0 ? j->instructions / j->seconds / 1e6 : 0,
+                    j->slices, (unsigned long long)j->digest, j->message);
+                total += j->instructions;
+                failed += j->state != JOB_HALTED;
+                free(j->image);
+                free(j->input);
+        }
+
+        for (unsigned i = 0; i < sched.nworkers; i++) {
+                steals += sched.workers[i].steals;
+                free(sched.workers[i].jobs.slots);
+        }
+
+        fprintf(stderr, "%u jobs (%u failed) on %u threads: %.3fs, %llu "
+            "instructions, %.1f Minst/s, %llu steals\n", njobs, failed,
+            sched.nworkers, wall, (unsigned long long)total,
+            wall > 0 ? total / wall / 1e6 : 0,
+            (unsigned long long)steals);
+
+        free(jobs);
+        free(sched.workers);
+        free(sched.parked);
+
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,35 @@
+/* um-format.h: the layout of the files um writes besides plain .um images,
+ * native images and snapshots, for um and the tools that read them.
+ */
+
+#ifndef UM_FORMAT_H
+#define UM_FORMAT_H
+
+#include <stdint.h>
+
+/* First word of a native-endian image, in host byte order. The second word
+ * holds the number of program words that follow, so the mapped file is
+ * laid out exactly like a segment with its header.
+ */
+#define NATIVE_MAGIC 0x314e4d55u
+
+/* First word of a snapshot, in host byte order. The header is followed by
+ * the segment table as 64-bit word offsets into the file (0 for an unmapped
+ * identifier), the free-identifier stack, the output written before the
+ * snapshot padded to whole words, and then each segment's storage with its
+ * header, so a restore maps the file and points the table into it.
+ */
+#define SNAPSHOT_MAGIC 0x31534d55u
+
+typedef struct snapshot_header {
+        uint32_t magic;
+        uint32_t prog_count;
+        uint32_t registers[8];
+        uint32_t memlength;
+        uint32_t freecount;
+        uint32_t outputbytes;
+        uint32_t reserved;
+        uint64_t words;
+} snapshot_header;
+
+#endif
@@ -0,0 +1,436 @@
+/* um-pool: serves an image from a pool of pre-booted processes. The image
+ * is run once, through libum, up to its boot point: the first input
+ * instruction, or a set number of instructions with -b. The booted process
+ * then forks clones, which share its memory copy-on-write, so a session
+ * starts with the program's segments already decompressed in place of
+ * running its boot again. Each clone waits on the Unix domain socket for
+ * one connection, replays the boot's output to it, runs the session with
+ * the socket as input and output, and exits. The pool keeps clones
+ * clones waiting (default 4) and forks a new one whenever one exits,
+ * unless several in a row exit before taking a connection.
+ *
+ * It reports on stderr how long each clone took to be ready after fork,
+ * and, from /proc/pid/smaps_rollup where the kernel has it, how much of a
+ * clone's memory is shared with the pool and how much is its own, once at
+ * spawn and again when its session ends.
+ *
+ * Usage: um-pool [-c clones] [-b instructions] socket image
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "um.h"
+#include "listener.h"
+
+#define DEFAULT_CLONES 4
+#define MAX_CLONES 4096
+#define BUF_BYTES 4096
+
+/* Instructions a clone runs between checks that its client is still there */
+#define SESSION_SLICE 1000000
+
+/* Exit status of a clone that never took a connection. The pool stops
+ * after MAX_UNSERVED of them in a row instead of forking clones that can
+ * only fail.
+ */
+#define EXIT_UNSERVED 2
+#define MAX_UNSERVED 8
+
+/* Where a machine's input and output go: nowhere during boot, so the
+ * first input blocks, and the connection's socket in a clone
+ */
+typedef struct pool_io {
+        int fd;
+
+        unsigned char inbuf[BUF_BYTES];
+        size_t inpos;
+        size_t inlen;
+
+        unsigned char *out;
+        size_t outlen;
+        size_t outcap;
+
+        /* Set once the client has gone: output is dropped from then on */
+        bool gone;
+} pool_io;
+
+/* Memory of a process as smaps_rollup splits it, in kB */
+typedef struct mem_split {
+        bool known;
+        unsigned long rss;
+        unsigned long shared;
+        unsigned long private;
+} mem_split;
+
+static pool_io pio = { .fd = -1 };
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Function: flush_output
+ * Does: Writes buffered output to the connection. Boot output is kept
+ *       until there is a connection to give it to.
+ * Paramters: None
+ * Returns: false if the connection failed, which drops the output
+ */
+static bool flush_output(void)
+{
+        size_t done = 0;
+
+        if (pio.gone)
+                return false;
+        if (pio.fd < 0)
+                return true;
+
+        while (done < pio.outlen) {
+                ssize_t n = write(pio.fd, pio.out + done, pio.outlen - done);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0) {
+                        pio.outlen = 0;
+                        pio.gone = true;
+                        return false;
+                }
+                done += n;
+        }
+
+        pio.outlen = 0;
+        return true;
+}
+
+static int pool_input(void *context)
+{
+        (void)context;
+
+        if (pio.fd < 0)
+                return UM_INPUT_BLOCKED;
+        if (pio.gone)
+                return UM_INPUT_EOF;
+
+        if (pio.inpos == pio.inlen) {
+                ssize_t n;
+
+                /* The client sees everything before it is asked for more */
+                flush_output();
+                do {
+                        n = read(pio.fd, pio.inbuf, BUF_BYTES);
+                } while (n < 0 && errno == EINTR);
+
+                if (n <= 0)
+                        return UM_INPUT_EOF;
+                pio.inpos = 0;
+                pio.inlen = n;
+        }
+
+        return pio.inbuf[pio.inpos++];
+}
+
+static void pool_output(void *context, unsigned char byte)
+{
+        (void)context;
+
+        if (pio.gone)
+                return;
+        if (pio.outlen == pio.outcap) {
+                if (pio.fd >= 0 && pio.outlen >= BUF_BYTES) {
+                        if (!flush_output())
+                                return;
+                } else {
+                        size_t cap = pio.outcap == 0 ? BUF_BYTES :
+                            2 * pio.outcap;
+                        unsigned char *out = realloc(pio.out, cap);
+
+                        if (out == NULL) {
+                                fprintf(stderr, "um-pool: out of memory "
+                                    "for output\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        pio.out = out;
+                        pio.outcap = cap;
+                }
+        }
+        pio.out[pio.outlen++] = byte;
+}
+
+/* Function: read_split
+ * Does: Reads a process's shared and private memory from smaps_rollup
+ * Paramters: pid_t
+ * Returns: the split, with known false if the file could not be read
+ */
+static mem_split read_split(pid_t pid)
+{
+        mem_split split = { false, 0, 0, 0 };
+        char path[64], line[256];
+
+        snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL)
+                return split;
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                char name[64];
+                unsigned long kb;
+
+                if (sscanf(line, "%63[^:]: %lu kB", name, &kb) != 2)
+                        continue;
+                if (strcmp(name, "Rss") == 0) {
+                        split.rss = kb;
+                        split.known = true;
+                } else if (strncmp(name, "Shared_", 7) == 0) {
+                        split.shared += kb;
+                } else if (strncmp(name, "Private_", 8) == 0) {
+                        split.private += kb;
+                }
+        }
+
+        fclose(fp);
+        return split;
+}
+
+static void print_split(const char *what, mem_split split)
+{
+        if (!split.known) {
+                fprintf(stderr, " %s -", what);
+                return;
+        }
+
+        fprintf(stderr, " %s rss %lu kB shared %lu kB private %lu kB", what,
+            split.rss, split.shared, split.private);
+}
+
+/* Function: serve
+ * Does: Runs in a clone: takes one connection and runs the booted machine
+ *       against it to the end. Never returns.
+ * Paramters: um_machine*, int, int
+ * Returns: None
+ */
+static void serve(um_machine *machine, int listener, int ready)
+{
+        uint64_t booted = um_instructions(machine);
+        int fd;
+
+        /* Tells the pool this clone is ready to take a connection */
+        char byte = 0;
+        if (write(ready, &byte, 1) != 1)
+                _exit(EXIT_UNSERVED);
+        close(ready);
+
+        do {
+                fd = accept(listener, NULL, NULL);
+        } while (fd < 0 && errno == EINTR);
+        if (fd < 0) {
+                perror("um-pool: accept");
+                _exit(EXIT_UNSERVED);
+        }
+        close(listener);
+
+        double start = now();
+        um_status status;
+
+        /* Runs in slices so a session whose client has gone is stopped */
+        pio.fd = fd;
+        do {
+                status = um_run(machine, SESSION_SLICE);
+        } while (status == UM_BUDGET && !pio.gone);
+        flush_output();
+        close(fd);
+
+        fprintf(stderr, "session %d: %s after %llu instructions in %.3f s,",
+            (int)getpid(), pio.gone ? "client gone" :
+            status == UM_HALTED ? "halted" : "failed",
+            (unsigned long long)(um_instructions(machine) - booted),
+            now() - start);
+        if (status == UM_FAILED)
+                fprintf(stderr, " %s,", um_last_error(machine)->message);
+        print_split("memory", read_split(getpid()));
+        fprintf(stderr, "\n");
+
+        _exit(status == UM_HALTED ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Function: spawn
+ * Does: Forks a clone of the booted machine and waits for it to be ready
+ * Paramters: um_machine*, int
+ * Returns: the clone's pid
+ */
+static pid_t spawn(um_machine *machine, int listener)
+{
+        int ready[2];
+
+        if (pipe(ready) != 0) {
+                perror("um-pool: pipe");
+                exit(EXIT_FAILURE);
+        }
+
+        double start = now();
+        pid_t pid = fork();
+
+        if (pid < 0) {
+                perror("um-pool: fork");
+                exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+                /* Clones go with the pool */
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                if (getppid() == 1)
+                        _exit(EXIT_FAILURE);
+                close(ready[0]);
+                serve(machine, listener, ready[1]);
+        }
+
+        char byte;
+        close(ready[1]);
+        ssize_t n = read(ready[0], &byte, 1);
+        double latency = now() - start;
+        close(ready[0]);
+
+        fprintf(stderr, "clone %d: %s in %.3f ms,", (int)pid,
+            n == 1 ? "ready" : "failed to start", latency * 1000);
+        print_split("memory", read_split(pid));
+        fprintf(stderr, "\n");
+
+        return pid;
+}
+
+/* Function: boot
+ * Does: Makes a machine from the image file and runs it to its boot point
+ * Paramters: const char*, uint64_t
+ * Returns: the booted machine
+ */
+static um_machine *boot(const char *filename, uint64_t instructions)
+{
+        int fd = open(filename, O_RDONLY);
+        struct stat sb;
+
+        if (fd < 0 || fstat(fd, &sb) != 0) {
+                perror(filename);
+                exit(EXIT_FAILURE);
+        }
+
+        void *image = sb.st_size == 0 ? NULL : mmap(NULL, sb.st_size,
+            PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (image == MAP_FAILED) {
+                perror(filename);
+                exit(EXIT_FAILURE);
+        }
+
+        um_io io = { pool_input, pool_output, NULL };
+        um_error error;
+        um_machine *machine = um_create(image, sb.st_size, &io, &error);
+
+        if (image != NULL)
+                munmap(image, sb.st_size);
+        if (machine == NULL) {
+                fprintf(stderr, "um-pool: %s\n", error.message);
+                exit(EXIT_FAILURE);
+        }
+
+        double start = now();
+        um_status status = um_run(machine,
+            instructions == 0 ? UINT64_MAX : instructions);
+
+        if (status == UM_HALTED || status == UM_FAILED) {
+                fprintf(stderr, "um-pool: %s %s before its boot point\n",
+                    filename, status == UM_HALTED ? "halted" : "failed");
+                exit(EXIT_FAILURE);
+        }
+
+        fprintf(stderr, "booted %s: %llu instructions in %.3f s, %zu bytes "
+            "of output,", filename,
+            (unsigned long long)um_instructions(machine), now() - start,
+            pio.outlen);
+        print_split("memory", read_split(getpid()));
+        fprintf(stderr, "\n");
+
+        return machine;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-c clones] [-b instructions] socket "
+            "image\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+        long long clones = DEFAULT_CLONES;
+        long long instructions = 0;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "c:b:")) != -1) {
+                switch (opt) {
+                case 'c':
+                        clones = atoll(optarg);
+                        break;
+                case 'b':
+                        instructions = atoll(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (optind + 2 != argc || clones < 1 || clones > MAX_CLONES ||
+            instructions < 0)
+                usage(argv[0]);
+
+        signal(SIGPIPE, SIG_IGN);
+        um_machine *machine = boot(argv[optind + 1], instructions);
+        int listener = open_listener(argv[optind], 0, "um-pool");
+
+        for (long long i = 0; i < clones; i++)
+                spawn(machine, listener);
+
+        /* Keeps the pool full: every clone that exits is replaced, until
+         * too many in a row exit without serving anyone */
+        int unserved = 0;
+
+        for (;;) {
+                int wstatus;
+                pid_t pid = wait(&wstatus);
+
+                if (pid < 0 && errno == EINTR)
+                        continue;
+                if (pid < 0) {
+                        perror("um-pool: wait");
+                        exit(EXIT_FAILURE);
+                }
+
+                if (WIFEXITED(wstatus) &&
+                    WEXITSTATUS(wstatus) == EXIT_UNSERVED)
+                        unserved++;
+                else
+                        unserved = 0;
+                if (unserved == MAX_UNSERVED) {
+                        fprintf(stderr, "um-pool: %d clones in a row exited "
+                            "before taking a connection; stopping\n",
+                            unserved);
+                        exit(EXIT_FAILURE);
+                }
+
+                spawn(machine, listener);
+        }
+}
@@ -0,0 +1,659 @@
+/* um-prof: reads a report written by um --profile and the program it ran,
+ * splits segment 0 into basic blocks at the start of the program, after
+ * every halt and load_program, and at every load_program target the
+ * profile saw or the code names, and prints the hottest blocks as annotated
+ * disassembly with each instruction's execution count and share of the
+ * run. Loops are recovered from load_programs whose target can be worked
+ * out from the load_values and conditional moves before them in their
+ * block and that jump back to an earlier block.
+ *
+ * The program is a .um image, a native image from --save-native, or a
+ * snapshot from --snapshot. A program that loads another segment runs code
+ * the image does not hold. A snapshot taken after that load, such as
+ * advent's at its first input, holds the right code, and profiling a
+ * --restore of it counts only that code.
+ *
+ * Usage: um-prof [-n blocks] report program
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "um-format.h"
+
+#define DEFAULT_BLOCKS 10
+
+/* Disassembly lines shown for one block before the rest are elided */
+#define MAX_LINES 40
+
+typedef struct block {
+        uint32_t start;
+        uint32_t end;
+        uint64_t entries;
+        uint64_t instructions;
+} block;
+
+/* A back edge from the load_program at tail to head, and the blocks on a 
+ * path from one to the other
+ */
+typedef struct loop {
+        uint32_t head;
+        uint32_t tail;
+        uint32_t blocks;
+        uint64_t instructions;
+} loop;
+
+static const char *const mnemonics[16] = {
+        "cmov", "sload", "sstore", "add", "mul", "div", "nand", "halt",
+        "map", "unmap", "out", "in", "loadp", "loadv", "op14", "op15"
+};
+
+/* Constants a register may hold at a load_program, up to this many */
+#define MAX_VALUES 8
+
+typedef struct values {
+        unsigned count;
+        bool known;
+        uint32_t value[MAX_VALUES];
+} values;
+
+/* The blocks in program order, the block of each pc, and the targets of 
+ * the load_program ending at each pc when they are known
+ */
+typedef struct cfg {
+        const uint32_t *prog;
+        uint32_t length;
+        const block *blocks;
+        uint32_t nblocks;
+        const uint32_t *blockof;
+        const values *exits;
+        unsigned char *forward;
+        unsigned char *backward;
+} cfg;
+
+/* Function: read_file
+ * Does: Reads a whole file into memory
+ * Paramters: const char*, size_t*
+ * Returns: the bytes, which the caller frees
+ */
+static unsigned char *read_file(const char *filename, size_t *bytes)
+{
+        FILE *in = fopen(filename, "rb");
+        unsigned char *data = NULL;
+        size_t length = 0, capacity = 0, n;
+
+        if (in == NULL) {
+                perror(filename);
+                exit(EXIT_FAILURE);
+        }
+
+        do {
+                if (length == capacity) {
+                        capacity = capacity == 0 ? 65536 : 2 * capacity;
+                        data = realloc(data, capacity);
+                }
+                n = fread(data + length, 1, capacity - length, in);
+                length += n;
+        } while (n > 0);
+
+        fclose(in);
+        *bytes = length;
+        return data;
+}
+
+/* Function: load_program
+ * Does: Finds segment 0 in an image, native image or snapshot
+ * Paramters: const char*, uint32_t*
+ * Returns: the program's words in host order
+ */
+static uint32_t *load_program(const char *filename, uint32_t *length)
+{
+        size_t bytes;
+        unsigned char *data = read_file(filename, &bytes);
+        size_t words = bytes / 4;
+        uint32_t first = 0;
+        uint32_t *prog;
+
+        if (bytes % 4 != 0) {
+                fprintf(stderr, "%s: not a UM program\n", filename);
+                exit(EXIT_FAILURE);
+        }
+        if (words > 0)
+                memcpy(&first, data, sizeof(first));
+
+        if (first == NATIVE_MAGIC && words >= 2) {
+                uint32_t header[2];
+
+                memcpy(header, data, sizeof(header));
+                *length = header[1] <= words - 2 ? header[1] : words - 2;
+                prog = malloc(sizeof(uint32_t) * (*length + 1));
+                memcpy(prog, data + 8, sizeof(uint32_t) * *length);
+        } else if (first == SNAPSHOT_MAGIC &&
+            bytes >= sizeof(snapshot_header) + sizeof(uint64_t)) {
+                uint64_t offset;
+                uint32_t header[2];
+
+                memcpy(&offset, data + sizeof(snapshot_header),
+                    sizeof(offset));
+                if (offset == 0 || offset > words - 2) {
+                        fprintf(stderr, "%s: snapshot has no program\n",
+                            filename);
+                        exit(EXIT_FAILURE);
+                }
+                memcpy(header, data + 4 * offset, sizeof(header));
+                *length = header[1] <= words - 2 - offset ? header[1] :
+                    (uint32_t)(words - 2 - offset);
+                prog = malloc(sizeof(uint32_t) * (*length + 1));
+                memcpy(prog, data + 4 * (offset + 2),
+                    sizeof(uint32_t) * *length);
+        } else {
+                /* UM images are big-endian */
+                *length = words;
+                prog = malloc(sizeof(uint32_t) * (words + 1));
+                for (size_t i = 0; i < words; i++)
+                        prog[i] = (uint32_t)data[4 * i] << 24 |
+                            (uint32_t)data[4 * i + 1] << 16 |
+                            (uint32_t)data[4 * i + 2] << 8 |
+                            data[4 * i + 3];
+        }
+
+        free(data);
+        return prog;
+}
+
+/* Function: read_profile
+ * Does: Reads the per-pc and per-block counts of a profile report
+ * Paramters: const char*, uint32_t, uint64_t*, uint64_t*, uint64_t*,
+ *            uint64_t*
+ * Returns: the number of loads of other segments
+ */
+static uint64_t read_profile(const char *filename, uint32_t length,
+    uint64_t *pcs, uint64_t *blocks, uint64_t *total, uint64_t *outside)
+{
+        FILE *in = fopen(filename, "r");
+        char line[256];
+        unsigned long long pc, count, loads = 0;
+
+        if (in == NULL) {
+                perror(filename);
+                exit(EXIT_FAILURE);
+        }
+        if (fgets(line, sizeof(line), in) == NULL ||
+            strcmp(line, "# um profile\n") != 0) {
+                fprintf(stderr, "%s: not a um profile\n", filename);
+                exit(EXIT_FAILURE);
+        }
+
+        *total = 0;
+        *outside = 0;
+        while (fgets(line, sizeof(line), in) != NULL) {
+                if (sscanf(line, "pc %llu %llu", &pc, &count) == 2) {
+                        if (pc < length)
+                                pcs[pc] = count;
+                        else
+                                *outside += count;
+                } else if (sscanf(line, "block %llu %llu", &pc, &count)
+                    == 2) {
+                        if (pc < length)
+                                blocks[pc] = count;
+                } else if (sscanf(line, "instructions %llu", &count) == 1) {
+                        *total = count;
+                } else if (sscanf(line, "load_program load %llu", &count)
+                    == 1) {
+                        loads = count;
+                }
+        }
+        fclose(in);
+
+        if (loads > 0)
+                fprintf(stderr, "Warning: the program loaded other "
+                    "segments %llu times; counts from that code are "
+                    "shown against this program's words\n", loads);
+
+        return loads;
+}
+
+static inline unsigned opcode_of(uint32_t word)
+{
+        return word >> 28;
+}
+
+/* Function: disassemble
+ * Does: Writes one instruction, with the field layout of decode_word
+ * Paramters: FILE*, uint32_t
+ * Returns: None
+ */
+static void disassemble(FILE *out, uint32_t word)
+{
+        unsigned opcode = opcode_of(word);
+        unsigned a = (word >> 6) & 7, b = (word >> 3) & 7, c = word & 7;
+
+        fprintf(out, "%-6s ", mnemonics[opcode]);
+        switch (opcode) {
+        case 0:
+                fprintf(out, "r%u <- r%u if r%u", a, b, c);
+                break;
+        case 1:
+                fprintf(out, "r%u <- [r%u][r%u]", a, b, c);
+                break;
+        case 2:
+                fprintf(out, "[r%u][r%u] <- r%u", a, b, c);
+                break;
+        case 3:
+                fprintf(out, "r%u <- r%u + r%u", a, b, c);
+                break;
+        case 4:
+                fprintf(out, "r%u <- r%u * r%u", a, b, c);
+                break;
+        case 5:
+                fprintf(out, "r%u <- r%u / r%u", a, b, c);
+                break;
+        case 6:
+                fprintf(out, "r%u <- ~(r%u & r%u)", a, b, c);
+                break;
+        case 8:
+                fprintf(out, "r%u <- new segment of r%u words", b, c);
+                break;
+        case 9:
+        case 10:
+        case 11:
+                fprintf(out, "r%u", c);
+                break;
+        case 12:
+                fprintf(out, "segment r%u, pc r%u", b, c);
+                break;
+        case 13:
+                fprintf(out, "r%u <- %u", (word >> 25) & 7,
+                    word & 0x1ffffff);
+                break;
+        default:
+                break;
+        }
+}
+
+/* Function: targets
+ * Does: Works out where a block's closing load_program can jump within
+ *       segment 0, following load_values and conditional moves through
+ *       the block. The segment must be loaded as 0 in the block unless 
+ *       jumps_only says the run never loaded another segment.
+ * Paramters: const uint32_t*, const block*, bool, values*
+ * Returns: whether the targets are known; they are left in the values
+ */
+static bool targets(const uint32_t *prog, const block *b, bool jumps_only, 
+    values *found)
+{
+        values regs[8];
+
+        memset(regs, 0, sizeof(regs));
+        for (uint32_t pc = b->start; pc <= b->end; pc++) {
+                uint32_t word = prog[pc];
+                unsigned opcode = opcode_of(word);
+                unsigned a = (word >> 6) & 7, bb = (word >> 3) & 7;
+                unsigned c = word & 7;
+
+                switch (opcode) {
+                case 13: {
+                        values *r = &regs[(word >> 25) & 7];
+
+                        r->known = true;
+                        r->count = 1;
+                        r->value[0] = word & 0x1ffffff;
+                        break;
+                }
+                case 0: {
+                        values *r = &regs[a], *from = &regs[bb];
+
+                        if (!r->known || !from->known) {
+                                r->known = false;
+                                break;
+                        }
+                        for (unsigned i = 0; i < from->count; i++) {
+                                bool have = false;
+
+                                for (unsigned j = 0; j < r->count; j++)
+                                        have |= r->value[j] ==
+                                            from->value[i];
+                                if (have)
+                                        continue;
+                                if (r->count == MAX_VALUES) {
+                                        r->known = false;
+                                        break;
+                                }
+                                r->value[r->count++] = from->value[i];
+                        }
+                        break;
+                }
+                case 12:
+                        if (pc != b->end || !regs[c].known)
+                                return false;
+                        if (!jumps_only && (!regs[bb].known || 
+                            regs[bb].count != 1 || regs[bb].value[0] != 0))
+                                return false;
+                        *found = regs[c];
+                        return true;
+                case 1: case 3: case 4: case 5: case 6:
+                        regs[a].known = false;
+                        break;
+                case 8:
+                        regs[bb].known = false;
+                        break;
+                case 11:
+                        regs[c].known = false;
+                        break;
+                default:
+                        break;
+                }
+        }
+
+        return false;
+}
+
+/* Function: split_blocks
+ * Does: Cuts the program into blocks at its leaders, totalling each 
+ *       block's instructions and entries
+ * Paramters: uint32_t, const bool*, const uint64_t*, block*
+ * Returns: the number of blocks
+ */
+static uint32_t split_blocks(uint32_t length, const bool *leader, 
+    const uint64_t *pcs, block *blocks)
+{
+        uint32_t nblocks = 0;
+
+        for (uint32_t pc = 0; pc < length; ) {
+                block *b = &blocks[nblocks++];
+
+                b->start = pc;
+                b->instructions = pcs[pc];
+                while (++pc < length && !leader[pc])
+                        b->instructions += pcs[pc];
+                b->end = pc - 1;
+                b->entries = pcs[b->start];
+        }
+
+        return nblocks;
+}
+
+/* Function: successors
+ * Does: Lists the blocks control can pass to from the given one: the next 
+ *       block, nothing after a halt, or a load_program's known targets
+ * Paramters: const cfg*, uint32_t, uint32_t*
+ * Returns: the number of successors
+ */
+static unsigned successors(const cfg *graph, uint32_t i, uint32_t *next)
+{
+        uint32_t end = graph->blocks[i].end;
+        unsigned opcode = opcode_of(graph->prog[end]);
+        const values *exit = &graph->exits[end];
+        unsigned count = 0;
+
+        if (opcode == 7)
+                return 0;
+
+        if (opcode != 12) {
+                if (i + 1 < graph->nblocks)
+                        next[count++] = i + 1;
+                return count;
+        }
+
+        for (unsigned t = 0; exit->known && t < exit->count; t++) {
+                if (exit->value[t] < graph->length)
+                        next[count++] = graph->blockof[exit->value[t]];
+        }
+        return count;
+}
+
+/* Function: loop_body
+ * Does: Finds the blocks between a loop's head and tail that are reached 
+ *       from the head and reach the tail, and totals their instructions. 
+ *       Jumps to unknown targets are left out.
+ * Paramters: cfg*, loop*
+ * Returns: None
+ */
+static void loop_body(cfg *graph, loop *l)
+{
+        uint32_t head = graph->blockof[l->head];
+        uint32_t tail = graph->blockof[l->tail];
+        uint32_t next[MAX_VALUES];
+        bool changed = true;
+
+        memset(graph->forward + head, 0, tail - head + 1);
+        memset(graph->backward + head, 0, tail - head + 1);
+
+        /* Blocks are in program order, so one pass reaches every block 
+         * that is entered from an earlier one; later passes follow jumps 
+         * back. Walking backwards, a pass repeats after any new mark.
+         */
+        graph->forward[head] = 1;
+        while (changed) {
+                changed = false;
+                for (uint32_t i = head; i <= tail; i++) {
+                        if (!graph->forward[i])
+                                continue;
+                        unsigned n = successors(graph, i, next);
+
+                        for (unsigned k = 0; k < n; k++) {
+                                if (next[k] >= head && next[k] <= tail && 
+                                    !graph->forward[next[k]]) {
+                                        graph->forward[next[k]] = 1;
+                                        changed |= next[k] < i;
+                                }
+                        }
+                }
+        }
+
+        graph->backward[tail] = 1;
+        changed = true;
+        while (changed) {
+                changed = false;
+                for (uint32_t i = tail; i-- > head; ) {
+                        unsigned n = successors(graph, i, next);
+
+                        for (unsigned k = 0; k < n && !graph->backward[i]; 
+                            k++) {
+                                if (next[k] >= head && next[k] <= tail && 
+                                    graph->backward[next[k]]) {
+                                        graph->backward[i] = 1;
+                                        changed = true;
+                                }
+                        }
+                }
+        }
+
+        l->blocks = 0;
+        l->instructions = 0;
+        for (uint32_t i = head; i <= tail; i++) {
+                if (graph->forward[i] && graph->backward[i]) {
+                        l->blocks++;
+                        l->instructions += graph->blocks[i].instructions;
+                }
+        }
+}
+
+static int by_instructions(const void *x, const void *y)
+{
+        uint64_t a = ((const block *)x)->instructions;
+        uint64_t b = ((const block *)y)->instructions;
+
+        return (a < b) - (a > b);
+}
+
+static int loops_by_instructions(const void *x, const void *y)
+{
+        uint64_t a = ((const loop *)x)->instructions;
+        uint64_t b = ((const loop *)y)->instructions;
+
+        return (a < b) - (a > b);
+}
+
+static double share(uint64_t count, uint64_t total)
+{
+        return total == 0 ? 0 : 100.0 * count / total;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-n blocks] report program\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+        unsigned shown = DEFAULT_BLOCKS;
+        int first = 1;
+
+        if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+                shown = atoi(argv[2]);
+                first = 3;
+        }
+        if (argc - first != 2 || shown == 0)
+                usage(argv[0]);
+
+        uint32_t length;
+        uint32_t *prog = load_program(argv[first + 1], &length);
+        uint64_t *pcs = calloc((size_t)length + 1, sizeof(uint64_t));
+        uint64_t *entries = calloc((size_t)length + 1, sizeof(uint64_t));
+        bool *leader = calloc((size_t)length + 1, sizeof(bool));
+        uint64_t total, outside;
+
+        bool jumps_only = read_profile(argv[first], length, pcs, entries, 
+            &total, &outside) == 0;
+
+        /* Blocks start at 0, after every halt and load_program, and at 
+         * every target the profile saw
+         */
+        for (uint32_t pc = 0; pc < length; pc++) {
+                unsigned opcode = opcode_of(prog[pc]);
+
+                if (opcode == 7 || opcode == 12)
+                        leader[pc + 1] = true;
+                if (entries[pc] != 0)
+                        leader[pc] = true;
+        }
+        if (length > 0)
+                leader[0] = true;
+
+        /* The targets a block's load_program names start blocks too. 
+         * Cutting a block at one can leave the load_values that named 
+         * another in the block before it, whose registers a jump into the 
+         * new block does not set, so targets are only taken from within 
+         * a block and the program is cut again until no new target turns 
+         * up.
+         */
+        block *blocks = malloc(sizeof(block) * ((size_t)length + 1));
+        values *exits = calloc((size_t)length + 1, sizeof(values));
+        uint32_t nblocks;
+        bool cut = true;
+
+        while (cut) {
+                cut = false;
+                nblocks = split_blocks(length, leader, pcs, blocks);
+
+                for (uint32_t i = 0; i < nblocks; i++) {
+                        values *found = &exits[blocks[i].end];
+
+                        if (!targets(prog, &blocks[i], jumps_only, found)) {
+                                found->known = false;
+                                continue;
+                        }
+                        for (unsigned t = 0; t < found->count; t++) {
+                                uint32_t head = found->value[t];
+
+                                if (head < length && !leader[head]) {
+                                        leader[head] = true;
+                                        cut = true;
+                                }
+                        }
+                }
+        }
+
+        /* Targets at or before their load_program are back edges */
+        loop *loops = malloc(sizeof(loop) * ((size_t)nblocks * MAX_VALUES 
+            + 1));
+        uint32_t nloops = 0;
+
+        for (uint32_t i = 0; i < nblocks; i++) {
+                const values *found = &exits[blocks[i].end];
+
+                for (unsigned t = 0; found->known && t < found->count; t++) {
+                        uint32_t head = found->value[t];
+
+                        if (head < length && head <= blocks[i].end)
+                                loops[nloops++] = (loop){ head, 
+                                    blocks[i].end, 0, 0 };
+                }
+        }
+
+        uint32_t *blockof = malloc(sizeof(uint32_t) * ((size_t)length + 1));
+        cfg graph = { prog, length, blocks, nblocks, blockof, exits, 
+            calloc((size_t)nblocks + 1, 1), calloc((size_t)nblocks + 1, 1) };
+
+        for (uint32_t i = 0; i < nblocks; i++) {
+                for (uint32_t pc = blocks[i].start; pc <= blocks[i].end; pc++)
+                        blockof[pc] = i;
+        }
+        for (uint32_t i = 0; i < nloops; i++)
+                loop_body(&graph, &loops[i]);
+
+        qsort(blocks, nblocks, sizeof(block), by_instructions);
+        qsort(loops, nloops, sizeof(loop), loops_by_instructions);
+
+        printf("# %llu instructions, %u words, %u blocks, %u loops\n",
+            (unsigned long long)total, length, nblocks, nloops);
+        if (outside > 0)
+                printf("# %llu instructions (%.1f%%) ran past the end of "
+                    "this program\n", (unsigned long long)outside,
+                    share(outside, total));
+
+        printf("\n# hottest loops\n");
+        for (uint32_t i = 0; i < nloops && i < shown; i++) {
+                if (loops[i].instructions == 0)
+                        break;
+                printf("loop %u back from %u  %u blocks  %llu "
+                    "instructions  %.1f%%\n", loops[i].head, loops[i].tail,
+                    loops[i].blocks, 
+                    (unsigned long long)loops[i].instructions,
+                    share(loops[i].instructions, total));
+        }
+
+        printf("\n# hottest blocks\n");
+        for (uint32_t i = 0; i < nblocks && i < shown; i++) {
+                block *b = &blocks[i];
+
+                if (b->instructions == 0)
+                        break;
+
+                printf("\nblock %u-%u  %llu entries  %llu instructions  "
+                    "%.1f%%\n", b->start, b->end,
+                    (unsigned long long)b->entries,
+                    (unsigned long long)b->instructions,
+                    share(b->instructions, total));
+
+                for (uint32_t pc = b->start; pc <= b->end; pc++) {
+                        if (pc - b->start == MAX_LINES) {
+                                printf("    ... %u more\n", b->end - pc + 1);
+                                break;
+                        }
+                        printf("%10u %12llu %5.1f%%  ", pc,
+                            (unsigned long long)pcs[pc],
+                            share(pcs[pc], total));
+                        disassemble(stdout, prog[pc]);
+                        printf("\n");
+                }
+        }
+
+        free(prog);
+        free(pcs);
+        free(entries);
+        free(leader);
+        free(blocks);
+        free(loops);
+        free(blockof);
+        free(exits);
+        free(graph.forward);
+        free(graph.backward);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,454 @@
+/* um-server: serves a UM image to many clients over a Unix domain socket
+ * from one thread. Every connection gets its own machine made through
+ * libum, and an epoll loop shares the CPU between them in slices of a set
+ * number of instructions. A session whose input instruction finds no byte
+ * waiting is parked until its socket is readable, so idle sessions cost
+ * only their memory. Output is buffered and written as the socket accepts
+ * it; a session with too much unsent output waits for the client to catch
+ * up. The connection is closed when the program halts or fails.
+ *
+ * Usage: um-server [-s slice] [-v] socket image
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "um.h"
+#include "listener.h"
+
+#define DEFAULT_SLICE 100000
+#define MAX_EVENTS 256
+#define IN_BYTES 4096
+
+/* A session stops running once this much output is waiting to be sent */
+#define OUT_HIGH_WATER (256 * 1024)
+
+typedef struct session {
+        int fd;
+        unsigned id;
+        um_machine *machine;
+
+        unsigned char inbuf[IN_BYTES];
+        size_t inpos;
+        size_t inlen;
+        bool ineof;
+
+        unsigned char *out;
+        size_t outpos;
+        size_t outlen;
+        size_t outcap;
+
+        /* Waiting for input, queued to run, or done and flushing output */
+        bool blocked;
+        bool queued;
+        bool done;
+        struct session *next;
+
+        /* The socket events asked of epoll */
+        uint32_t events;
+} session;
+
+typedef struct server {
+        int epoll;
+        int listener;
+        const void *image;
+        size_t imagebytes;
+        uint64_t slice;
+        bool verbose;
+
+        /* Sessions ready to run, first to last */
+        session *head;
+        session *tail;
+
+        unsigned opened;
+        unsigned live;
+} server;
+
+static server srv;
+
+static int session_input(void *context)
+{
+        session *s = context;
+
+        if (s->inpos == s->inlen)
+                return s->ineof ? UM_INPUT_EOF : UM_INPUT_BLOCKED;
+
+        return s->inbuf[s->inpos++];
+}
+
+static void session_output(void *context, unsigned char byte)
+{
+        session *s = context;
+
+        if (s->outlen == s->outcap) {
+                s->outcap = s->outcap == 0 ? 4096 : 2 * s->outcap;
+                s->out = realloc(s->out, s->outcap);
+        }
+        s->out[s->outlen++] = byte;
+}
+
+/* Function: watch
+ * Does: Sets the socket events a session waits for: input until its end
+ *       while there is room to keep it, and room to write while output
+ *       is waiting. epoll is level-triggered, so input left unread would
+ *       otherwise wake the loop again at once.
+ * Paramters: session*
+ * Returns: None
+ */
+static void watch(session *s)
+{
+        bool room = s->inlen < IN_BYTES || s->inpos == s->inlen;
+        uint32_t events = (!s->ineof && room ? EPOLLIN | EPOLLRDHUP : 0) |
+            (s->outpos < s->outlen ? EPOLLOUT : 0);
+        struct epoll_event ev = { events, { .ptr = s } };
+
+        if (events == s->events)
+                return;
+
+        epoll_ctl(srv.epoll, EPOLL_CTL_MOD, s->fd, &ev);
+        s->events = events;
+}
+
+static void enqueue(session *s)
+{
+        if (s->queued || s->done)
+                return;
+
+        s->queued = true;
+        s->next = NULL;
+        if (srv.tail == NULL)
+                srv.head = s;
+        else
+                srv.tail->next = s;
+        srv.tail = s;
+}
+
+static session *dequeue(void)
+{
+        session *s = srv.head;
+
+        if (s != NULL) {
+                srv.head = s->next;
+                if (srv.head == NULL)
+                        srv.tail = NULL;
+                s->queued = false;
+        }
+
+        return s;
+}
+
+/* Function: close_session
+ * Does: Drops a session's connection and machine. A queued session is
+ *       only marked and freed when it comes off the queue.
+ * Paramters: session*
+ * Returns: None
+ */
+static void close_session(session *s)
+{
+        if (s->fd >= 0) {
+                epoll_ctl(srv.epoll, EPOLL_CTL_DEL, s->fd, NULL);
+                close(s->fd);
+                s->fd = -1;
+                srv.live--;
+
+                if (srv.verbose)
+                        fprintf(stderr, "session %u closed after %llu "
+                            "instructions\n", s->id,
+                            (unsigned long long)(s->machine == NULL ? 0 :
+                            um_instructions(s->machine)));
+        }
+
+        s->done = true;
+        if (s->queued)
+                return;
+
+        um_free(s->machine);
+        free(s->out);
+        free(s);
+}
+
+/* Function: flush
+ * Does: Writes as much waiting output as the socket takes
+ * Paramters: session*
+ * Returns: false if the connection failed and the session was closed
+ */
+static bool flush(session *s)
+{
+        while (s->outpos < s->outlen) {
+                ssize_t n = write(s->fd, s->out + s->outpos,
+                    s->outlen - s->outpos);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                if (n < 0) {
+                        close_session(s);
+                        return false;
+                }
+                s->outpos += n;
+        }
+
+        if (s->outpos == s->outlen)
+                s->outpos = s->outlen = 0;
+
+        /* A finished session goes once its output is out */
+        if (s->done && s->outlen == 0) {
+                close_session(s);
+                return false;
+        }
+
+        watch(s);
+        return true;
+}
+
+/* Function: fill
+ * Does: Reads what the client has sent into the session's input buffer
+ * Paramters: session*
+ * Returns: false if the connection failed and the session was closed
+ */
+static bool fill(session *s)
+{
+        if (s->inpos == s->inlen)
+                s->inpos = s->inlen = 0;
+
+        while (!s->ineof && s->inlen < IN_BYTES) {
+                ssize_t n = read(s->fd, s->inbuf + s->inlen,
+                    IN_BYTES - s->inlen);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                if (n < 0) {
+                        close_session(s);
+                        return false;
+                }
+                if (n == 0)
+                        s->ineof = true;
+                s->inlen += n;
+        }
+
+        return true;
+}
+
+/* Function: run_slice
+ * Does: Runs a session for one slice and decides where it goes next
+ * Paramters: session*
+ * Returns: None
+ */
+static void run_slice(session *s)
+{
+        um_status status = um_run(s->machine, srv.slice);
+
+        switch (status) {
+        case UM_BUDGET:
+                if (s->outlen - s->outpos < OUT_HIGH_WATER)
+                        enqueue(s);
+                break;
+        case UM_BLOCKED:
+                s->blocked = true;
+                break;
+        case UM_HALTED:
+                s->done = true;
+                break;
+        case UM_FAILED:
+                if (srv.verbose)
+                        fprintf(stderr, "session %u failed: %s\n", s->id,
+                            um_last_error(s->machine)->message);
+                s->done = true;
+                break;
+        }
+
+        flush(s);
+}
+
+/* Function: accept_sessions
+ * Does: Takes every waiting connection and makes a machine for each
+ * Paramters: None
+ * Returns: None
+ */
+static void accept_sessions(void)
+{
+        for (;;) {
+                int fd = accept(srv.listener, NULL, NULL);
+
+                if (fd < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                            errno != EINTR)
+                                perror("um-server: accept");
+                        if (errno == EINTR)
+                                continue;
+                        return;
+                }
+
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+                session *s = calloc(1, sizeof(*s));
+                um_io io = { session_input, session_output, s };
+                um_error error;
+
+                s->fd = fd;
+                s->id = srv.opened++;
+                s->machine = um_create(srv.image, srv.imagebytes, &io,
+                    &error);
+                srv.live++;
+
+                s->events = EPOLLIN | EPOLLRDHUP;
+                struct epoll_event ev = { s->events, { .ptr = s } };
+                epoll_ctl(srv.epoll, EPOLL_CTL_ADD, fd, &ev);
+
+                if (s->machine == NULL) {
+                        fprintf(stderr, "um-server: %s\n", error.message);
+                        close_session(s);
+                        continue;
+                }
+
+                if (srv.verbose)
+                        fprintf(stderr, "session %u opened, %u live\n",
+                            s->id, srv.live);
+                enqueue(s);
+        }
+}
+
+/* Function: handle
+ * Does: Acts on the socket events of one session
+ * Paramters: session*, uint32_t
+ * Returns: None
+ */
+static void handle(session *s, uint32_t events)
+{
+        if (s->fd < 0)
+                return;
+
+        if (events & EPOLLOUT) {
+                bool full = s->outlen - s->outpos >= OUT_HIGH_WATER;
+
+                if (!flush(s))
+                        return;
+                if (full && !s->blocked)
+                        enqueue(s);
+        }
+
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (!fill(s))
+                        return;
+                if (s->ineof && s->done && s->outlen == 0) {
+                        close_session(s);
+                        return;
+                }
+                if (s->blocked && (s->inpos < s->inlen || s->ineof)) {
+                        s->blocked = false;
+                        enqueue(s);
+                }
+
+                /* Hangup is reported whatever is watched: the client has
+                 * gone both ways, so nothing more can reach it
+                 */
+                if (events & (EPOLLERR | EPOLLHUP)) {
+                        close_session(s);
+                        return;
+                }
+                watch(s);
+        }
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-s slice] [-v] socket image\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+        long long slice = DEFAULT_SLICE;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "s:v")) != -1) {
+                switch (opt) {
+                case 's':
+                        slice = atoll(optarg);
+                        break;
+                case 'v':
+                        srv.verbose = true;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (optind + 2 != argc || slice < 1)
+                usage(argv[0]);
+
+        int fd = open(argv[optind + 1], O_RDONLY);
+        struct stat sb;
+
+        if (fd < 0 || fstat(fd, &sb) != 0) {
+                perror(argv[optind + 1]);
+                exit(EXIT_FAILURE);
+        }
+        srv.imagebytes = sb.st_size;
+        srv.image = sb.st_size == 0 ? NULL : mmap(NULL, sb.st_size,
+            PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (srv.image == MAP_FAILED) {
+                perror(argv[optind + 1]);
+                exit(EXIT_FAILURE);
+        }
+
+        srv.slice = slice;
+        srv.listener = open_listener(argv[optind],
+            SOCK_NONBLOCK | SOCK_CLOEXEC, "um-server");
+        srv.epoll = epoll_create1(EPOLL_CLOEXEC);
+        signal(SIGPIPE, SIG_IGN);
+
+        struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+        if (srv.epoll < 0 || epoll_ctl(srv.epoll, EPOLL_CTL_ADD,
+            srv.listener, &ev) != 0) {
+                perror("um-server: epoll");
+                exit(EXIT_FAILURE);
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+
+        for (;;) {
+                /* Only waits when no session is ready to run */
+                int n = epoll_wait(srv.epoll, events, MAX_EVENTS,
+                    srv.head == NULL ? -1 : 0);
+
+                if (n < 0 && errno != EINTR) {
+                        perror("um-server: epoll_wait");
+                        exit(EXIT_FAILURE);
+                }
+
+                for (int i = 0; i < n; i++) {
+                        if (events[i].data.ptr == NULL)
+                                accept_sessions();
+                        else
+                                handle(events[i].data.ptr, events[i].events);
+                }
+
+                /* Gives every session that was ready one slice */
+                for (session *last = srv.tail, *s = NULL; last != NULL &&
+                    s != last; ) {
+                        s = dequeue();
+                        if (s->done && s->fd < 0)
+                                close_session(s);
+                        else
+                                run_slice(s);
+                }
+        }
+}
@@ -2,33 +2,452 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "except.h"
 #include "assert.h"
+#include "um.h"
+#include "um-format.h"
+#include "fnv.h"
+
+/* The direct-threaded engine relies on GCC's labels-as-values extension.
+ * Build with -DUM_THREADED=0 to leave only the portable switch loop.
+ */
+#ifndef UM_THREADED
+#if defined(__GNUC__)
+#define UM_THREADED 1
+#else
+#define UM_THREADED 0
+#endif
+#endif
+
+/* The JIT emits x86-64 code into an anonymous executable mapping.
+ * Build with -DUM_JIT=0 to leave it out.
+ */
+#ifndef UM_JIT
+#if UM_THREADED && defined(__x86_64__) && defined(MAP_ANONYMOUS)
+#define UM_JIT 1
+#else
+#define UM_JIT 0
+#endif
+#endif
+
+/* --perf-stats reads the host's hardware counters through perf_event_open.
+ * Build with -DUM_PERF=0 to leave them out; the phases are still timed.
+ */
+#ifndef UM_PERF
+#if defined(__linux__) && defined(SYS_perf_event_open)
+#define UM_PERF 1
+#else
+#define UM_PERF 0
+#endif
+#endif
+
+/* Halt instruction placed one entry past the end of the decoded program
+ * so the threaded engine stops without a bounds check on every dispatch
+ */
+#define HALT_SENTINEL 0x70000000u
+
+typedef enum engine { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT, 
+    ENGINE_PROFILE, ENGINE_CHECKED } engine;
+
+/* The profiler is a separate engine, so the others carry no counters.
+ * Build with -DUM_PROFILE=0 to leave it out.
+ */
+#ifndef UM_PROFILE
+#define UM_PROFILE 1
+#endif
+
+/* Buckets of the map_segment size histogram: bucket i counts sizes below 
+ * 2^i words, the last one everything larger
+ */
+#define PROFILE_MAP_BUCKETS 33
+
+typedef struct profile {
+        uint64_t instructions;
+        uint64_t opcodes[16];
+
+        uint64_t *pcs;
+        uint64_t *blocks;
+        uint32_t pclength;
+
+        uint64_t mapsizes[PROFILE_MAP_BUCKETS];
+        uint64_t unmaps;
+        uint64_t jumps;
+        uint64_t loads;
+} *profile;
+
+typedef struct jit *jit;
 
 extern Except_T Bitpack_Overflow;
 Except_T Bitpack_Overflow = { "Overflow packing bits" };
 
+/* One pre-decoded word of segment 0; for load_value, a is the target 
+ * register and lvalue the value
+ */
+typedef struct instr {
+        uint8_t opcode;
+        uint8_t a;
+        uint8_t b;
+        uint8_t c;
+        uint32_t lvalue;
+} instr;
+
+/* The peephole pass marks an entry that starts a common sequence by 
+ * putting the kind of sequence above its opcode. Only the threaded engine 
+ * dispatches on the whole byte; everything else masks the mark off.
+ * FUSE_BULK_LOOP marks the head of a whole copy or fill loop, which runs 
+ * as one memmove or fill when its registers allow; see match_loop.
+ */
+#define OPCODE_MASK 0x0f
+#define FUSE_SHIFT 4
+
+typedef enum fusion { FUSE_NONE, FUSE_LOADV_LOADV, FUSE_LOADV_LOADP, 
+    FUSE_NAND_NAND, FUSE_LOAD_ADD_STORE, FUSE_BULK_LOOP, FUSE_KINDS } fusion;
+
+/* Decode cache files hold these marks; see CACHE_VERSION */
+
+/* The most entries a bulk loop takes, and so how far back a store into 
+ * segment 0 can change one's mark
+ */
+#define LOOP_MAX_WORDS 9
+
+/* What bulk_loop returns when the loop has to run an iteration at a time. 
+ * No load_value can name it as an exit.
+ */
+#define LOOP_DECLINED UINT32_MAX
+
+/* The registers of a bulk loop, as match_loop finds them */
+typedef struct loop_match {
+        bool copy;
+        bool loady;
+        unsigned t, s, i, d, j, v, k, n, step, x, y, z;
+        uint32_t exit;
+} loop_match;
+
+/* Segments of up to 2^POOL_MAX_CLASS words, header included, are rounded 
+ * up to a power of two and recycled through per-class free lists. Classes 
+ * up to POOL_SLAB_CLASS are carved out of shared slabs; larger blocks come 
+ * from malloc and go back to it once the pool holds POOL_HIGH_WATER bytes 
+ * of them. Slabs are aligned to their size and count their blocks in use, 
+ * and once the pool holds POOL_HIGH_WATER bytes of slab blocks, slabs none 
+ * of whose blocks are in use are taken off the free lists and freed.
+ */
+#define POOL_MIN_CLASS 2
+#define POOL_SLAB_CLASS 10
+#define POOL_MAX_CLASS 16
+#define POOL_SLAB_BYTES (256 * 1024)
+#define POOL_SLAB_HEADER 16
+#define POOL_HIGH_WATER ((size_t)64 * 1024 * 1024)
+
+/* Larger blocks are anonymous mappings. They read as zero when they are 
+ * new, so map_segment leaves them alone, and their pages go back to the 
+ * system with madvise when they are unmapped, which leaves them reading as 
+ * zero again. Up to POOL_MAPPED_BYTES of such address space is kept for 
+ * reuse, so a program mapping and unmapping big buffers in a loop makes 
+ * one madvise per unmap rather than an mmap and munmap.
+ */
+#define POOL_MAPPED_BYTES ((size_t)4 << 30)
+
+/* With --arena every segment is carved out of one reserved virtual region 
+ * instead, rounded up to a power of two of any size and never handed back, 
+ * so segments mapped together sit together. Pages are only committed as 
+ * they are touched. If ARENA_BYTES cannot be reserved, successively 
+ * halved sizes down to ARENA_MIN_BYTES are tried.
+ */
+#define ARENA_BYTES ((size_t)64 << 30)
+#define ARENA_MIN_BYTES ((size_t)1 << 30)
+#define ARENA_MAX_CLASS 34
+
+typedef struct seg_pool {
+        uint32_t *freelists[ARENA_MAX_CLASS + 1];
+
+        char *arena;
+        char *arenatop;
+        size_t arenabytes;
+
+        char *slabs;
+        char *slabtop;
+        size_t slableft;
+        size_t slabsweep;
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t released;
+        size_t held;
+        size_t heldlarge;
+        size_t heldslab;
+        size_t heldmapped;
+} seg_pool;
+
+/* The start of every slab: the previous slab, and how many of its blocks 
+ * are mapped
+ */
+typedef struct slab_header {
+        char *next;
+        uint32_t live;
+} slab_header;
+
+/* The decode cache keeps the decoded form of programs that segment 0 has 
+ * held, keyed by an FNV-1a hash of their words, so a load_program of 
+ * contents seen before copies the entries instead of decoding them again. 
+ * A program is kept once its hash has been seen twice, in up to 
+ * CACHE_SLOTS entries and CACHE_MAX_BYTES bytes. With a directory, every 
+ * decoded program is also written there and looked up on a miss, so 
+ * later runs of the same image find it.
+ */
+#define CACHE_SLOTS 8
+#define CACHE_MAX_BYTES ((size_t)64 * 1024 * 1024)
+
+/* First word of a decode cache file, in host byte order. It is followed by 
+ * the format, the program's length and hash, its words, and its decoded 
+ * entries with the halt entry. The entries hold the peephole marks as 
+ * they are, so CACHE_VERSION goes up whenever the marks or instr change, 
+ * and a file of any other format is decoded again.
+ */
+#define CACHE_MAGIC 0x31434d55u
+#define CACHE_VERSION 2
+#define CACHE_FORMAT ((uint32_t)CACHE_VERSION << 16 | FUSE_KINDS << 8 | \
+    sizeof(instr))
+
+typedef struct cache_entry {
+        uint64_t hash;
+        uint32_t length;
+        uint64_t used;
+        uint32_t *words;
+        instr *decoded;
+} cache_entry;
+
+typedef struct decode_cache {
+        cache_entry entries[CACHE_SLOTS];
+        size_t bytes;
+        uint64_t clock;
+
+        /* Hashes seen once, oldest overwritten first */
+        uint64_t seen[CACHE_SLOTS];
+        unsigned seennext;
+
+        const char *dir;
+        bool warned;
+
+        uint64_t hits;
+        uint64_t diskhits;
+        uint64_t misses;
+} decode_cache;
+
+/* Smallest capacity of the segment table and of the free-identifier 
+ * stack; neither shrinks below it
+ */
+#define TABLE_MIN 100
+
+/* Number of free identifiers before a compaction pass is first tried */
+#define TABLE_COMPACT_MIN 4096
+
+/* Output is collected in IO_OUT_BYTES and written when the buffer fills, 
+ * before input is read and at halt; input is read IO_IN_BYTES at a time
+ */
+#define IO_OUT_BYTES (64 * 1024)
+#define IO_IN_BYTES (64 * 1024)
+
+/* An input log is text. Its first line is IO_LOG_HEADER; then a line 
+ * "in count byte" for every byte the program read and "eof count" for 
+ * every read at end of input, count being the instructions retired when 
+ * it was read, and last "end instructions bytes digest" with the output's 
+ * length and FNV-1a digest.
+ */
+#define IO_LOG_HEADER "um-input-log 1"
+
+typedef struct io_event {
+        uint64_t at;
+        int byte;
+} io_event;
+
+typedef struct io_dev {
+        unsigned char out[IO_OUT_BYTES];
+        size_t outlen;
+
+        const unsigned char *in;
+        size_t inpos;
+        size_t inlen;
+        unsigned char inbuf[IO_IN_BYTES];
+        void *inmap;
+
+        bool interactive;
+
+        /* Everything flushed so far, kept while a snapshot is pending */
+        bool transcribe;
+        unsigned char *transcript;
+        size_t transcriptlen;
+        size_t transcriptcap;
+
+        /* Input logging. Only the switch loop keeps retired up to date, 
+         * and counting says it does.
+         */
+        FILE *record;
+        io_event *replay;
+        size_t replaylen;
+        size_t replaypos;
+        bool counting;
+        uint64_t retired;
+        uint64_t digest;
+        uint64_t outbytes;
+        uint64_t endretired;
+        uint64_t endbytes;
+        uint64_t enddigest;
+} io_dev;
+
+static io_dev io;
+
+/* The counters --perf-stats reports, in order. Any the host lacks, or 
+ * will not open for this process, read as missing.
+ */
+#define PERF_COUNTERS 6
+
+typedef struct perf_stats {
+        bool on;
+        int fds[PERF_COUNTERS];
+        bool any;
+
+        /* Counter values and wall clock at the end of the last phase */
+        uint64_t phase[PERF_COUNTERS];
+        double phasetime;
+
+        /* The switch loop calls perf_sample when it has retired next 
+         * instructions, every interval instructions
+         */
+        uint64_t interval;
+        uint64_t next;
+        uint64_t sampled[PERF_COUNTERS];
+        double sampletime;
+} perf_stats;
+
+static perf_stats perf = { .next = UINT64_MAX };
+
 typedef struct memory {
         uint32_t** segments;
         uint32_t memlength;
+        uint32_t memcapacity;
+        uint32_t compactat;
+        uint64_t compactions;
+
+        seg_pool pool;
+
+        uint32_t *image;
+        size_t imagebytes;
+        uint32_t imagerefs;
+
+        instr *decoded;
+        uint32_t decodedlength;
+        /* Whether any entry of decoded may carry a FUSE_BULK_LOOP mark */
+        bool loops;
+        decode_cache cache;
+
+        struct jit *jit;
 
         uint32_t *unmapidentifiers;
         uint32_t unmaplastindex;
         uint32_t unmaplistlength;
+
+        /* Set while a library call runs: faults land here, not in exit */
+        jmp_buf *fault;
+        um_error *error;
 } *memory;
 
-static inline void run_prog(memory mem, uint32_t registers[], 
+/* A budgeted run for the library: the instructions it may still retire, 
+ * where its input and output go, the instruction running (for a fault's 
+ * pc) and why it stopped */
+typedef struct run_slice {
+        const um_io *io;
+        uint64_t budget;
+        uint32_t pc;
+        um_status status;
+} run_slice;
+
+static inline uint64_t run_prog(memory mem, uint32_t registers[], 
+    uint32_t *prog_count);
+#if UM_THREADED
+static void run_prog_threaded(memory mem, uint32_t registers[], 
+    uint32_t *prog_count, bool checked, run_slice *slice);
+#else
+static void run_prog_checked(memory mem, uint32_t registers[], 
+    uint32_t *prog_count);
+#endif
+#if UM_JIT
+static void run_prog_jit(memory mem, uint32_t registers[], 
+    uint32_t *prog_count);
+static void jit_reset(jit j, memory mem);
+static inline void jit_invalidate(jit j, memory mem, uint32_t offset);
+#endif
+static inline bool exec_instr(memory mem, uint32_t registers[], 
     uint32_t *prog_count);
+#if UM_PROFILE
+static void run_prog_profile(memory mem, uint32_t registers[], 
+    uint32_t *prog_count, profile prof);
+static void profile_report(profile prof, FILE *out);
+#endif
 
 static inline memory init_mem();
-static inline void init_prog(memory mem, FILE *fp, uint32_t num_words);
+static inline void init_prog(memory mem, int fd, const char *filename);
+static void save_native(memory mem, const char *filename);
+static bool run_to_input(memory mem, uint32_t registers[], 
+    uint32_t *prog_count);
+static void save_snapshot(memory mem, uint32_t registers[], 
+    uint32_t prog_count, const char *filename);
+static void restore_snapshot(memory mem, uint32_t registers[], 
+    uint32_t *prog_count, int fd, const char *filename);
+static void swap_words(uint32_t *dst, const uint8_t *src, size_t n);
 static inline uint32_t get_word(memory mem, unsigned seg_num, unsigned offset);
 static inline void put_word(memory mem, unsigned seg_num, unsigned offset, 
     uint32_t val);
 static inline void free_mem(memory mem);
+static inline uint32_t take_identifier(memory mem);
+static inline void release_identifier(memory mem, uint32_t index);
+static void compact_table(memory mem);
+static void table_report(memory mem, FILE *out);
+static inline uint32_t *seg_alloc(memory mem, uint32_t num_words);
+static inline void seg_free(memory mem, uint32_t *seg);
+static void slab_sweep(seg_pool *pool);
+static inline uint32_t *seg_share(uint32_t *seg);
+static inline void seg_release(memory mem, uint32_t *seg);
+static inline uint32_t *seg_own(memory mem, uint32_t seg_num);
+static bool arena_init(seg_pool *pool);
+static void pool_destroy(seg_pool *pool);
+static void pool_report(seg_pool *pool, FILE *out);
+static inline void decode_prog(memory mem);
+static inline void decode_entry(memory mem, uint32_t offset);
+static inline void fuse_entry(memory mem, uint32_t offset);
+__attribute__((noinline))
+static void remark_loops(memory mem, uint32_t offset);
+static void mark_loop(memory mem, uint32_t offset);
+__attribute__((noinline))
+static bool match_loop(const instr *in, uint32_t head, loop_match *m);
+__attribute__((noinline))
+static uint32_t bulk_loop(memory mem, uint32_t r[], const instr *in, 
+    uint32_t head);
+static uint64_t cache_hash(const uint32_t *seg);
+static bool cache_fetch(memory mem, uint64_t hash);
+static void cache_note(memory mem, uint64_t hash);
+static void cache_store(memory mem, uint64_t hash);
+static void cache_destroy(decode_cache *cache);
+static void cache_report(decode_cache *cache, FILE *out);
 
 static inline void initialize_regs(uint32_t registers[]);
 static inline uint32_t at_reg(uint32_t registers[], unsigned index);
@@ -61,6 +480,22 @@ static inline void load_program(memory mem, uint32_t registers[],
 static inline void load_value(uint32_t registers[], unsigned a, 
     unsigned lvalue);
 
+static void check_instr(memory mem, uint32_t registers[], uint32_t pc);
+static inline bool segment_holds(memory mem, uint32_t seg_num, 
+    uint32_t word);
+static void um_fail(memory mem, um_error_code code, const char *format, ...)
+    __attribute__((noreturn, format(printf, 3, 4)));
+
+static void io_init(void);
+static void io_flush(void);
+static void io_record(const char *filename);
+static void io_replay(const char *filename);
+static void io_log_end(uint64_t retired);
+
+static void perf_init(uint64_t interval);
+static void perf_phase(const char *name, bool counted, uint64_t retired);
+static void perf_sample(uint64_t retired);
+static void perf_close(void);
 static inline uint32_t io_input();
 static inline void io_output(uint32_t word);
 
@@ -75,21 +510,134 @@ static inline uint64_t Bitpack_newu(uint64_t word, unsigned width,
 static inline uint64_t Bitpack_news(uint64_t word, unsigned width, 
     unsigned lsb, int64_t value);
 
+#ifndef UM_LIBRARY
+
 int main(int argc, char *argv[]) 
 {
-        if (argc == 1) {
+        engine eng = UM_THREADED ? ENGINE_THREADED : ENGINE_SWITCH;
+        const char *engine_flag = NULL;
+        bool pool_stats = false;
+        bool count = false;
+        bool perf_stats = false;
+        long long perf_interval = 0;
+        uint64_t retired = 0;
+        bool restore = false;
+        bool arena = false;
+        char *native_out = NULL;
+        char *profile_out = NULL;
+        char *snapshot_out = NULL;
+        char *cache_dir = NULL;
+        char *record_log = NULL;
+        char *replay_log = NULL;
+        char *filename = NULL;
+
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--switch") == 0) {
+                        engine_flag = NULL;
+                        eng = ENGINE_SWITCH;
+                } else if (strcmp(argv[i], "--save-native") == 0 && 
+                    i + 1 < argc) {
+                        native_out = argv[++i];
+                } else if (strcmp(argv[i], "--snapshot") == 0 && 
+                    i + 1 < argc) {
+                        snapshot_out = argv[++i];
+                } else if (strcmp(argv[i], "--decode-cache") == 0 && 
+                    i + 1 < argc) {
+                        cache_dir = argv[++i];
+                } else if (strcmp(argv[i], "--record") == 0 && 
+                    i + 1 < argc) {
+                        record_log = argv[++i];
+                } else if (strcmp(argv[i], "--replay") == 0 && 
+                    i + 1 < argc) {
+                        replay_log = argv[++i];
+                } else if (strcmp(argv[i], "--restore") == 0) {
+                        restore = true;
+                } else if (strcmp(argv[i], "--profile") == 0 && 
+                    i + 1 < argc) {
+                        if (!UM_PROFILE) {
+                                fprintf(stderr, "%s: %s\n", argv[0], 
+                                    "profiler not built");
+                                exit(EXIT_FAILURE);
+                        }
+                        engine_flag = argv[i];
+                        profile_out = argv[++i];
+                        eng = ENGINE_PROFILE;
+                } else if (strcmp(argv[i], "--count") == 0) {
+                        count = true;
+                } else if (strcmp(argv[i], "--arena") == 0) {
+                        arena = true;
+                } else if (strcmp(argv[i], "--pool-stats") == 0) {
+                        pool_stats = true;
+                } else if (strcmp(argv[i], "--perf-stats") == 0) {
+                        perf_stats = true;
+                } else if (strcmp(argv[i], "--perf-sample") == 0 && 
+                    i + 1 < argc) {
+                        perf_interval = atoll(argv[++i]);
+                        perf_stats = true;
+                        if (perf_interval < 1) {
+                                fprintf(stderr, "%s: --perf-sample needs a "
+                                    "positive instruction count\n", 
+                                    argv[0]);
+                                exit(EXIT_FAILURE);
+                        }
+                } else if (strcmp(argv[i], "--jit") == 0) {
+                        if (!UM_JIT) {
+                                fprintf(stderr, "%s: %s\n", argv[0], 
+                                    "JIT not built");
+                                exit(EXIT_FAILURE);
+                        }
+                        engine_flag = argv[i];
+                        eng = ENGINE_JIT;
+                } else if (strcmp(argv[i], "--checked") == 0) {
+                        engine_flag = argv[i];
+                        eng = ENGINE_CHECKED;
+                } else if (strcmp(argv[i], "--threaded") == 0) {
+                        if (!UM_THREADED) {
+                                fprintf(stderr, "%s: %s\n", argv[0], 
+                                    "threaded engine not built");
+                                exit(EXIT_FAILURE);
+                        }
+                        engine_flag = argv[i];
+                        eng = ENGINE_THREADED;
+                } else if (filename == NULL) {
+                        filename = argv[i];
+                } else {
+                        fprintf(stderr, "usage: %s [--switch | --threaded | "
+                            "--jit | --checked | --profile report] [--count] "
+                            "[--pool-stats] [--perf-stats] [--perf-sample n] "
+                            "[--arena] [--save-native out] "
+                            "[--snapshot out] [--restore] "
+                            "[--decode-cache dir] [--record log | "
+                            "--replay log] file.um\n", 
+                            argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        if (filename == NULL) {
                 fprintf(stdout, "Error: A UM file not provided\n");
                 exit(EXIT_FAILURE);
         }
 
-        FILE *fp;
-        fp = fopen(argv[1], "r");
+        /* These run the switch loop, which is the only one that counts, so 
+         * they cannot have another engine
+         */
+        if ((count || record_log != NULL || perf_interval > 0) && 
+            engine_flag != NULL) {
+                fprintf(stderr, "%s: %s runs the switch loop and cannot be "
+                    "combined with %s\n", argv[0], count ? "--count" : 
+                    record_log != NULL ? "--record" : "--perf-sample", 
+                    engine_flag);
+                exit(EXIT_FAILURE);
+        }
+
+        int fd = open(filename, O_RDONLY);
 
         /* Checks if the file is read */
-        if (fp == NULL) {
+        if (fd < 0) {
                 fprintf(stderr, "%s: %s %s %s\n",
                         argv[0], "Could not open file ",
-                        argv[1], "for reading");
+                        filename, "for reading");
                 exit(EXIT_FAILURE);
         }
 
@@ -98,35 +646,144 @@ int main(int argc, char *argv[])
         uint32_t registers[8];
         uint32_t prog_count = 0;
 
-        struct stat sb;
-        stat(argv[1], &sb);
-        uint32_t num_words = sb.st_size / 4;
+        if (perf_stats)
+                perf_init(perf_interval);
 
         /* Initializes main UM components */
         initialize_regs(registers);
         mem = init_mem();
+        mem->cache.dir = cache_dir;
+        if (arena && !arena_init(&mem->pool))
+                fprintf(stderr, "Warning: Could not reserve an arena; "
+                    "using the pool\n");
+        io_init();
+
+        if (record_log != NULL && replay_log != NULL) {
+                fprintf(stderr, "%s: --record and --replay cannot be "
+                    "combined\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+        if (record_log != NULL)
+                io_record(record_log);
+        if (replay_log != NULL)
+                io_replay(replay_log);
+
+        if (restore)
+                restore_snapshot(mem, registers, &prog_count, fd, filename);
+        else
+                init_prog(mem, fd, filename);
+        close(fd);
+        perf_phase("load", true, 0);
+
+        if (native_out != NULL) {
+                save_native(mem, native_out);
+                free_mem(mem);
+                exit(EXIT_SUCCESS);
+        }
+
+        if (snapshot_out != NULL) {
+                io.transcribe = true;
+                if (!run_to_input(mem, registers, &prog_count)) {
+                        fprintf(stderr, "Warning: program halted before "
+                            "reading input; no snapshot written\n");
+                        io_flush();
+                        free_mem(mem);
+                        exit(EXIT_SUCCESS);
+                }
+                save_snapshot(mem, registers, prog_count, snapshot_out);
+                io.transcribe = false;
+                free(io.transcript);
+                io.transcript = NULL;
+        }
 
-        init_prog(mem, fp, num_words);
+        /* Only the switch loop counts instructions, and a log records 
+         * the count at each input and perf samples at every interval, so 
+         * these replace the default engine
+         */
+        if (count || record_log != NULL || perf_interval > 0)
+                eng = ENGINE_SWITCH;
+        io.counting = eng == ENGINE_SWITCH;
+
+#if !UM_PROFILE
+        (void)profile_out;
+#endif
 
         /* Runs the UM */
-        run_prog(mem, registers, &prog_count);
+        switch (eng) {
+#if UM_PROFILE
+        case ENGINE_PROFILE: {
+                struct profile prof;
+                FILE *report = fopen(profile_out, "w");
+
+                if (report == NULL) {
+                        fprintf(stderr, "%s: Could not open %s for writing\n", 
+                            argv[0], profile_out);
+                        exit(EXIT_FAILURE);
+                }
+                run_prog_profile(mem, registers, &prog_count, &prof);
+                profile_report(&prof, report);
+                fclose(report);
+                break;
+        }
+#endif
+#if UM_JIT
+        case ENGINE_JIT:
+                run_prog_jit(mem, registers, &prog_count);
+                break;
+#endif
+#if UM_THREADED
+        case ENGINE_THREADED:
+                run_prog_threaded(mem, registers, &prog_count, false, NULL);
+                break;
+        case ENGINE_CHECKED:
+                run_prog_threaded(mem, registers, &prog_count, true, NULL);
+                break;
+#else
+        case ENGINE_CHECKED:
+                run_prog_checked(mem, registers, &prog_count);
+                break;
+#endif
+        default:
+                retired = run_prog(mem, registers, &prog_count);
+                break;
+        }
+
+        io_log_end(retired);
+        io_flush();
+        perf_phase("exec", eng == ENGINE_SWITCH, retired);
+
+        if (count)
+                fprintf(stderr, "instructions: %llu\n", 
+                    (unsigned long long)retired);
+
+        if (pool_stats) {
+                pool_report(&mem->pool, stderr);
+                table_report(mem, stderr);
+                cache_report(&mem->cache, stderr);
+        }
 
         /* Frees memory */
-        fclose(fp);
         free_mem(mem);
+        perf_phase("teardown", true, 0);
+        perf_close();
 
         exit(EXIT_SUCCESS);
 }
 
-/* Function: run_program
- * Does: Runs all instructions
- * Paramters: Seq_T, Seq_T, UArray_T, uint32_t*
- * Returns: none
+#endif /* UM_LIBRARY */
+
+/* Function: run_switch
+ * Does: Runs all instructions. Each value of sampling gets its own copy 
+ *       of the loop, so only --perf-sample pays for the check.
+ * Paramters: memory, uint32_t[], uint32_t*, bool
+ * Returns: number of instructions executed
  */
-static inline void run_prog(memory mem, uint32_t registers[], 
-    uint32_t *prog_count) 
+__attribute__((always_inline))
+static inline uint64_t run_switch(memory mem, uint32_t registers[], 
+    uint32_t *prog_count, bool sampling) 
 {
         bool prog_change = false;
+        uint64_t retired = 0;
 
         uint32_t curr_length = mem->segments[0][1];
 
@@ -140,6 +797,9 @@ static inline void run_prog(memory mem, uint32_t registers[],
                 decode_word(instruction, &opcode, &a, &b, &c, &lvalue);
 
                 *prog_count = *prog_count + 1;
+                retired++;
+                if (sampling && __builtin_expect(retired == perf.next, 0))
+                        perf_sample(retired);
 
                 /* Executes the specified instruction */
                 switch (opcode) {
@@ -177,6 +837,7 @@ static inline void run_prog(memory mem, uint32_t registers[],
                                 output(registers, c);
                                 break;
                         case 11 :
+                                io.retired = retired;
                                 input(registers, c);
                                 break;
                         case 12 :
@@ -187,8 +848,8 @@ static inline void run_prog(memory mem, uint32_t registers[],
                                 load_value(registers, a, lvalue);
                                 break;
                         default:
-                                fprintf(stderr, "Error: Invalid Instruction\n");
-                                exit(EXIT_FAILURE);
+                                um_fail(mem, UM_ERROR_OPCODE, "Invalid "
+                                    "instruction at pc %u", *prog_count - 1);
 
                 }
 
@@ -199,12 +860,327 @@ static inline void run_prog(memory mem, uint32_t registers[],
                 
                 /* Check if the last instruction has been executed*/
                 if (*prog_count == curr_length) {
-                        return;
+                        return retired;
                 } 
         }
 }
 
+/* Each copy of the switch loop is a function of its own, where the 
+ * operations it calls are inlined as they would not be in main
+ */
+__attribute__((noinline, flatten))
+static uint64_t run_prog_plain(memory mem, uint32_t registers[], 
+    uint32_t *prog_count)
+{
+        return run_switch(mem, registers, prog_count, false);
+}
+
+__attribute__((noinline, flatten))
+static uint64_t run_prog_sampled(memory mem, uint32_t registers[], 
+    uint32_t *prog_count)
+{
+        return run_switch(mem, registers, prog_count, true);
+}
+
+/* Function: run_program
+ * Does: Runs all instructions in the switch loop
+ * Paramters: memory, uint32_t[], uint32_t*
+ * Returns: number of instructions executed
+ */
+static inline uint64_t run_prog(memory mem, uint32_t registers[], 
+    uint32_t *prog_count) 
+{
+        if (perf.interval > 0)
+                return run_prog_sampled(mem, registers, prog_count);
+        return run_prog_plain(mem, registers, prog_count);
+}
+
+
+/* Function: exec_instr
+ * Does: Runs the single pre-decoded instruction at the program counter
+ * Paramters: memory, uint32_t[], uint32_t*
+ * Returns: false once the program halts, true otherwise
+ */
+static inline bool exec_instr(memory mem, uint32_t registers[], 
+    uint32_t *prog_count)
+{
+        const instr *in = &mem->decoded[*prog_count];
+
+        *prog_count = *prog_count + 1;
+
+        switch (in->opcode & OPCODE_MASK) {
+                case 0 :
+                        conditional_move(registers, in->a, in->b, in->c);
+                        break;
+                case 1 :
+                        segmented_load(registers, mem, in->a, in->b, in->c);
+                        break;
+                case 2 :
+                        segmented_store(registers, mem, in->a, in->b, in->c);
+                        break;
+                case 3 :
+                        addition(registers, in->a, in->b, in->c);
+                        break;
+                case 4 :
+                        multiplication(registers, in->a, in->b, in->c);
+                        break;
+                case 5 :
+                        division(registers, in->a, in->b, in->c);
+                        break;
+                case 6 :
+                        bitwise_NAND(registers, in->a, in->b, in->c);
+                        break;
+                case 7 :
+                        halt(mem, prog_count);
+                        return false;
+                case 8 :
+                        map_segment(registers, mem, in->b, in->c);
+                        break;
+                case 9 :
+                        unmap_segment(registers, mem, in->c);
+                        break;
+                case 10 :
+                        output(registers, in->c);
+                        break;
+                case 11 :
+                        input(registers, in->c);
+                        break;
+                case 12 :
+                        load_program(mem, registers, prog_count, in->b, 
+                            in->c);
+                        break;
+                case 13 :
+                        load_value(registers, in->a, in->lvalue);
+                        break;
+                default:
+                        um_fail(mem, UM_ERROR_OPCODE, "Invalid instruction "
+                            "at pc %u", *prog_count - 1);
+        }
+
+        return true;
+}
+
+#if UM_THREADED
+
+/* Function: run_prog_threaded
+ * Does: Runs all instructions from the pre-decoded program using direct 
+ *       threading: every handler jumps straight to the next handler, and 
+ *       the registers live in a local array for the duration of the run. 
+ *       An entry marked by fuse_entry runs its first instruction and goes 
+ *       directly to the handler of the next without a dispatch. Checked, 
+ *       every op that can fault is tested first, with check_instr making 
+ *       the report, and fused sequences that contain one run an op at a 
+ *       time; unchecked, no handler tests anything. Given a slice, the run is checked, every 
+ *       dispatch goes through op_tick to spend the budget and note the pc, 
+ *       and halt and I/O return to the library instead of the program.
+ * Paramters: memory, uint32_t[], uint32_t*, bool, run_slice*
+ * Returns: none
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+static void run_prog_threaded(memory mem, uint32_t registers[], 
+    uint32_t *prog_count, bool checked, run_slice *slice)
+{
+        /* Marked entries only ever carry these opcodes */
+        static void *const dispatch[FUSE_KINDS << FUSE_SHIFT] = {
+                &&op_cmov, &&op_sload, &&op_sstore, &&op_add,
+                &&op_mul, &&op_div, &&op_nand, &&op_halt,
+                &&op_map, &&op_unmap, &&op_out, &&op_in,
+                &&op_loadp, &&op_loadv, &&op_invalid, &&op_invalid,
+                [FUSE_LOADV_LOADV << FUSE_SHIFT | 13] = &&op_loadv_loadv,
+                [FUSE_LOADV_LOADP << FUSE_SHIFT | 13] = &&op_loadv_loadp,
+                [FUSE_NAND_NAND << FUSE_SHIFT | 6] = &&op_nand_nand,
+                [FUSE_LOAD_ADD_STORE << FUSE_SHIFT | 1] = 
+                    &&op_load_add_store,
+                [FUSE_BULK_LOOP << FUSE_SHIFT | 1] = &&op_bulk_loop,
+                [FUSE_BULK_LOOP << FUSE_SHIFT | 2] = &&op_bulk_loop
+        };
+        static void *const checked_dispatch[FUSE_KINDS << FUSE_SHIFT] = {
+                &&op_cmov, &&op_check_sload, &&op_check_sstore, &&op_add,
+                &&op_mul, &&op_check_div, &&op_nand, &&op_halt,
+                &&op_map, &&op_check, &&op_check, &&op_in,
+                &&op_check_loadp, &&op_loadv, &&op_invalid, &&op_invalid,
+                [FUSE_LOADV_LOADV << FUSE_SHIFT | 13] = &&op_loadv_loadv,
+                [FUSE_LOADV_LOADP << FUSE_SHIFT | 13] = &&op_loadv,
+                [FUSE_NAND_NAND << FUSE_SHIFT | 6] = &&op_nand_nand,
+                [FUSE_LOAD_ADD_STORE << FUSE_SHIFT | 1] = &&op_check_sload,
+                [FUSE_BULK_LOOP << FUSE_SHIFT | 1] = &&op_check_sload,
+                [FUSE_BULK_LOOP << FUSE_SHIFT | 2] = &&op_check_sstore
+        };
+        /* Reached from op_tick, which has already counted the op */
+        static void *const slice_dispatch[16] = {
+                &&op_cmov, &&op_check_sload, &&op_check_sstore, &&op_add,
+                &&op_mul, &&op_check_div, &&op_nand, &&op_slice_halt,
+                &&op_map, &&op_check, &&op_slice_out, &&op_slice_in,
+                &&op_check_loadp, &&op_loadv, &&op_invalid, &&op_invalid
+        };
+        static void *const tick[FUSE_KINDS << FUSE_SHIFT] = {
+                [0 ... (FUSE_KINDS << FUSE_SHIFT) - 1] = &&op_tick
+        };
+        void *const *handlers = slice != NULL ? tick : 
+            checked ? checked_dispatch : dispatch;
+
+        uint32_t r[8];
+        const instr *prog = mem->decoded;
+        const instr *in;
+        uint32_t pc = *prog_count;
+        uint32_t target;
+
+        memcpy(r, registers, sizeof(r));
+
+/* Fetches the next pre-decoded instruction and jumps to its handler */
+#define DISPATCH()                                                      \
+        do {                                                            \
+                in = &prog[pc++];                                       \
+                goto *handlers[in->opcode];                             \
+        } while (0)
+/* Moves to the next instruction of a fused sequence */
+#define FUSED_NEXT() (in = &prog[pc++])
+#define A in->a
+#define B in->b
+#define C in->c
+
+        DISPATCH();
+
+op_cmov:
+        if (r[C] != 0)
+                r[A] = r[B];
+        DISPATCH();
+op_sload:
+        r[A] = mem->segments[r[B]][r[C] + 2];
+        DISPATCH();
+op_sstore:
+        if (__builtin_expect(mem->segments[r[A]][0] > 1, 0))
+                seg_own(mem, r[A]);
+        mem->segments[r[A]][r[B] + 2] = r[C];
+        if (__builtin_expect(r[A] == 0, 0))
+                decode_entry(mem, r[B]);
+        DISPATCH();
+op_add:
+        r[A] = r[B] + r[C];
+        DISPATCH();
+op_mul:
+        r[A] = r[B] * r[C];
+        DISPATCH();
+op_div:
+        r[A] = r[B] / r[C];
+        DISPATCH();
+op_nand:
+        r[A] = ~(r[B] & r[C]);
+        DISPATCH();
+op_map:
+        map_segment(r, mem, B, C);
+        DISPATCH();
+op_unmap:
+        unmap_segment(r, mem, C);
+        DISPATCH();
+op_out:
+        io_output(r[C]);
+        DISPATCH();
+op_in:
+        input(r, C);
+        DISPATCH();
+op_loadp:
+        load_program(mem, r, &pc, B, C);
+        prog = mem->decoded;
+        DISPATCH();
+op_loadv:
+        r[A] = in->lvalue;
+        DISPATCH();
+op_loadv_loadv:
+        r[A] = in->lvalue;
+        FUSED_NEXT();
+        goto op_loadv;
+op_loadv_loadp:
+        r[A] = in->lvalue;
+        FUSED_NEXT();
+        if (r[B] == 0) {
+                pc = r[C];
+                DISPATCH();
+        }
+        goto op_loadp;
+op_nand_nand:
+        r[A] = ~(r[B] & r[C]);
+        FUSED_NEXT();
+        goto op_nand;
+op_load_add_store:
+        r[A] = mem->segments[r[B]][r[C] + 2];
+        FUSED_NEXT();
+        r[A] = r[B] + r[C];
+        FUSED_NEXT();
+        goto op_sstore;
+op_bulk_loop:
+        target = bulk_loop(mem, r, in, pc - 1);
+        if (target == LOOP_DECLINED)
+                goto *dispatch[in->opcode & OPCODE_MASK];
+        pc = target;
+        DISPATCH();
+/* The common case of each check is tested inline; check_instr reports */
+op_check_sload:
+        if (__builtin_expect(!segment_holds(mem, r[B], r[C]), 0))
+                goto op_check;
+        goto op_sload;
+op_check_sstore:
+        if (__builtin_expect(!segment_holds(mem, r[A], r[B]), 0))
+                goto op_check;
+        goto op_sstore;
+op_check_div:
+        if (__builtin_expect(r[C] == 0, 0))
+                goto op_check;
+        goto op_div;
+op_check_loadp:
+        if (__builtin_expect(!segment_holds(mem, r[B], r[C]), 0))
+                goto op_check;
+        goto op_loadp;
+op_check:
+        check_instr(mem, r, pc - 1);
+        goto *dispatch[in->opcode & OPCODE_MASK];
+op_invalid:
+        um_fail(mem, UM_ERROR_OPCODE, "Invalid instruction at pc %u", pc - 1);
+op_tick:
+        if (slice->budget == 0) {
+                pc--;
+                slice->status = UM_BUDGET;
+                goto op_halt;
+        }
+        /* A fault unwinds past this frame, so leave what it reports */
+        slice->budget--;
+        slice->pc = pc - 1;
+        goto *slice_dispatch[in->opcode & OPCODE_MASK];
+op_slice_out:
+        check_instr(mem, r, pc - 1);
+        if (slice->io->output != NULL)
+                slice->io->output(slice->io->context, r[C]);
+        DISPATCH();
+op_slice_in: {
+        int c = slice->io->input == NULL ? UM_INPUT_EOF : 
+            slice->io->input(slice->io->context);
+
+        if (c == UM_INPUT_BLOCKED) {
+                /* Not retired: the next slice runs it again */
+                pc--;
+                slice->budget++;
+                slice->status = UM_BLOCKED;
+                goto op_halt;
+        }
+        r[C] = c == UM_INPUT_EOF ? ~0u : (uint32_t)(c & 0xff);
+        DISPATCH();
+}
+op_slice_halt:
+        pc--;
+        slice->status = UM_HALTED;
+op_halt:
+#undef DISPATCH
+#undef FUSED_NEXT
+#undef A
+#undef B
+#undef C
+        memcpy(registers, r, sizeof(r));
+        *prog_count = pc;
+}
+#pragma GCC diagnostic pop
 
+#endif /* UM_THREADED */
 
 /******************************************************
 *
@@ -216,65 +1192,134 @@ static inline memory init_mem()
 {
         memory mem = malloc(sizeof(* mem));
         mem->memlength = 1;
-        mem->segments = malloc(sizeof(uint32_t*));
+        mem->memcapacity = TABLE_MIN;
+        mem->segments = malloc(TABLE_MIN * sizeof(uint32_t*));
+        mem->compactat = TABLE_COMPACT_MIN;
+        mem->compactions = 0;
 
-        mem->unmapidentifiers = calloc(100, sizeof(uint32_t));
+        mem->unmapidentifiers = calloc(TABLE_MIN, sizeof(uint32_t));
         mem->unmaplastindex = 0;
-        mem->unmaplistlength = 100;
+        mem->unmaplistlength = TABLE_MIN;
+
+        mem->decoded = NULL;
+        mem->decodedlength = 0;
+        memset(&mem->cache, 0, sizeof(mem->cache));
+
+        mem->jit = NULL;
+
+        mem->fault = NULL;
+        mem->error = NULL;
+
+        memset(&mem->pool, 0, sizeof(mem->pool));
+
+        mem->image = NULL;
+        mem->imagebytes = 0;
+        mem->imagerefs = 0;
 
         return mem;
 }
 
-static inline void init_prog(memory mem, FILE *fp, uint32_t num_words)
+/* Function: init_prog
+ * Does: Loads the program image into segment 0. A big-endian image is 
+ *       mapped and byte-swapped into a new segment; a native-endian image 
+ *       becomes segment 0 itself, with pages read in as they are used.
+ * Paramters: memory, int, const char*
+ * Returns: None
+ */
+static inline void init_prog(memory mem, int fd, const char *filename)
 {
-        int reader = 1;
-        int index = 2;
-        uint32_t temp_ch;
-        uint32_t word = 0;
-        bool end = false;
+        struct stat sb;
 
-        if (mem == NULL || fp == NULL) {
+        if (mem == NULL || fstat(fd, &sb) != 0) {
                 fprintf(stdout, "Error: Memory/File pointer is uninitialized");
                 exit(EXIT_FAILURE);
         }
 
-        mem->segments[0] = malloc(sizeof(uint32_t) * (num_words + 2));
-        mem->segments[0][0] = 1;
-        mem->segments[0][1] = 0;
+        size_t bytes = sb.st_size;
 
-        end = false;
+        if (bytes % 4 != 0) {
+                fprintf(stderr, "Error: %s is truncated: %zu trailing "
+                    "bytes after the last whole word\n", filename, bytes % 4);
+                exit(EXIT_FAILURE);
+        }
 
-        rewind(fp);
+        if (bytes / 4 > UINT32_MAX) {
+                fprintf(stderr, "Error: %s is too large\n", filename);
+                exit(EXIT_FAILURE);
+        }
 
-        while (!end) {
-                temp_ch = fgetc(fp);
+        if (bytes == 0) {
+                mem->segments[0] = seg_alloc(mem, 0);
+                decode_prog(mem);
+                return;
+        }
 
-                if ((int)temp_ch == EOF) {
-                        end = true;
-                } else {
-                        word = (uint32_t)Bitpack_newu((uint64_t)word, 8, 
-                        (32 - (8 * reader)), temp_ch);
+        /* Private writable pages, so the header can be updated in place */
+        uint32_t *image = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE, fd, 0);
 
-                        if (reader < 4) {
-                                reader++;
-                        } else {
-                                mem->segments[0][index] = word;
+        if (image == MAP_FAILED) {
+                fprintf(stderr, "Error: Could not map %s\n", filename);
+                exit(EXIT_FAILURE);
+        }
 
-                                reader = 1;
-                                index++;
-                        }
+        if (bytes >= 8 && image[0] == NATIVE_MAGIC) {
+                if (image[1] != bytes / 4 - 2) {
+                        fprintf(stderr, "Error: %s is truncated: header "
+                            "gives %u words, file holds %zu\n", filename, 
+                            image[1], bytes / 4 - 2);
+                        exit(EXIT_FAILURE);
                 }
+
+                image[0] = 1;
+                mem->image = image;
+                mem->imagebytes = bytes;
+                mem->imagerefs = 1;
+                mem->segments[0] = image;
+        } else if (bytes >= 8 && image[0] == __builtin_bswap32(NATIVE_MAGIC)) {
+                fprintf(stderr, "Error: %s is a native image from a host of "
+                    "the other byte order\n", filename);
+                exit(EXIT_FAILURE);
+        } else {
+                uint32_t num_words = bytes / 4;
+
+                mem->segments[0] = seg_alloc(mem, num_words);
+                swap_words(mem->segments[0] + 2, (const uint8_t *)image, 
+                    num_words);
+                munmap(image, bytes);
         }
 
+        decode_prog(mem);
 }
 
-static inline uint32_t get_word(memory mem, unsigned seg_num, unsigned offset)
+/* Function: save_native
+ * Does: Writes segment 0 as a native-endian image that init_prog can map 
+ *       without conversion
+ * Paramters: memory, const char*
+ * Returns: None
+ */
+static void save_native(memory mem, const char *filename)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory is uninitialized");
+        FILE *out = fopen(filename, "wb");
+        uint32_t *prog = mem->segments[0];
+        uint32_t header[2] = { NATIVE_MAGIC, prog[1] };
+
+        if (out == NULL) {
+                fprintf(stderr, "Error: Could not open %s for writing\n", 
+                    filename);
+                exit(EXIT_FAILURE);
+        }
+
+        if (fwrite(header, sizeof(uint32_t), 2, out) != 2 || 
+            fwrite(prog + 2, sizeof(uint32_t), prog[1], out) != prog[1] || 
+            fclose(out) != 0) {
+                fprintf(stderr, "Error: Could not write %s\n", filename);
                 exit(EXIT_FAILURE);
         }
+}
 
+static inline uint32_t get_word(memory mem, unsigned seg_num, unsigned offset)
+{
         uint32_t word = mem->segments[seg_num][offset + 2];
 
         return word;
@@ -284,488 +1329,3486 @@ static inline uint32_t get_word(memory mem, unsigned seg_num, unsigned offset)
 static inline void put_word(memory mem, unsigned seg_num, unsigned offset, 
     uint32_t val)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory is uninitialized");
-                exit(EXIT_FAILURE);
+        uint32_t *seg = mem->segments[seg_num];
+
+        if (seg[0] > 1)
+                seg = seg_own(mem, seg_num);
+
+        seg[offset + 2] = val;
+}
+
+/* Function: take_identifier
+ * Does: Picks the identifier for a new segment, reusing the most recently 
+ *       unmapped one or else growing the table geometrically
+ * Paramters: memory
+ * Returns: uint32_t
+ */
+static inline uint32_t take_identifier(memory mem)
+{
+        /* Checks if there are any unmapped segments */
+        if (mem->unmaplastindex != 0) {
+                /* Gets the segment number of an unmapped segment */
+                uint32_t index = mem->unmapidentifiers[mem->unmaplastindex];
+                (mem->unmaplastindex)--;
+
+                /* Gives back most of the stack once it is mostly empty */
+                if (mem->unmaplistlength > TABLE_MIN && 
+                    mem->unmaplastindex < mem->unmaplistlength / 4) {
+                        mem->unmaplistlength /= 2;
+                        mem->unmapidentifiers = realloc(mem->unmapidentifiers,
+                            sizeof(uint32_t) * mem->unmaplistlength);
+                }
+
+                return index;
+        }
+
+        if (mem->memlength == mem->memcapacity) {
+                mem->memcapacity *= 2;
+                mem->segments = realloc(mem->segments, 
+                    mem->memcapacity * sizeof(uint32_t*));
         }
 
-        mem->segments[seg_num][offset + 2] = val;
+        return (mem->memlength)++;
 }
 
-static inline void free_mem(memory mem)
+/* Function: release_identifier
+ * Does: Makes the identifier of an unmapped segment available again, and 
+ *       compacts the table once most of it is unmapped
+ * Paramters: memory, uint32_t
+ * Returns: None
+ */
+static inline void release_identifier(memory mem, uint32_t index)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory is uninitialized");
-                exit(EXIT_FAILURE);
+        if (mem->unmaplastindex == (mem->unmaplistlength - 1)) {
+                size_t newsize = sizeof(uint32_t) * (mem->unmaplistlength * 2);
+                mem->unmapidentifiers = realloc(mem->unmapidentifiers, newsize);
+                mem->unmaplistlength = mem->unmaplistlength * 2;
+        } 
+        
+        (mem->unmaplastindex)++;
+        mem->unmapidentifiers[mem->unmaplastindex] = index;
+
+        if (mem->unmaplastindex >= mem->compactat && 
+            mem->unmaplastindex > mem->memlength / 4 * 3)
+                compact_table(mem);
+}
+
+/* Function: compact_table
+ * Does: Drops the unmapped identifiers at the top of the table and from 
+ *       the free stack, then shrinks both. Mapped identifiers are visible to 
+ *       the program and never move. The next pass waits until the free 
+ *       stack has doubled, so the cost stays amortized O(1) per unmap.
+ * Paramters: memory
+ * Returns: None
+ */
+static void compact_table(memory mem)
+{
+        while (mem->memlength > 1 && 
+            mem->segments[mem->memlength - 1] == NULL)
+                (mem->memlength)--;
+
+        uint32_t kept = 0;
+        for (uint32_t i = 1; i <= mem->unmaplastindex; i++) {
+                if (mem->unmapidentifiers[i] < mem->memlength)
+                        mem->unmapidentifiers[++kept] = 
+                            mem->unmapidentifiers[i];
         }
+        mem->unmaplastindex = kept;
+
+        while (mem->memcapacity / 2 > TABLE_MIN && 
+            mem->memcapacity / 4 >= mem->memlength)
+                mem->memcapacity /= 2;
+        mem->segments = realloc(mem->segments, 
+            mem->memcapacity * sizeof(uint32_t*));
+
+        while (mem->unmaplistlength / 2 > TABLE_MIN && 
+            mem->unmaplistlength / 4 > mem->unmaplastindex + 1)
+                mem->unmaplistlength /= 2;
+        mem->unmapidentifiers = realloc(mem->unmapidentifiers, 
+            sizeof(uint32_t) * mem->unmaplistlength);
+
+        mem->compactat = 2 * kept;
+        if (mem->compactat < TABLE_COMPACT_MIN)
+                mem->compactat = TABLE_COMPACT_MIN;
+        mem->compactions++;
+}
+
+/* Function: table_report
+ * Does: Prints the size of the segment table and free-identifier stack
+ * Paramters: memory, FILE*
+ * Returns: None
+ */
+static void table_report(memory mem, FILE *out)
+{
+        fprintf(out, "table: %u identifiers, capacity %u, %u free, "
+            "%llu compactions\n", mem->memlength, mem->memcapacity, 
+            mem->unmaplastindex, (unsigned long long)mem->compactions);
+}
 
+static inline void free_mem(memory mem)
+{
         int length = mem->memlength;
 
         /* Frees each mem_seg struct*/
         for (int i = 0; i < length; i++) {
                 if (mem->segments[i] != NULL)
-                        free(mem->segments[i]);
+                        seg_release(mem, mem->segments[i]);
         }
 
         free(mem->segments);
+        pool_destroy(&mem->pool);
 
         if (mem->unmapidentifiers != NULL) {
                 free(mem->unmapidentifiers);
         }
 
+        free(mem->decoded);
+        cache_destroy(&mem->cache);
+
         free(mem);
 }
 
 
-/******************************************************
-*
-* Functions from ops_interface
-*
-******************************************************/
-
-
-/* Function: initialize_regs
- * Does: Initializes registers
- * Paramters: None
- * Returns: UArray_T
+/* Function: decode_prog
+ * Does: Rebuilds the pre-decoded copy of segment 0, followed by a halt 
+ *       entry so running off the end stops the program. Takes it from the 
+ *       decode cache when the same words were decoded before.
+ * Paramters: memory
+ * Returns: None
  */
-static inline void initialize_regs(uint32_t registers[])
+static inline void decode_prog(memory mem)
 {
-        /* Sets the values of all registers to 0 */
-        for (int i = 0; i < 8; i++) {
-                registers[i] = 0;
+        uint32_t length = mem->segments[0][1];
+
+        if (length + 1 > mem->decodedlength) {
+                free(mem->decoded);
+                mem->decoded = malloc(sizeof(instr) * (length + 1));
+                mem->decodedlength = length + 1;
         }
-}
 
-/* Function: free_regs
- * Does: Frees registers
- * Paramters: UArray_T
- * Returns: None
- */
-static inline uint32_t at_reg(uint32_t registers[], unsigned index)
-{    
-        if (index > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        uint64_t hash = cache_hash(mem->segments[0]);
+
+        mem->loops = false;
+        if (cache_fetch(mem, hash)) {
+                for (uint32_t i = 0; i < length && !mem->loops; i++)
+                        mem->loops = mem->decoded[i].opcode >> FUSE_SHIFT == 
+                            FUSE_BULK_LOOP;
+                return;
         }
 
-        return registers[index];
+        unsigned a, b, c, lvalue;
+        uint32_t opcode;
+
+        for (uint32_t i = 0; i < length; i++) {
+                decode_word(mem->segments[0][i + 2], &opcode, &a, &b, &c, 
+                    &lvalue);
+                mem->decoded[i] = (instr){ opcode, a, b, c, lvalue };
+        }
+
+        decode_word(HALT_SENTINEL, &opcode, &a, &b, &c, &lvalue);
+        mem->decoded[length] = (instr){ opcode, a, b, c, lvalue };
+
+        for (uint32_t i = 0; i < length; i++)
+                fuse_entry(mem, i);
+        for (uint32_t i = 0; i < length; i++)
+                mark_loop(mem, i);
+
+        cache_store(mem, hash);
 }
 
-/* Function: update_reg
- * Does: Updates a specified register to a specified value
- * Paramters: UArray_T, unsigned, uint32_t
+/* Function: decode_entry
+ * Does: Re-decodes the word at the given offset of segment 0, along with 
+ *       the marks of the sequences that may include it
+ * Paramters: memory, uint32_t
  * Returns: None
  */
-static inline void update_reg(uint32_t registers[], unsigned index, 
-    uint32_t word)
+static inline void decode_entry(memory mem, uint32_t offset)
 {
-        if (index > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        if (offset >= mem->segments[0][1])
+                return;
+
+        uint32_t opcode;
+        unsigned a, b, c, lvalue;
+        uint8_t marked = mem->decoded[offset].opcode;
+        decode_word(mem->segments[0][offset + 2], &opcode, &a, &b, &c, 
+            &lvalue);
+        mem->decoded[offset] = (instr){ opcode, a, b, c, lvalue };
+
+        /* Marks other than loops depend only on opcodes, so a word that 
+         * keeps its opcode keeps them all
+         */
+        if ((marked & OPCODE_MASK) == opcode) {
+                mem->decoded[offset].opcode = marked;
+                if (mem->loops)
+                        remark_loops(mem, offset);
+                return;
         }
 
-        registers[index] = word;
+        for (uint32_t i = offset < 2 ? 0 : offset - 2; i <= offset; i++)
+                fuse_entry(mem, i);
+        if (mem->loops)
+                remark_loops(mem, offset);
 }
 
-/* Function: decode_word
- * Does: Decodes a given word and puts the appropriate bits into
-         appropriate parameters
- * Paramters: uint32_t, uint32_t*, unsigned*, unsigned*, unsigned*, unsigned*
+/* Function: remark_loops
+ * Does: Checks again the bulk loops a changed word of a program that has 
+ *       them may start or be part of. They reach back further than the 
+ *       other sequences and depend on operands as well as opcodes.
+ * Paramters: memory, uint32_t
  * Returns: None
  */
-static inline void decode_word(uint32_t word, uint32_t *opcode, unsigned *a, 
-    unsigned *b, unsigned *c, unsigned *lvalue)
+static void remark_loops(memory mem, uint32_t offset)
 {
-        *opcode = (uint32_t)Bitpack_getu(word, 4, 28);
+        uint32_t first = offset < LOOP_MAX_WORDS - 1 ? 0 : 
+            offset - (LOOP_MAX_WORDS - 1);
 
-        if (*opcode == 13) {
-                *a = (unsigned)Bitpack_getu(word, 3, 25);
-                *b = 0;
-                *c = 0;
-                *lvalue = (unsigned)Bitpack_getu(word, 25, 0);
-        } else {
-                *a = (unsigned)Bitpack_getu(word, 3, 6);
-                *b = (unsigned)Bitpack_getu(word, 3, 3);
-                *c = (unsigned)Bitpack_getu(word, 3, 0);
-                *lvalue = 0;
+        for (uint32_t i = first; i <= offset; i++) {
+                if (mem->decoded[i].opcode >> FUSE_SHIFT == FUSE_BULK_LOOP)
+                        fuse_entry(mem, i);
+                mark_loop(mem, i);
         }
 }
 
-/* Function: conditional move
- * Does: Performs a conditional move
- * Paramters: UArray_T, unsigned, unsigned, unsigned
+/* Function: fuse_entry
+ * Does: Marks the entry at the given offset with the sequence it starts: 
+ *       two load_values, a load_value and a load_program, two NANDs, or a 
+ *       segmented load, addition and segmented store. Clears the mark if 
+ *       it starts none. The halt entry past the end stops any match.
+ * Paramters: memory, uint32_t
  * Returns: None
  */
-static inline void conditional_move(uint32_t registers[], unsigned a, 
-    unsigned b, unsigned c)
+static inline void fuse_entry(memory mem, uint32_t offset)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
+        instr *in = &mem->decoded[offset];
+        unsigned first = in[0].opcode & OPCODE_MASK;
+        unsigned second = in[1].opcode & OPCODE_MASK;
+        fusion kind = FUSE_NONE;
+
+        if (first == 13 && second == 13)
+                kind = FUSE_LOADV_LOADV;
+        else if (first == 13 && second == 12)
+                kind = FUSE_LOADV_LOADP;
+        else if (first == 6 && second == 6)
+                kind = FUSE_NAND_NAND;
+        else if (first == 1 && second == 3 && 
+            (in[2].opcode & OPCODE_MASK) == 2)
+                kind = FUSE_LOAD_ADD_STORE;
+
+        in->opcode = first | kind << FUSE_SHIFT;
+}
 
-        if (at_reg(registers, c) == 0) {
-                return;
-        } else {
-                uint32_t temp = at_reg(registers, b);
-                update_reg(registers, a, temp);
+/* Function: mark_loop
+ * Does: Marks the entry at the given offset as the head of a bulk loop if 
+ *       it starts one, in place of the mark fuse_entry gave it
+ * Paramters: memory, uint32_t
+ * Returns: None
+ */
+static void mark_loop(memory mem, uint32_t offset)
+{
+        instr *in = &mem->decoded[offset];
+        unsigned first = in[0].opcode & OPCODE_MASK;
+        unsigned second = in[1].opcode & OPCODE_MASK;
+
+        if (((first == 1 && second == 2) || (first == 2 && second == 3)) && 
+            match_loop(in, offset, NULL)) {
+                in->opcode = first | FUSE_BULK_LOOP << FUSE_SHIFT;
+                mem->loops = true;
         }
 }
 
-/* Function: segmented_load
- * Does: Performs a segmented load
- * Paramters: UArray_T, Seq_T, unsigned, unsigned
- * Returns: None
+/* Function: match_loop
+ * Does: Matches a loop at the given offset that copies or fills words 
+ *       one at a time:
+ *               sload  t <- [s][i]      (copies only)
+ *               sstore [d][j] <- t      (or a value register v to fill)
+ *               add    i <- i + k
+ *               add    j <- j + k       (only if j is not i)
+ *               add    n <- n + c
+ *               loadv  x <- exit
+ *               loadv  y <- head        (optional)
+ *               cmov   x <- y if n
+ *               loadp  z, x
+ *       Either order of an addition's operands matches. The registers it 
+ *       writes must all differ, except that x may be t, and none may be 
+ *       one it only reads, so the loop's effect depends only on their 
+ *       values at the head. bulk_loop checks those. The registers go in 
+ *       m unless it is NULL.
+ * Paramters: const instr*, uint32_t, loop_match*
+ * Returns: whether there is such a loop
  */
-static inline void segmented_load(uint32_t registers[], memory mem, unsigned a, 
-    unsigned b, unsigned c)
+static bool match_loop(const instr *in, uint32_t head, loop_match *m)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        const instr *p = in;
+        unsigned written = 0, read = 0;
+        loop_match unused;
+
+        if (m == NULL)
+                m = &unused;
+
+/* Adds a register to those written, failing if it is there already */
+#define WRITES(reg) do { if (written >> (reg) & 1) return false;        \
+        written |= 1u << (reg); } while (0)
+#define OP(entry) ((entry).opcode & OPCODE_MASK)
+/* Matches an addition of reg and another register, which goes in other */
+#define ADDS(entry, reg, other)                                         \
+        (OP(entry) == 3 && (entry).a == (reg) &&                        \
+        ((entry).b == (reg) ? ((other) = (entry).c, true) :             \
+        (entry).c == (reg) ? ((other) = (entry).b, true) : false))
+
+        *m = (loop_match){ .copy = OP(*p) == 1 };
+        if (m->copy) {
+                m->t = p->a;
+                m->s = p->b;
+                m->i = p->c;
+                WRITES(m->t);
+                read |= 1u << m->s;
+                p++;
+                if (OP(*p) != 2 || p->c != m->t)
+                        return false;
+        } else {
+                if (OP(*p) != 2)
+                        return false;
+                m->v = p->c;
+                m->i = p->b;
+                read |= 1u << m->v;
         }
 
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
+        m->d = p->a;
+        m->j = p->b;
+        read |= 1u << m->d;
+        p++;
+
+        if (!ADDS(*p, m->i, m->k))
+                return false;
+        WRITES(m->i);
+        p++;
+
+        if (m->j != m->i) {
+                unsigned k;
+
+                if (!ADDS(*p, m->j, k) || k != m->k)
+                        return false;
+                WRITES(m->j);
+                p++;
         }
-        
-        unsigned val_b = at_reg(registers, b);
-        unsigned val_c = at_reg(registers, c);
 
-        uint32_t new_word = get_word(mem, val_b, val_c);
-        update_reg(registers, a, new_word); 
+        m->n = p->a;
+        if (!ADDS(*p, m->n, m->step))
+                return false;
+        WRITES(m->n);
+        read |= 1u << m->k | 1u << m->step;
+        p++;
+
+        if (OP(*p) != 13)
+                return false;
+        m->x = p->a;
+        m->exit = p->lvalue;
+        if (!m->copy || m->x != m->t)
+                WRITES(m->x);
+        p++;
+
+        m->loady = OP(*p) == 13;
+        if (m->loady) {
+                if (p->lvalue != head)
+                        return false;
+                m->y = p->a;
+                WRITES(m->y);
+                p++;
+        } else {
+                m->y = p->b;
+                read |= 1u << m->y;
+        }
+
+        if (OP(p[0]) != 0 || p[0].a != m->x || p[0].b != m->y || 
+            p[0].c != m->n || OP(p[1]) != 12 || p[1].c != m->x)
+                return false;
+        m->z = p[1].b;
+        read |= 1u << m->z;
+
+#undef WRITES
+#undef OP
+#undef ADDS
+        return (written & read) == 0;
 }
 
-/* Function: segmented_store
- * Does: Performs a segmented store
- * Paramters: UArray_T, Seq_T, unsigned, unsigned
- * Returns: None
+/* Function: bulk_loop
+ * Does: Runs all the iterations of the loop that starts at head at once, 
+ *       when k holds 1, c holds 1 or 2^32 - 1 and n is not 0, so the 
+ *       loop runs -n or n times, y holds head unless the loop loads it, 
+ *       z holds 0, the destination is not segment 0 and every index stays 
+ *       inside its segment. A copy within one segment whose destination 
+ *       starts inside the source and after it repeats words, so it runs 
+ *       as a loop too. Leaves the registers and pc as the last iteration 
+ *       would have.
+ * Paramters: memory, uint32_t[], const instr*, uint32_t
+ * Returns: the pc to go on from, or LOOP_DECLINED, having changed nothing, 
+ *          if the loop must run normally
  */
-static inline void segmented_store(uint32_t registers[], memory mem, 
-    unsigned a, unsigned b, unsigned c)
+static uint32_t bulk_loop(memory mem, uint32_t r[], const instr *in, 
+    uint32_t head)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        loop_match m;
+
+        if (!match_loop(in, head, &m))
+                return LOOP_DECLINED;
+
+        uint32_t words = r[m.step] == 1 ? -r[m.n] : 
+            r[m.step] == UINT32_MAX ? r[m.n] : 0;
+        uint32_t dst_seg = r[m.d];
+        uint32_t to = r[m.j];
+
+        if (words == 0 || r[m.k] != 1 || r[m.z] != 0 || 
+            (!m.loady && r[m.y] != head) || dst_seg == 0 || 
+            dst_seg >= mem->memlength || mem->segments[dst_seg] == NULL ||
+            (uint64_t)to + words > mem->segments[dst_seg][1])
+                return LOOP_DECLINED;
+
+        uint32_t src_seg = 0, from = 0;
+
+        if (m.copy) {
+                src_seg = r[m.s];
+                from = r[m.i];
+                if (src_seg >= mem->memlength || 
+                    mem->segments[src_seg] == NULL ||
+                    (uint64_t)from + words > mem->segments[src_seg][1] ||
+                    (src_seg == dst_seg && from < to && to - from < words))
+                        return LOOP_DECLINED;
         }
 
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
+        uint32_t *dst = mem->segments[dst_seg];
+        if (dst[0] > 1)
+                dst = seg_own(mem, dst_seg);
+        dst += 2 + to;
+
+        if (m.copy) {
+                const uint32_t *src = mem->segments[src_seg] + 2 + from;
+
+                r[m.t] = src[words - 1];
+                memmove(dst, src, sizeof(uint32_t) * words);
+        } else {
+                uint32_t value = r[m.v];
+
+                for (uint32_t w = 0; w < words; w++)
+                        dst[w] = value;
         }
-        
-        unsigned val_a = at_reg(registers, a);
-        unsigned val_b = at_reg(registers, b);
-        unsigned val_c = at_reg(registers, c);
 
-        put_word(mem, val_a, val_b, val_c);
+        r[m.i] += words;
+        if (m.j != m.i)
+                r[m.j] += words;
+        r[m.n] = 0;
+        r[m.x] = m.exit;
+        r[m.y] = head;
+
+        return m.exit;
 }
 
-/* Function: addition
- * Does: Performs an addition
- * Paramters: UArray_T, unsigned, unsigned, unsigned
- * Returns: None
+
+/******************************************************
+*
+* Functions from seg_pool
+*
+******************************************************/
+
+/* Function: pool_class
+ * Does: Finds the size class of a block of the given number of words
+ * Paramters: uint64_t
+ * Returns: log2 of the class size in words
  */
-static inline void addition(uint32_t registers[], unsigned a, unsigned b, 
-    unsigned c)
+static inline unsigned pool_class(uint64_t words)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stderr, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        uint32_t first = at_reg(registers, b);
-        uint32_t second = at_reg(registers, c);
-        uint32_t sum = (first + second) % 4294967296;
+        if (words <= (1u << POOL_MIN_CLASS))
+                return POOL_MIN_CLASS;
 
-        update_reg(registers, a, sum);
+        return 64 - __builtin_clzll(words - 1);
 }
 
-/* Function: multiplication
- * Does: Performs a multiplication
- * Paramters: UArray_T, unsigned, unsigned, unsigned
- * Returns: None
+/* Function: arena_init
+ * Does: Reserves the arena that every segment is carved out of from now on
+ * Paramters: seg_pool*
+ * Returns: false if no arena could be reserved
  */
-static inline void multiplication (uint32_t registers[], unsigned a, 
-    unsigned b, unsigned c)
+static bool arena_init(seg_pool *pool)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        for (size_t bytes = ARENA_BYTES; bytes >= ARENA_MIN_BYTES; 
+            bytes /= 2) {
+                void *arena = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+                if (arena != MAP_FAILED) {
+                        pool->arena = arena;
+                        pool->arenatop = arena;
+                        pool->arenabytes = bytes;
+                        return true;
+                }
         }
 
-        uint32_t first = at_reg(registers, b);
-        uint32_t second = at_reg(registers, c);
-        uint32_t product = (first * second) % 4294967296;
-
-        update_reg(registers, a, product);
+        return false;
 }
 
-/* Function: division
- * Does: Performs a division
- * Paramters: UArray_T, unsigned, unsigned, unsigned
- * Returns: None
+/* Function: arena_alloc
+ * Does: Takes a block of the given size class from its free list, or else 
+ *       from the top of the arena
+ * Paramters: seg_pool*, unsigned
+ * Returns: the block, or NULL once the arena is full
  */
-static inline void division(uint32_t registers[], unsigned a, unsigned b, 
-    unsigned c)
+static inline uint32_t *arena_alloc(seg_pool *pool, unsigned class)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        size_t bytes = (size_t)sizeof(uint32_t) << class;
+        uint32_t *seg = pool->freelists[class];
+
+        if (seg != NULL) {
+                pool->hits++;
+                memcpy(&pool->freelists[class], seg, sizeof(uint32_t *));
+                if (class > POOL_MAX_CLASS)
+                        pool->heldmapped -= bytes;
+                else
+                        pool->held -= bytes;
+                return seg;
         }
 
-        uint32_t first = at_reg(registers, b);
-        uint32_t second = at_reg(registers, c);
-        uint32_t quotient = (first / second) % 4294967296;
+        /* Large blocks start on a page, so seg_free can release them */
+        if (class > POOL_MAX_CLASS) {
+                size_t page = (size_t)sysconf(_SC_PAGESIZE);
+                size_t used = (size_t)(pool->arenatop - pool->arena);
 
-        update_reg(registers, a, quotient);
+                pool->arenatop = pool->arena + (used + page - 1) / page * 
+                    page;
+        }
+
+        pool->misses++;
+        if ((size_t)(pool->arenatop - pool->arena) > pool->arenabytes || 
+            bytes > pool->arenabytes - (size_t)(pool->arenatop - 
+            pool->arena))
+                return NULL;
+
+        seg = (uint32_t *)(void *)pool->arenatop;
+        pool->arenatop += bytes;
+
+        return seg;
 }
 
-/* Function: bitwise_NAND
- * Does: Performs a bitwise NAND
- * Paramters: UArray_T, unsigned, unsigned, unsigned
- * Returns: None
+/* Function: pool_map
+ * Does: Takes a block of a class above POOL_MAX_CLASS from its free list, 
+ *       or else maps a new one. Either way its words read as zero.
+ * Paramters: seg_pool*, unsigned
+ * Returns: the block, or NULL if it could not be mapped
  */
-static inline void bitwise_NAND(uint32_t registers[], unsigned a, unsigned b, 
-    unsigned c)
+static inline uint32_t *pool_map(seg_pool *pool, unsigned class)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        size_t bytes = (size_t)sizeof(uint32_t) << class;
+        uint32_t *seg = pool->freelists[class];
+
+        if (seg != NULL) {
+                pool->hits++;
+                memcpy(&pool->freelists[class], seg, sizeof(uint32_t *));
+                pool->heldmapped -= bytes;
+                return seg;
         }
 
-        uint32_t first = at_reg(registers, b);
-        uint32_t second = at_reg(registers, c);
-        uint32_t result = first & second;
-        result = ~result;
-        update_reg(registers, a, result);
+        pool->misses++;
+        seg = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        return seg == MAP_FAILED ? NULL : seg;
 }
 
-/* Function: halt
- * Does: Halts the program
- * Paramters: Seq_T, uint32_t*
- * Returns: None
+/* Function: seg_zeroed
+ * Does: Tells whether seg_alloc hands out segments of the given length 
+ *       already cleared, which it does for blocks above POOL_MAX_CLASS
+ * Paramters: uint32_t
+ * Returns: bool
  */
-static inline void halt(memory mem, uint32_t *prog_count)
+static inline bool seg_zeroed(uint32_t num_words)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized"); 
-                exit(EXIT_FAILURE); 
-        }
-        
-        *prog_count = mem->segments[0][1];
+        return pool_class((uint64_t)num_words + 2) > POOL_MAX_CLASS;
 }
 
-/* Function: map_segment
- * Does: Maps a segment with a specified number of words
- * Paramters: UArray_T, Seq_T, Seq_T, unsigned, unsigned
- * Returns: None
+/* Function: slab_of
+ * Does: Finds the slab a block of a slab class was carved from
+ * Paramters: uint32_t*
+ * Returns: slab_header*
  */
-static inline void map_segment(uint32_t registers[], memory mem, unsigned b, 
-    unsigned c)
+static inline slab_header *slab_of(uint32_t *seg)
 {
-        if (b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
+        return (slab_header *)((uintptr_t)seg & 
+            ~(uintptr_t)(POOL_SLAB_BYTES - 1));
+}
 
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
+/* Function: seg_alloc
+ * Does: Allocates a mapped segment of num_words words plus its header, 
+ *       reusing a pooled block of the same size class when there is one. 
+ *       The words are not cleared unless seg_zeroed says so.
+ * Paramters: memory, uint32_t
+ * Returns: uint32_t*
+ */
+static inline uint32_t *seg_alloc(memory mem, uint32_t num_words)
+{
+        seg_pool *pool = &mem->pool;
+        uint64_t words = (uint64_t)num_words + 2;
+        unsigned class = pool_class(words);
+        uint32_t *seg;
+
+        if (pool->arena != NULL) {
+                seg = arena_alloc(pool, class);
+        } else if (class > POOL_MAX_CLASS) {
+                seg = pool_map(pool, class);
+        } else if (pool->freelists[class] != NULL) {
+                size_t bytes = sizeof(uint32_t) << class;
+
+                pool->hits++;
+                seg = pool->freelists[class];
+                memcpy(&pool->freelists[class], seg, sizeof(uint32_t *));
+                pool->held -= bytes;
+                if (class > POOL_SLAB_CLASS) {
+                        pool->heldlarge -= bytes;
+                } else {
+                        pool->heldslab -= bytes;
+                        slab_of(seg)->live++;
+                }
+        } else if (class > POOL_SLAB_CLASS) {
+                pool->misses++;
+                seg = malloc(sizeof(uint32_t) << class);
+        } else {
+                size_t bytes = sizeof(uint32_t) << class;
+
+                pool->misses++;
+                if (pool->slableft < bytes) {
+                        void *slab;
+
+                        if (posix_memalign(&slab, POOL_SLAB_BYTES, 
+                            POOL_SLAB_BYTES) != 0)
+                                um_fail(mem, UM_ERROR_MEMORY, "Out of "
+                                    "memory mapping a segment of %u words", 
+                                    num_words);
+                        ((slab_header *)slab)->next = pool->slabs;
+                        ((slab_header *)slab)->live = 0;
+                        pool->slabs = slab;
+                        pool->slabtop = pool->slabs + POOL_SLAB_HEADER;
+                        pool->slableft = POOL_SLAB_BYTES - POOL_SLAB_HEADER;
+                }
+                seg = (uint32_t *)(void *)pool->slabtop;
+                pool->slabtop += bytes;
+                pool->slableft -= bytes;
+                slab_of(seg)->live++;
         }
-        
-        unsigned num_words = at_reg(registers, c);
-        uint32_t curr_memsize = mem->memlength;
-        uint32_t new_index;
-
-        /* Checks if there are any unmapped segments */
-        if (mem->unmaplastindex != 0) {
-                /* Gets the segment number of an unmapped segment */
-                new_index = mem->unmapidentifiers[mem->unmaplastindex];
-                (mem->unmaplastindex)--;
 
-                mem->segments[new_index] = 
-                    malloc(sizeof(uint32_t) * (num_words + 2));
-                mem->segments[new_index][0] = 1;
-                mem->segments[new_index][1] = num_words;
+        if (seg == NULL)
+                um_fail(mem, UM_ERROR_MEMORY, "Out of memory mapping a "
+                    "segment of %u words", num_words);
 
-        } else {
-                /* Creates a new struct */
-                size_t newsize = (curr_memsize + 1) * sizeof(uint32_t*);
-                mem->segments = realloc(mem->segments, newsize);
-                (mem->memlength)++;
+        seg[0] = 1;
+        seg[1] = num_words;
 
-                new_index = curr_memsize;
+        return seg;
+}
 
-                mem->segments[new_index] = 
-                    malloc(sizeof(uint32_t) * (num_words + 2));
-                mem->segments[new_index][0] = 1;
-                mem->segments[new_index][1] = num_words;
+/* Function: seg_free
+ * Does: Returns a segment to the free list of its size class, or to 
+ *       malloc if the pool is past its high-water mark. A slab block past 
+ *       the mark sweeps the idle slabs. A block above POOL_MAX_CLASS gives 
+ *       its pages back first, and is unmapped if the pool already keeps 
+ *       POOL_MAPPED_BYTES of them.
+ * Paramters: memory, uint32_t*
+ * Returns: None
+ */
+static inline void seg_free(memory mem, uint32_t *seg)
+{
+        seg_pool *pool = &mem->pool;
+        unsigned class = pool_class((uint64_t)seg[1] + 2);
+        size_t bytes = (size_t)sizeof(uint32_t) << class;
+
+        if (class > POOL_MAX_CLASS) {
+                if (pool->arena == NULL && 
+                    pool->heldmapped + bytes > POOL_MAPPED_BYTES) {
+                        pool->released++;
+                        munmap(seg, bytes);
+                        return;
+                }
+                madvise(seg, bytes, MADV_DONTNEED);
+                memcpy(seg, &pool->freelists[class], sizeof(uint32_t *));
+                pool->freelists[class] = seg;
+                pool->heldmapped += bytes;
+                return;
         }
 
-        /* Sets all words to 0 */
-        for (unsigned i = 0; i < num_words; i++) {
-                mem->segments[new_index][i + 2] = 0;
+        if (pool->arena == NULL && class > POOL_SLAB_CLASS) {
+                if (pool->heldlarge + bytes > POOL_HIGH_WATER) {
+                        pool->released++;
+                        free(seg);
+                        return;
+                }
+                pool->heldlarge += bytes;
         }
 
-        update_reg(registers, b, new_index);
+        memcpy(seg, &pool->freelists[class], sizeof(uint32_t *));
+        pool->freelists[class] = seg;
+        pool->held += bytes;
+
+        if (pool->arena == NULL && class <= POOL_SLAB_CLASS) {
+                slab_of(seg)->live--;
+                pool->heldslab += bytes;
+                if (pool->heldslab > POOL_HIGH_WATER && 
+                    pool->heldslab > pool->slabsweep)
+                        slab_sweep(pool);
+        }
 }
 
-/* Function: unmap_segment
- * Does: Maps the segment at a specified index
- * Paramters: UArray_T, Seq_T, Seq_T, unsigned
+/* Function: slab_sweep
+ * Does: Frees the slabs with no block in use, but the one being carved, 
+ *       after taking their blocks off the free lists. The next sweep waits 
+ *       until the pool holds twice what is left, so one that frees little 
+ *       is not repeated on every unmap.
+ * Paramters: seg_pool*
  * Returns: None
  */
-static inline void unmap_segment(uint32_t registers[], memory mem, unsigned c)
+static void slab_sweep(seg_pool *pool)
 {
-        if (c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        for (unsigned class = 0; class <= POOL_SLAB_CLASS; class++) {
+                size_t bytes = (size_t)sizeof(uint32_t) << class;
+                uint32_t *prev = NULL;
+                uint32_t *seg = pool->freelists[class];
+
+                while (seg != NULL) {
+                        uint32_t *next;
+                        slab_header *slab = slab_of(seg);
+
+                        memcpy(&next, seg, sizeof(uint32_t *));
+                        if (slab->live == 0 && (char *)slab != pool->slabs) {
+                                if (prev == NULL)
+                                        pool->freelists[class] = next;
+                                else
+                                        memcpy(prev, &next, 
+                                            sizeof(uint32_t *));
+                                pool->held -= bytes;
+                                pool->heldslab -= bytes;
+                        } else {
+                                prev = seg;
+                        }
+                        seg = next;
+                }
         }
 
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-        
-        unsigned index = (unsigned)at_reg(registers, c);
+        slab_header *prev = (slab_header *)(void *)pool->slabs;
 
-        if (index == 0) {
-                fprintf(stdout, "Error: Cannot unmap segment 0");  
-                exit(EXIT_FAILURE);
-        }
+        while (prev != NULL && prev->next != NULL) {
+                slab_header *slab = (slab_header *)(void *)prev->next;
 
-        /* Checks if the segment is already unmapped*/
-        if (mem->segments[index][0] != 0) {
-                free(mem->segments[index]);
-                mem->segments[index] = NULL;
-        } else {
-                fprintf(stdout, "Error: Unmapping an unmapped segment");
-                exit(EXIT_FAILURE);
+                if (slab->live == 0) {
+                        prev->next = slab->next;
+                        free(slab);
+                        pool->released++;
+                } else {
+                        prev = slab;
+                }
         }
 
-        if (mem->unmaplastindex == (mem->unmaplistlength - 1)) {
-                size_t newsize = sizeof(uint32_t) * (mem->unmaplistlength * 2);
-                mem->unmapidentifiers = realloc(mem->unmapidentifiers, newsize);
-                mem->unmaplistlength = mem->unmaplistlength * 2;
-        } 
-        
-        (mem->unmaplastindex)++;
-        mem->unmapidentifiers[mem->unmaplastindex] = index;
-        
+        pool->slabsweep = 2 * pool->heldslab;
 }
 
-/* Function: output
- * Does: Outputs the value at the given register
- * Paramters: UArray_T, unsigned
- * Returns: None
+/* Function: seg_share
+ * Does: Adds a reference to a segment's storage; word 0 of the header 
+ *       counts the segment table entries that point at it
+ * Paramters: uint32_t*
+ * Returns: uint32_t*
  */
-static inline void output(uint32_t registers[], unsigned c)
+static inline uint32_t *seg_share(uint32_t *seg)
 {
-        if (c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        io_output(at_reg(registers, c));
+        seg[0]++;
+        return seg;
 }
 
-/* Function: input
- * Does: Takes input and stores it in the given register
- * Paramters: UArray_T, unsigned
+/* Function: seg_release
+ * Does: Drops a reference to a segment's storage, freeing it with the last.
+ *       Storage inside a mapped native image or snapshot is left in place, 
+ *       and the mapping goes once none of its segments are in use.
+ * Paramters: memory, uint32_t*
  * Returns: None
  */
-static inline void input(uint32_t registers[], unsigned c)
+static inline void seg_release(memory mem, uint32_t *seg)
 {
-        if (c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        if (--seg[0] != 0)
+                return;
+
+        if ((uintptr_t)seg - (uintptr_t)mem->image < mem->imagebytes) {
+                if (--mem->imagerefs == 0) {
+                        munmap(mem->image, mem->imagebytes);
+                        mem->image = NULL;
+                        mem->imagebytes = 0;
+                }
+        } else {
+                seg_free(mem, seg);
         }
+}
 
-        uint32_t userinput = io_input();
-        if (userinput == (unsigned)EOF) {
-                userinput = ~0;      
-        } 
+/* Function: seg_own
+ * Does: Gives a segment whose storage is shared its own copy before it is 
+ *       written
+ * Paramters: memory, uint32_t
+ * Returns: the segment's new storage
+ */
+static inline uint32_t *seg_own(memory mem, uint32_t seg_num)
+{
+        uint32_t *shared = mem->segments[seg_num];
+        uint32_t length = shared[1];
+        uint32_t *copy = seg_alloc(mem, length);
 
-        update_reg(registers, c, userinput);
+        memcpy(copy + 2, shared + 2, sizeof(uint32_t) * length);
+        shared[0]--;
+        mem->segments[seg_num] = copy;
+
+        return copy;
 }
 
-/* Function: load_program
- * Does: Loads the sgment at the spcified index into the program
- * Paramters: Seq_T, UArray_T, uint32_t*, unsigned, unsigned
+/* Function: pool_destroy
+ * Does: Frees the slabs and every pooled block that came from malloc
+ * Paramters: seg_pool*
  * Returns: None
  */
-static inline void load_program(memory mem, uint32_t registers[], 
-        uint32_t *prog_count, unsigned b, unsigned c)
+static void pool_destroy(seg_pool *pool)
 {
-        if (b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        if (pool->arena != NULL) {
+                munmap(pool->arena, pool->arenabytes);
+                pool->arena = NULL;
+                memset(pool->freelists, 0, sizeof(pool->freelists));
+                return;
         }
 
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-        
-        uint32_t seg_num = at_reg(registers, b);
+        for (unsigned class = POOL_MAX_CLASS + 1; class <= ARENA_MAX_CLASS; 
+            class++) {
+                uint32_t *seg = pool->freelists[class];
 
-        if (seg_num == 0) {
-                *prog_count = at_reg(registers, c);
-                return;
+                while (seg != NULL) {
+                        uint32_t *next;
+                        memcpy(&next, seg, sizeof(uint32_t *));
+                        munmap(seg, (size_t)sizeof(uint32_t) << class);
+                        seg = next;
+                }
         }
 
-        /* Makes a deep copy of the segment to be duplicated*/
+        for (unsigned class = POOL_SLAB_CLASS + 1; class <= POOL_MAX_CLASS; 
+            class++) {
+                uint32_t *seg = pool->freelists[class];
 
-        int length = mem->segments[seg_num][1];
-        uint32_t* duplicate = malloc((length + 2) * sizeof(uint32_t));
-
-        /* Copies each word */
-        for (int i = 0; i < length + 2; i++) {
-                duplicate[i] = mem->segments[seg_num][i];
+                while (seg != NULL) {
+                        uint32_t *next;
+                        memcpy(&next, seg, sizeof(uint32_t *));
+                        free(seg);
+                        seg = next;
+                }
         }
 
-        /* Abandons the original program segment */
-        free(mem->segments[0]);
+        while (pool->slabs != NULL) {
+                char *next = ((slab_header *)(void *)pool->slabs)->next;
 
-        mem->segments[0] = duplicate;
+                free(pool->slabs);
+                pool->slabs = next;
+        }
 
-        *prog_count = at_reg(registers, c);
+        memset(pool->freelists, 0, sizeof(pool->freelists));
 }
 
-/* Function: load_value
- * Does: Loadsa the given value to the given register
- * Paramters: UArray_T, unsigned, unsigned
+/* Function: pool_report
+ * Does: Prints the pool's hit, miss and release counts and the bytes it 
+ *       holds
+ * Paramters: seg_pool*, FILE*
  * Returns: None
  */
-static inline void load_value(uint32_t registers[], unsigned a, unsigned lvalue)
+static void pool_report(seg_pool *pool, FILE *out)
 {
-        if (a > 7) {
-                fprintf(stderr, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        update_reg(registers, a, lvalue);
+        fprintf(out, "pool: %llu hits, %llu misses, %llu released, "
+            "%zu bytes held, %zu bytes of released mappings\n", 
+            (unsigned long long)pool->hits, 
+            (unsigned long long)pool->misses, 
+            (unsigned long long)pool->released, pool->held, 
+            pool->heldmapped);
+
+        if (pool->arena != NULL)
+                fprintf(out, "arena: %zu bytes carved of %zu reserved\n", 
+                    (size_t)(pool->arenatop - pool->arena), 
+                    pool->arenabytes);
 }
 
+
 /******************************************************
 *
-* Functions from io_dev
+* Functions from decode_cache
 *
 ******************************************************/
 
-static inline uint32_t io_input()
+/* Function: cache_hash
+ * Does: Hashes a segment's length and words with FNV-1a
+ * Paramters: const uint32_t*
+ * Returns: uint64_t
+ */
+static uint64_t cache_hash(const uint32_t *seg)
 {
-        char value = fgetc(stdin);
-        
-        return value;
-}
+        uint64_t hash = (FNV_SEED ^ seg[1]) * FNV_PRIME;
+
+        for (uint32_t i = 0; i < seg[1]; i++)
+                hash = (hash ^ seg[i + 2]) * FNV_PRIME;
+
+        return hash;
+}
+
+static inline size_t cache_entry_bytes(uint32_t length)
+{
+        return sizeof(uint32_t) * (size_t)length + 
+            sizeof(instr) * ((size_t)length + 1);
+}
+
+static void cache_path(decode_cache *cache, uint64_t hash, char *path, 
+    size_t size)
+{
+        snprintf(path, size, "%s/%016llx.umd", cache->dir, 
+            (unsigned long long)hash);
+}
+
+static void cache_evict(decode_cache *cache, cache_entry *entry)
+{
+        cache->bytes -= cache_entry_bytes(entry->length);
+        free(entry->words);
+        free(entry->decoded);
+        memset(entry, 0, sizeof(*entry));
+}
+
+/* Function: cache_insert
+ * Does: Keeps a copy of segment 0 and its decoded entries, evicting the 
+ *       least recently used programs to make room
+ * Paramters: memory, uint64_t
+ * Returns: None
+ */
+static void cache_insert(memory mem, uint64_t hash)
+{
+        decode_cache *cache = &mem->cache;
+        uint32_t length = mem->segments[0][1];
+        size_t bytes = cache_entry_bytes(length);
+
+        if (bytes > CACHE_MAX_BYTES)
+                return;
+
+        cache_entry *entry;
+
+        for (;;) {
+                cache_entry *oldest = NULL;
+
+                entry = NULL;
+                for (unsigned i = 0; i < CACHE_SLOTS; i++) {
+                        cache_entry *e = &cache->entries[i];
+
+                        if (e->words == NULL && entry == NULL)
+                                entry = e;
+                        else if (e->words != NULL && (oldest == NULL || 
+                            e->used < oldest->used))
+                                oldest = e;
+                }
+
+                if (entry != NULL && cache->bytes + bytes <= CACHE_MAX_BYTES)
+                        break;
+                cache_evict(cache, oldest);
+        }
+
+        entry->words = malloc(sizeof(uint32_t) * (size_t)length);
+        entry->decoded = malloc(sizeof(instr) * ((size_t)length + 1));
+        if (entry->words == NULL || entry->decoded == NULL) {
+                free(entry->words);
+                free(entry->decoded);
+                entry->words = NULL;
+                entry->decoded = NULL;
+                return;
+        }
+
+        memcpy(entry->words, mem->segments[0] + 2, 
+            sizeof(uint32_t) * (size_t)length);
+        memcpy(entry->decoded, mem->decoded, 
+            sizeof(instr) * ((size_t)length + 1));
+        entry->hash = hash;
+        entry->length = length;
+        entry->used = ++cache->clock;
+        cache->bytes += bytes;
+}
+
+/* Function: cache_read
+ * Does: Looks for segment 0 in the cache directory, filling the decoded 
+ *       program from the file if its words match
+ * Paramters: memory, uint64_t
+ * Returns: whether the file was there and matched
+ */
+static bool cache_read(memory mem, uint64_t hash)
+{
+        char path[4096];
+        uint32_t length = mem->segments[0][1];
+        size_t bytes = 3 * sizeof(uint32_t) + sizeof(uint64_t) + 
+            cache_entry_bytes(length);
+        struct stat sb;
+
+        cache_path(&mem->cache, hash, path, sizeof(path));
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return false;
+
+        if (fstat(fd, &sb) != 0 || (size_t)sb.st_size != bytes) {
+                close(fd);
+                return false;
+        }
+
+        uint32_t *file = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (file == MAP_FAILED)
+                return false;
+
+        uint64_t filehash;
+        memcpy(&filehash, file + 3, sizeof(filehash));
+
+        bool ok = file[0] == CACHE_MAGIC && file[1] == CACHE_FORMAT && 
+            file[2] == length && filehash == hash && memcmp(file + 5, 
+            mem->segments[0] + 2, sizeof(uint32_t) * (size_t)length) == 0;
+
+        if (ok)
+                memcpy(mem->decoded, file + 5 + length, 
+                    sizeof(instr) * ((size_t)length + 1));
+
+        munmap(file, bytes);
+        return ok;
+}
+
+/* Function: cache_write
+ * Does: Writes segment 0 and its decoded entries to the cache directory, 
+ *       through a temporary file so readers never see half of one
+ * Paramters: memory, uint64_t
+ * Returns: None
+ */
+static void cache_write(memory mem, uint64_t hash)
+{
+        decode_cache *cache = &mem->cache;
+        char path[4096], temp[4096 + 32];
+        uint32_t length = mem->segments[0][1];
+        uint32_t header[3] = { CACHE_MAGIC, CACHE_FORMAT, length };
+
+        cache_path(cache, hash, path, sizeof(path));
+        snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+
+        FILE *out = fopen(temp, "wb");
+        bool ok = out != NULL && 
+            fwrite(header, sizeof(uint32_t), 3, out) == 3 && 
+            fwrite(&hash, sizeof(hash), 1, out) == 1 && 
+            fwrite(mem->segments[0] + 2, sizeof(uint32_t), length, out) == 
+            length && 
+            fwrite(mem->decoded, sizeof(instr), (size_t)length + 1, out) == 
+            (size_t)length + 1;
+
+        if (out != NULL && fclose(out) != 0)
+                ok = false;
+        if (ok && rename(temp, path) != 0)
+                ok = false;
+
+        if (!ok) {
+                if (out != NULL)
+                        unlink(temp);
+                if (!cache->warned)
+                        fprintf(stderr, "Warning: Could not write to the "
+                            "decode cache in %s\n", cache->dir);
+                cache->warned = true;
+        }
+}
+
+/* Function: cache_fetch
+ * Does: Fills the decoded program from a cached copy of the same words, 
+ *       kept in memory or in the cache directory
+ * Paramters: memory, uint64_t
+ * Returns: false if it has to be decoded
+ */
+static bool cache_fetch(memory mem, uint64_t hash)
+{
+        decode_cache *cache = &mem->cache;
+        uint32_t length = mem->segments[0][1];
+
+        for (unsigned i = 0; i < CACHE_SLOTS; i++) {
+                cache_entry *entry = &cache->entries[i];
+
+                if (entry->words == NULL || entry->hash != hash || 
+                    entry->length != length || memcmp(entry->words, 
+                    mem->segments[0] + 2, sizeof(uint32_t) * 
+                    (size_t)length) != 0)
+                        continue;
+
+                memcpy(mem->decoded, entry->decoded, 
+                    sizeof(instr) * ((size_t)length + 1));
+                entry->used = ++cache->clock;
+                cache->hits++;
+                return true;
+        }
+
+        if (cache->dir != NULL && cache_read(mem, hash)) {
+                cache->diskhits++;
+                cache_note(mem, hash);
+                return true;
+        }
+
+        cache->misses++;
+        return false;
+}
+
+/* Function: cache_note
+ * Does: Keeps segment 0 and its decoded entries in memory if its hash was 
+ *       seen before, and otherwise remembers the hash, so programs loaded 
+ *       only once cost no copy
+ * Paramters: memory, uint64_t
+ * Returns: None
+ */
+static void cache_note(memory mem, uint64_t hash)
+{
+        decode_cache *cache = &mem->cache;
+
+        for (unsigned i = 0; i < CACHE_SLOTS; i++) {
+                if (cache->seen[i] == hash) {
+                        cache_insert(mem, hash);
+                        return;
+                }
+        }
+
+        cache->seen[cache->seennext] = hash;
+        cache->seennext = (cache->seennext + 1) % CACHE_SLOTS;
+}
+
+/* Function: cache_store
+ * Does: Offers the freshly decoded segment 0 to the cache, writing it to 
+ *       the cache directory if there is one
+ * Paramters: memory, uint64_t
+ * Returns: None
+ */
+static void cache_store(memory mem, uint64_t hash)
+{
+        if (mem->cache.dir != NULL)
+                cache_write(mem, hash);
+
+        cache_note(mem, hash);
+}
+
+static void cache_destroy(decode_cache *cache)
+{
+        for (unsigned i = 0; i < CACHE_SLOTS; i++) {
+                if (cache->entries[i].words != NULL)
+                        cache_evict(cache, &cache->entries[i]);
+        }
+}
+
+/* Function: cache_report
+ * Does: Prints the decode cache's hits, misses and the bytes it holds
+ * Paramters: decode_cache*, FILE*
+ * Returns: None
+ */
+static void cache_report(decode_cache *cache, FILE *out)
+{
+        fprintf(out, "decode cache: %llu hits, %llu from disk, %llu misses, "
+            "%zu bytes held\n", (unsigned long long)cache->hits, 
+            (unsigned long long)cache->diskhits, 
+            (unsigned long long)cache->misses, cache->bytes);
+}
+
+
+/******************************************************
+*
+* Functions from ops_interface
+*
+******************************************************/
+
+
+/* Function: initialize_regs
+ * Does: Initializes registers
+ * Paramters: None
+ * Returns: UArray_T
+ */
+static inline void initialize_regs(uint32_t registers[])
+{
+        /* Sets the values of all registers to 0 */
+        for (int i = 0; i < 8; i++) {
+                registers[i] = 0;
+        }
+}
+
+/* Function: free_regs
+ * Does: Frees registers
+ * Paramters: UArray_T
+ * Returns: None
+ */
+static inline uint32_t at_reg(uint32_t registers[], unsigned index)
+{    
+        return registers[index];
+}
+
+/* Function: update_reg
+ * Does: Updates a specified register to a specified value
+ * Paramters: UArray_T, unsigned, uint32_t
+ * Returns: None
+ */
+static inline void update_reg(uint32_t registers[], unsigned index, 
+    uint32_t word)
+{
+        registers[index] = word;
+}
+
+/* Function: decode_word
+ * Does: Decodes a given word and puts the appropriate bits into
+         appropriate parameters
+ * Paramters: uint32_t, uint32_t*, unsigned*, unsigned*, unsigned*, unsigned*
+ * Returns: None
+ */
+static inline void decode_word(uint32_t word, uint32_t *opcode, unsigned *a, 
+    unsigned *b, unsigned *c, unsigned *lvalue)
+{
+        *opcode = (uint32_t)Bitpack_getu(word, 4, 28);
+
+        if (*opcode == 13) {
+                *a = (unsigned)Bitpack_getu(word, 3, 25);
+                *b = 0;
+                *c = 0;
+                *lvalue = (unsigned)Bitpack_getu(word, 25, 0);
+        } else {
+                *a = (unsigned)Bitpack_getu(word, 3, 6);
+                *b = (unsigned)Bitpack_getu(word, 3, 3);
+                *c = (unsigned)Bitpack_getu(word, 3, 0);
+                *lvalue = 0;
+        }
+}
+
+/* Function: conditional move
+ * Does: Performs a conditional move
+ * Paramters: UArray_T, unsigned, unsigned, unsigned
+ * Returns: None
+ */
+static inline void conditional_move(uint32_t registers[], unsigned a, 
+    unsigned b, unsigned c)
+{
+        if (at_reg(registers, c) == 0) {
+                return;
+        } else {
+                uint32_t temp = at_reg(registers, b);
+                update_reg(registers, a, temp);
+        }
+}
+
+/* Function: segmented_load
+ * Does: Performs a segmented load
+ * Paramters: UArray_T, Seq_T, unsigned, unsigned
+ * Returns: None
+ */
+static inline void segmented_load(uint32_t registers[], memory mem, unsigned a, 
+    unsigned b, unsigned c)
+{
+        unsigned val_b = at_reg(registers, b);
+        unsigned val_c = at_reg(registers, c);
+
+        uint32_t new_word = get_word(mem, val_b, val_c);
+        update_reg(registers, a, new_word); 
+}
+
+/* Function: segmented_store
+ * Does: Performs a segmented store
+ * Paramters: UArray_T, Seq_T, unsigned, unsigned
+ * Returns: None
+ */
+static inline void segmented_store(uint32_t registers[], memory mem, 
+    unsigned a, unsigned b, unsigned c)
+{
+        unsigned val_a = at_reg(registers, a);
+        unsigned val_b = at_reg(registers, b);
+        unsigned val_c = at_reg(registers, c);
+
+        put_word(mem, val_a, val_b, val_c);
+
+        /* Keeps the decoded program in step with self-modifying code */
+        if (val_a == 0) {
+                decode_entry(mem, val_b);
+#if UM_JIT
+                if (mem->jit != NULL)
+                        jit_invalidate(mem->jit, mem, val_b);
+#endif
+        }
+}
+
+/* Function: addition
+ * Does: Performs an addition
+ * Paramters: UArray_T, unsigned, unsigned, unsigned
+ * Returns: None
+ */
+static inline void addition(uint32_t registers[], unsigned a, unsigned b, 
+    unsigned c)
+{
+        uint32_t first = at_reg(registers, b);
+        uint32_t second = at_reg(registers, c);
+        uint32_t sum = (first + second) % 4294967296;
+
+        update_reg(registers, a, sum);
+}
+
+/* Function: multiplication
+ * Does: Performs a multiplication
+ * Paramters: UArray_T, unsigned, unsigned, unsigned
+ * Returns: None
+ */
+static inline void multiplication (uint32_t registers[], unsigned a, 
+    unsigned b, unsigned c)
+{
+        uint32_t first = at_reg(registers, b);
+        uint32_t second = at_reg(registers, c);
+        uint32_t product = (first * second) % 4294967296;
+
+        update_reg(registers, a, product);
+}
+
+/* Function: division
+ * Does: Performs a division
+ * Paramters: UArray_T, unsigned, unsigned, unsigned
+ * Returns: None
+ */
+static inline void division(uint32_t registers[], unsigned a, unsigned b, 
+    unsigned c)
+{
+        uint32_t first = at_reg(registers, b);
+        uint32_t second = at_reg(registers, c);
+        uint32_t quotient = (first / second) % 4294967296;
+
+        update_reg(registers, a, quotient);
+}
+
+/* Function: bitwise_NAND
+ * Does: Performs a bitwise NAND
+ * Paramters: UArray_T, unsigned, unsigned, unsigned
+ * Returns: None
+ */
+static inline void bitwise_NAND(uint32_t registers[], unsigned a, unsigned b, 
+    unsigned c)
+{
+        uint32_t first = at_reg(registers, b);
+        uint32_t second = at_reg(registers, c);
+        uint32_t result = first & second;
+        result = ~result;
+        update_reg(registers, a, result);
+}
+
+/* Function: halt
+ * Does: Halts the program
+ * Paramters: Seq_T, uint32_t*
+ * Returns: None
+ */
+static inline void halt(memory mem, uint32_t *prog_count)
+{
+        *prog_count = mem->segments[0][1];
+}
+
+/* Function: map_segment
+ * Does: Maps a segment with a specified number of words
+ * Paramters: UArray_T, Seq_T, Seq_T, unsigned, unsigned
+ * Returns: None
+ */
+static inline void map_segment(uint32_t registers[], memory mem, unsigned b, 
+    unsigned c)
+{
+        unsigned num_words = at_reg(registers, c);
+        uint32_t new_index = take_identifier(mem);
+
+        mem->segments[new_index] = seg_alloc(mem, num_words);
+
+        /* Sets all words to 0, unless they come from a mapping that 
+         * already reads as zero
+         */
+        if (!seg_zeroed(num_words))
+                memset(mem->segments[new_index] + 2, 0, 
+                    sizeof(uint32_t) * num_words);
+
+        update_reg(registers, b, new_index);
+}
+
+/* Function: unmap_segment
+ * Does: Maps the segment at a specified index
+ * Paramters: UArray_T, Seq_T, Seq_T, unsigned
+ * Returns: None
+ */
+static inline void unmap_segment(uint32_t registers[], memory mem, unsigned c)
+{
+        unsigned index = (unsigned)at_reg(registers, c);
+
+        seg_release(mem, mem->segments[index]);
+        mem->segments[index] = NULL;
+
+        release_identifier(mem, index);
+}
+
+/* Function: output
+ * Does: Outputs the value at the given register
+ * Paramters: UArray_T, unsigned
+ * Returns: None
+ */
+static inline void output(uint32_t registers[], unsigned c)
+{
+        io_output(at_reg(registers, c));
+}
+
+/* Function: input
+ * Does: Takes input and stores it in the given register
+ * Paramters: UArray_T, unsigned
+ * Returns: None
+ */
+static inline void input(uint32_t registers[], unsigned c)
+{
+        uint32_t userinput = io_input();
+        if (userinput == (unsigned)EOF) {
+                userinput = ~0;      
+        } 
+
+        update_reg(registers, c, userinput);
+}
+
+/* Function: load_program
+ * Does: Loads the sgment at the spcified index into the program
+ * Paramters: Seq_T, UArray_T, uint32_t*, unsigned, unsigned
+ * Returns: None
+ */
+static inline void load_program(memory mem, uint32_t registers[], 
+        uint32_t *prog_count, unsigned b, unsigned c)
+{
+        uint32_t seg_num = at_reg(registers, b);
+
+        if (seg_num == 0) {
+                *prog_count = at_reg(registers, c);
+                return;
+        }
+
+        /* Shares the segment to be duplicated; the first store to either 
+         * side makes the copy. Reloading the segment that segment 0 
+         * already shares keeps the decoded program and translations.
+         */
+        uint32_t *source = mem->segments[seg_num];
+
+        if (source != mem->segments[0]) {
+                /* Abandons the original program segment */
+                seg_release(mem, mem->segments[0]);
+
+                mem->segments[0] = seg_share(source);
+                decode_prog(mem);
+#if UM_JIT
+                if (mem->jit != NULL)
+                        jit_reset(mem->jit, mem);
+#endif
+        }
+
+        *prog_count = at_reg(registers, c);
+}
+
+/* Function: load_value
+ * Does: Loadsa the given value to the given register
+ * Paramters: UArray_T, unsigned, unsigned
+ * Returns: None
+ */
+static inline void load_value(uint32_t registers[], unsigned a, unsigned lvalue)
+{
+        update_reg(registers, a, lvalue);
+}
+
+/******************************************************
+*
+* Functions from checker
+*
+******************************************************/
+
+#if !UM_THREADED
+
+/* Function: run_prog_checked
+ * Does: Runs all instructions from the pre-decoded program, passing each 
+ *       one to check_instr before it runs
+ * Paramters: memory, uint32_t[], uint32_t*
+ * Returns: none
+ */
+static void run_prog_checked(memory mem, uint32_t registers[], 
+    uint32_t *prog_count)
+{
+        do {
+                check_instr(mem, registers, *prog_count);
+        } while (exec_instr(mem, registers, prog_count));
+}
+
+#endif
+
+/* Function: um_fail
+ * Does: Stops the machine with a report. Inside a library call the report 
+ *       goes back to the caller; otherwise it is printed and the program 
+ *       exits.
+ * Paramters: memory, um_error_code, const char*, ...
+ * Returns: Does not return
+ */
+static void um_fail(memory mem, um_error_code code, const char *format, ...)
+{
+        char message[sizeof(((um_error *)0)->message)];
+        va_list args;
+
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+
+        if (mem->fault != NULL) {
+                mem->error->code = code;
+                memcpy(mem->error->message, message, sizeof(message));
+                longjmp(*mem->fault, 1);
+        }
+
+        fprintf(stderr, "Error: %s\n", message);
+        exit(EXIT_FAILURE);
+}
+
+/* Function: segment_holds
+ * Does: Tests whether seg_num names a mapped segment with a word at index 
+ *       word, the case check_segment lets through
+ * Paramters: memory, uint32_t, uint32_t
+ * Returns: true if the access is in bounds
+ */
+static inline bool segment_holds(memory mem, uint32_t seg_num, uint32_t word)
+{
+        return seg_num < mem->memlength && mem->segments[seg_num] != NULL && 
+            word < mem->segments[seg_num][1];
+}
+
+/* Function: check_segment
+ * Does: Stops the machine unless seg_num names a mapped segment and, when 
+ *       end is nonzero, end - 1 is a word inside it
+ * Paramters: memory, uint32_t, uint64_t, uint32_t, const char*
+ * Returns: None
+ */
+static void check_segment(memory mem, uint32_t seg_num, uint64_t end, 
+    uint32_t pc, const char *op)
+{
+        if (seg_num >= mem->memlength || mem->segments[seg_num] == NULL)
+                um_fail(mem, UM_ERROR_SEGMENT, "%s of unmapped segment %u "
+                    "at pc %u", op, seg_num, pc);
+
+        uint32_t length = mem->segments[seg_num][1];
+
+        if (end > length)
+                um_fail(mem, UM_ERROR_BOUNDS, "%s of word %llu past the end "
+                    "of segment %u (%u words) at pc %u", op, 
+                    (unsigned long long)end - 1, seg_num, length, pc);
+}
+
+/* Function: check_instr
+ * Does: Stops the machine with a report if the instruction at pc would 
+ *       fault: an access to an unmapped segment or past the end of one, 
+ *       division by zero, unmapping segment 0 or an unmapped segment, 
+ *       output of a value above 255, a load_program of an unmapped 
+ *       segment or to a pc outside it, or an invalid opcode
+ * Paramters: memory, uint32_t[], uint32_t
+ * Returns: None
+ */
+static void check_instr(memory mem, uint32_t registers[], uint32_t pc)
+{
+        const instr *in = &mem->decoded[pc];
+        uint32_t *r = registers;
+
+        switch (in->opcode & OPCODE_MASK) {
+        case 1:
+                check_segment(mem, r[in->b], (uint64_t)r[in->c] + 1, pc, 
+                    "Load");
+                break;
+        case 2:
+                check_segment(mem, r[in->a], (uint64_t)r[in->b] + 1, pc, 
+                    "Store");
+                break;
+        case 5:
+                if (r[in->c] == 0)
+                        um_fail(mem, UM_ERROR_DIVIDE, "Division by zero at "
+                            "pc %u", pc);
+                break;
+        case 9:
+                if (r[in->c] == 0)
+                        um_fail(mem, UM_ERROR_UNMAP, "Unmap of segment 0 at "
+                            "pc %u", pc);
+                check_segment(mem, r[in->c], 0, pc, "Unmap");
+                break;
+        case 10:
+                if (r[in->c] > 255)
+                        um_fail(mem, UM_ERROR_OUTPUT, "Output of %u, above "
+                            "255, at pc %u", r[in->c], pc);
+                break;
+        case 12:
+                check_segment(mem, r[in->b], (uint64_t)r[in->c] + 1, pc, 
+                    "Load program");
+                break;
+        case 14:
+        case 15:
+                um_fail(mem, UM_ERROR_OPCODE, "Invalid instruction at pc %u",
+                    pc);
+        }
+}
+
+#if UM_PROFILE
+
+/******************************************************
+*
+* Functions from profiler
+*
+******************************************************/
+
+/* Function: profile_grow
+ * Does: Makes the per-pc tables cover a segment 0 of the given length
+ * Paramters: profile, uint32_t
+ * Returns: None
+ */
+static void profile_grow(profile prof, uint32_t length)
+{
+        uint32_t old = prof->pclength;
+
+        if (length + 1 <= old)
+                return;
+
+        prof->pcs = realloc(prof->pcs, sizeof(uint64_t) * (length + 1));
+        prof->blocks = realloc(prof->blocks, sizeof(uint64_t) * (length + 1));
+        memset(prof->pcs + old, 0, sizeof(uint64_t) * (length + 1 - old));
+        memset(prof->blocks + old, 0, sizeof(uint64_t) * (length + 1 - old));
+        prof->pclength = length + 1;
+}
+
+/* Function: run_prog_profile
+ * Does: Runs all instructions one at a time, counting executions per 
+ *       opcode and per pc of segment 0, entries to each basic block (the 
+ *       start of the program and every load_program target), the sizes 
+ *       of mapped segments, unmaps, and load_program calls split into 
+ *       jumps within segment 0 and loads of another segment
+ * Paramters: memory, uint32_t[], uint32_t*, profile
+ * Returns: none
+ */
+static void run_prog_profile(memory mem, uint32_t registers[], 
+    uint32_t *prog_count, profile prof)
+{
+        memset(prof, 0, sizeof(*prof));
+        profile_grow(prof, mem->segments[0][1]);
+        prof->blocks[*prog_count]++;
+
+        while (true) {
+                uint32_t pc = *prog_count;
+                const instr *in = &mem->decoded[pc];
+                bool jumped = false;
+
+                prof->instructions++;
+                prof->opcodes[in->opcode & OPCODE_MASK]++;
+                prof->pcs[pc]++;
+
+                switch (in->opcode & OPCODE_MASK) {
+                case 8: {
+                        uint32_t words = registers[in->c];
+                        unsigned bucket = words == 0 ? 0 : 
+                            32 - __builtin_clz(words);
+                        prof->mapsizes[bucket]++;
+                        break;
+                }
+                case 9:
+                        prof->unmaps++;
+                        break;
+                case 12:
+                        if (registers[in->b] == 0) {
+                                prof->jumps++;
+                        } else {
+                                prof->loads++;
+                                profile_grow(prof, 
+                                    mem->segments[registers[in->b]][1]);
+                        }
+                        jumped = true;
+                        break;
+                }
+
+                if (!exec_instr(mem, registers, prog_count))
+                        return;
+
+                if (jumped && *prog_count < prof->pclength)
+                        prof->blocks[*prog_count]++;
+        }
+}
+
+/* Function: profile_report
+ * Does: Writes the profile as one count per line: totals, opcodes, the 
+ *       map size histogram, then every pc and block entry that ran. um-prof 
+ *       reads the pc and block lines.
+ * Paramters: profile, FILE*
+ * Returns: None
+ */
+static void profile_report(profile prof, FILE *out)
+{
+        static const char *const names[16] = {
+                "cmov", "sload", "sstore", "add", "mul", "div", "nand", 
+                "halt", "map", "unmap", "out", "in", "loadp", "loadv", 
+                "invalid", "invalid"
+        };
+
+        fprintf(out, "# um profile\n");
+        fprintf(out, "instructions %llu\n", 
+            (unsigned long long)prof->instructions);
+        for (unsigned op = 0; op < 16; op++) {
+                if (prof->opcodes[op] != 0)
+                        fprintf(out, "opcode %u %s %llu\n", op, names[op], 
+                            (unsigned long long)prof->opcodes[op]);
+        }
+        for (unsigned b = 0; b < PROFILE_MAP_BUCKETS; b++) {
+                if (prof->mapsizes[b] != 0)
+                        fprintf(out, "map_size %llu %llu %llu\n", 
+                            b == 0 ? 0ull : 1ull << (b - 1), 
+                            (1ull << b) - 1, 
+                            (unsigned long long)prof->mapsizes[b]);
+        }
+        fprintf(out, "unmap %llu\n", (unsigned long long)prof->unmaps);
+        fprintf(out, "load_program jump %llu\n", 
+            (unsigned long long)prof->jumps);
+        fprintf(out, "load_program load %llu\n", 
+            (unsigned long long)prof->loads);
+        for (uint32_t pc = 0; pc < prof->pclength; pc++) {
+                if (prof->pcs[pc] != 0)
+                        fprintf(out, "pc %u %llu\n", pc, 
+                            (unsigned long long)prof->pcs[pc]);
+        }
+        for (uint32_t pc = 0; pc < prof->pclength; pc++) {
+                if (prof->blocks[pc] != 0)
+                        fprintf(out, "block %u %llu\n", pc, 
+                            (unsigned long long)prof->blocks[pc]);
+        }
+
+        free(prof->pcs);
+        free(prof->blocks);
+}
+
+#endif /* UM_PROFILE */
+
+/******************************************************
+*
+* Functions from io_dev
+*
+******************************************************/
+
+/* Function: io_init
+ * Does: Sets up buffered I/O. A regular file on stdin is mapped and read 
+ *       in place; a terminal on stdout makes every newline flush output so 
+ *       prompts show up before the program waits for input.
+ * Paramters: None
+ * Returns: None
+ */
+static void io_init(void)
+{
+        struct stat sb;
+
+        io.outlen = 0;
+        io.in = io.inbuf;
+        io.inpos = 0;
+        io.inlen = 0;
+        io.inmap = NULL;
+        io.interactive = isatty(STDOUT_FILENO);
+
+        if (fstat(STDIN_FILENO, &sb) == 0 && S_ISREG(sb.st_mode) && 
+            sb.st_size > 0) {
+                off_t start = lseek(STDIN_FILENO, 0, SEEK_CUR);
+                void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, 
+                    STDIN_FILENO, 0);
+
+                if (start >= 0 && start <= sb.st_size && map != MAP_FAILED) {
+                        io.inmap = map;
+                        io.in = map;
+                        io.inpos = start;
+                        io.inlen = sb.st_size;
+                } else if (map != MAP_FAILED) {
+                        munmap(map, sb.st_size);
+                }
+        }
+
+        /* Keeps output written before an error exit */
+        atexit(io_flush);
+}
+
+/* Function: io_flush
+ * Does: Writes out any buffered output
+ * Paramters: None
+ * Returns: None
+ */
+static void io_flush(void)
+{
+        size_t done = 0;
+
+        if (io.record != NULL || io.replay != NULL) {
+                for (size_t i = 0; i < io.outlen; i++)
+                        io.digest = (io.digest ^ io.out[i]) * FNV_PRIME;
+                io.outbytes += io.outlen;
+        }
+
+        /* A replay only digests the output */
+        if (io.replay != NULL)
+                done = io.outlen;
+
+        while (done < io.outlen) {
+                ssize_t n = write(STDOUT_FILENO, io.out + done, 
+                    io.outlen - done);
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+                done += n;
+        }
+
+        if (io.transcribe && io.outlen > 0) {
+                if (io.transcriptlen + io.outlen > io.transcriptcap) {
+                        io.transcriptcap = 2 * (io.transcriptlen + io.outlen);
+                        io.transcript = realloc(io.transcript, 
+                            io.transcriptcap);
+                }
+                memcpy(io.transcript + io.transcriptlen, io.out, io.outlen);
+                io.transcriptlen += io.outlen;
+        }
+
+        io.outlen = 0;
+}
+
+/* Function: io_refill
+ * Does: Reads the next block of input once the current one is used up
+ * Paramters: None
+ * Returns: false at end of input
+ */
+static bool io_refill(void)
+{
+        if (io.inmap != NULL)
+                return false;
+
+        ssize_t n;
+        do {
+                n = read(STDIN_FILENO, io.inbuf, IO_IN_BYTES);
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= 0)
+                return false;
+
+        io.inpos = 0;
+        io.inlen = n;
+        return true;
+}
+
+/* Function: io_replay_next
+ * Does: Hands the program the next byte of the input log, checking that 
+ *       it is read at the instruction it was recorded at when the switch 
+ *       loop is counting
+ * Paramters: None
+ * Returns: the byte, or EOF
+ */
+static uint32_t io_replay_next(void)
+{
+        if (io.replaypos == io.replaylen) {
+                fprintf(stderr, "Error: Replay diverged: the program read "
+                    "more input than the log holds\n");
+                exit(EXIT_FAILURE);
+        }
+
+        io_event *event = &io.replay[io.replaypos++];
+
+        if (io.counting && event->at != io.retired) {
+                fprintf(stderr, "Error: Replay diverged: input %zu read at "
+                    "instruction %llu, recorded at %llu\n", io.replaypos, 
+                    (unsigned long long)io.retired, 
+                    (unsigned long long)event->at);
+                exit(EXIT_FAILURE);
+        }
+
+        return event->byte < 0 ? (uint32_t)EOF : (uint32_t)event->byte;
+}
+
+static inline uint32_t io_input()
+{
+        io_flush();
+
+        if (io.replay != NULL)
+                return io_replay_next();
+
+        uint32_t byte = (uint32_t)EOF;
+
+        if (io.inpos < io.inlen || io_refill())
+                byte = io.in[io.inpos++];
+
+        if (io.record != NULL) {
+                if (byte == (uint32_t)EOF)
+                        fprintf(io.record, "eof %llu\n", 
+                            (unsigned long long)io.retired);
+                else
+                        fprintf(io.record, "in %llu %u\n", 
+                            (unsigned long long)io.retired, byte);
+        }
+
+        return byte;
+}
 
 static inline void io_output(uint32_t word)
 {
-        fputc(word, stdout);
+        io.out[io.outlen++] = (unsigned char)word;
+
+        if (io.outlen == IO_OUT_BYTES || (io.interactive && word == '\n'))
+                io_flush();
+}
+
+/* Function: io_record
+ * Does: Starts logging every byte of input the program reads, with the 
+ *       instruction count it was read at, to the given file
+ * Paramters: const char*
+ * Returns: None
+ */
+static void io_record(const char *filename)
+{
+        io.record = fopen(filename, "w");
+        if (io.record == NULL) {
+                fprintf(stderr, "Error: Could not open %s for writing\n", 
+                    filename);
+                exit(EXIT_FAILURE);
+        }
+
+        fprintf(io.record, "%s\n", IO_LOG_HEADER);
+        io.digest = FNV_SEED;
+        io.outbytes = 0;
+}
+
+/* Function: io_replay
+ * Does: Reads an input log so the program takes its input from it in 
+ *       place of stdin. Output is digested and not written.
+ * Paramters: const char*
+ * Returns: None
+ */
+static void io_replay(const char *filename)
+{
+        FILE *log = fopen(filename, "r");
+        char line[128];
+        size_t capacity = 1024;
+
+        if (log == NULL || fgets(line, sizeof(line), log) == NULL || 
+            strncmp(line, IO_LOG_HEADER "\n", sizeof(line)) != 0) {
+                fprintf(stderr, "Error: %s is not an input log\n", filename);
+                exit(EXIT_FAILURE);
+        }
+
+        io.replay = malloc(sizeof(io_event) * capacity);
+        io.replaylen = 0;
+        io.replaypos = 0;
+
+        bool ended = false;
+        unsigned long long at, instructions, bytes, digest;
+        unsigned byte;
+
+        while (!ended && fgets(line, sizeof(line), log) != NULL) {
+                if (io.replaylen == capacity) {
+                        capacity *= 2;
+                        io.replay = realloc(io.replay, 
+                            sizeof(io_event) * capacity);
+                }
+
+                io_event *event = &io.replay[io.replaylen];
+
+                if (sscanf(line, "in %llu %u", &at, &byte) == 2 && 
+                    byte < 256) {
+                        *event = (io_event){ at, (int)byte };
+                } else if (sscanf(line, "eof %llu", &at) == 1) {
+                        *event = (io_event){ at, -1 };
+                } else if (sscanf(line, "end %llu %llu %llx", &instructions, 
+                    &bytes, &digest) == 3) {
+                        ended = true;
+                        continue;
+                } else {
+                        break;
+                }
+                io.replaylen++;
+        }
+        fclose(log);
+
+        if (!ended) {
+                fprintf(stderr, "Error: %s is truncated\n", filename);
+                exit(EXIT_FAILURE);
+        }
+
+        io.endretired = instructions;
+        io.endbytes = bytes;
+        io.enddigest = digest;
+        io.retired = 0;
+        io.digest = FNV_SEED;
+        io.outbytes = 0;
+        io.interactive = false;
+}
+
+/* Function: io_log_end
+ * Does: Finishes the input log being recorded with the run's totals, or 
+ *       checks a replayed run against the totals in its log
+ * Paramters: uint64_t
+ * Returns: None
+ */
+static void io_log_end(uint64_t retired)
+{
+        io_flush();
+
+        if (io.record != NULL) {
+                fprintf(io.record, "end %llu %llu %016llx\n", 
+                    (unsigned long long)retired, 
+                    (unsigned long long)io.outbytes, 
+                    (unsigned long long)io.digest);
+                if (fclose(io.record) != 0) {
+                        fprintf(stderr, "Error: Could not write the input "
+                            "log\n");
+                        exit(EXIT_FAILURE);
+                }
+                io.record = NULL;
+        }
+
+        if (io.replay == NULL)
+                return;
+
+        if (io.replaypos != io.replaylen) {
+                fprintf(stderr, "Error: Replay diverged: the program halted "
+                    "with %zu logged inputs unread\n", 
+                    io.replaylen - io.replaypos);
+                exit(EXIT_FAILURE);
+        }
+        if (io.outbytes != io.endbytes || io.digest != io.enddigest) {
+                fprintf(stderr, "Error: Replay diverged: output of %llu "
+                    "bytes with digest %016llx, recorded %llu bytes with "
+                    "digest %016llx\n", (unsigned long long)io.outbytes, 
+                    (unsigned long long)io.digest, 
+                    (unsigned long long)io.endbytes, 
+                    (unsigned long long)io.enddigest);
+                exit(EXIT_FAILURE);
+        }
+        if (io.counting && retired != io.endretired) {
+                fprintf(stderr, "Error: Replay diverged: %llu instructions, "
+                    "recorded %llu\n", (unsigned long long)retired, 
+                    (unsigned long long)io.endretired);
+                exit(EXIT_FAILURE);
+        }
+
+        free(io.replay);
+        io.replay = NULL;
+}
+
+
+/******************************************************
+*
+* Functions from perf_stats
+*
+******************************************************/
+
+static const char *const perf_names[PERF_COUNTERS] = {
+        "cycles", "instructions", "branch-misses", "L1d-misses", 
+        "LLC-misses", "dTLB-misses"
+};
+
+static double perf_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Function: perf_init
+ * Does: Opens a counter for each of perf_names, counting this process in 
+ *       user space, and starts the clock. Says so once on stderr if no 
+ *       counter opens, as in a container or with perf_event_paranoid set 
+ *       high, and then reports only times and UM instructions.
+ * Paramters: uint64_t (sample every that many UM instructions, or 0)
+ * Returns: None
+ */
+static void perf_init(uint64_t interval)
+{
+        int error = ENOSYS;
+
+        perf.on = true;
+        perf.interval = interval;
+        perf.next = interval == 0 ? UINT64_MAX : interval;
+
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+                perf.fds[i] = -1;
+#if UM_PERF
+                static const struct { uint32_t type; uint64_t config; } 
+                    events[PERF_COUNTERS] = {
+                        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+                        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+                        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+                        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | 
+                            PERF_COUNT_HW_CACHE_OP_READ << 8 | 
+                            PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+                        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+                        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | 
+                            PERF_COUNT_HW_CACHE_OP_READ << 8 | 
+                            PERF_COUNT_HW_CACHE_RESULT_MISS << 16 }
+                };
+                struct perf_event_attr attr;
+
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = events[i].type;
+                attr.config = events[i].config;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+
+                /* More counters than the PMU has are multiplexed, so each 
+                 * is scaled by how long it actually ran
+                 */
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | 
+                    PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                perf.fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, 
+                    -1, 0);
+                if (perf.fds[i] < 0)
+                        error = errno;
+                else
+                        perf.any = true;
+#endif
+        }
+
+        if (!perf.any)
+                fprintf(stderr, "perf: no hardware counters (%s); "
+                    "reporting times and UM instructions only\n", 
+                    strerror(error));
+
+        fprintf(stderr, "# perf\tphase\tseconds\tum-instructions");
+        for (int i = 0; i < PERF_COUNTERS; i++)
+                fprintf(stderr, "\t%s", perf_names[i]);
+        fprintf(stderr, "\tIPC\n");
+
+        perf.phasetime = perf.sampletime = perf_now();
+}
+
+/* Function: perf_read
+ * Does: Reads every counter, scaled up for any time it was multiplexed 
+ *       out, with missing counters as UINT64_MAX
+ * Paramters: uint64_t[]
+ * Returns: None
+ */
+static void perf_read(uint64_t values[])
+{
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+                uint64_t data[3];
+
+                values[i] = UINT64_MAX;
+                if (perf.fds[i] < 0 || read(perf.fds[i], data, 
+                    sizeof(data)) != sizeof(data))
+                        continue;
+
+                values[i] = data[2] == 0 ? 0 : data[2] == data[1] ? data[0] : 
+                    (uint64_t)((double)data[0] * data[1] / data[2]);
+        }
+}
+
+/* Function: perf_line
+ * Does: Prints one line of the report: the time, UM instructions and 
+ *       counters since the given start, and the host's instructions per 
+ *       cycle over them
+ * Paramters: const char*, double, bool, uint64_t, const uint64_t[], 
+ *            const uint64_t[]
+ * Returns: None
+ */
+static void perf_line(const char *name, double seconds, bool counted, 
+    uint64_t retired, const uint64_t start[], const uint64_t end[])
+{
+        fprintf(stderr, "perf\t%s\t%.6f\t", name, seconds);
+        if (counted)
+                fprintf(stderr, "%llu", (unsigned long long)retired);
+        else
+                fprintf(stderr, "-");
+
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+                if (end[i] == UINT64_MAX || start[i] == UINT64_MAX)
+                        fprintf(stderr, "\t-");
+                else
+                        fprintf(stderr, "\t%llu", 
+                            (unsigned long long)(end[i] - start[i]));
+        }
+
+        if (end[0] == UINT64_MAX || end[1] == UINT64_MAX || 
+            end[0] == start[0])
+                fprintf(stderr, "\t-\n");
+        else
+                fprintf(stderr, "\t%.3f\n", (double)(end[1] - start[1]) / 
+                    (end[0] - start[0]));
+}
+
+/* Function: perf_phase
+ * Does: Reports the phase that has just ended: load, exec or teardown
+ * Paramters: const char*, bool (whether retired is known), uint64_t
+ * Returns: None
+ */
+static void perf_phase(const char *name, bool counted, uint64_t retired)
+{
+        uint64_t values[PERF_COUNTERS];
+        double now;
+
+        if (!perf.on)
+                return;
+
+        perf_read(values);
+        now = perf_now();
+        perf_line(name, now - perf.phasetime, counted, retired, perf.phase, 
+            values);
+
+        memcpy(perf.phase, values, sizeof(values));
+        memcpy(perf.sampled, values, sizeof(values));
+        perf.phasetime = perf.sampletime = now;
+}
+
+/* Function: perf_sample
+ * Does: Reports the last interval UM instructions, as a line named for 
+ *       the count at its end
+ * Paramters: uint64_t
+ * Returns: None
+ */
+static void perf_sample(uint64_t retired)
+{
+        uint64_t values[PERF_COUNTERS];
+        char name[32];
+        double now;
+
+        perf_read(values);
+        now = perf_now();
+        snprintf(name, sizeof(name), "@%llu", (unsigned long long)retired);
+        perf_line(name, now - perf.sampletime, true, perf.interval, 
+            perf.sampled, values);
+
+        memcpy(perf.sampled, values, sizeof(values));
+        perf.sampletime = now;
+        perf.next += perf.interval;
+}
+
+static void perf_close(void)
+{
+        for (int i = 0; i < PERF_COUNTERS; i++)
+                if (perf.fds[i] >= 0)
+                        close(perf.fds[i]);
+        perf.on = false;
+}
+
+#if UM_JIT
+
+/******************************************************
+*
+* Functions from jit
+*
+******************************************************/
+
+/* Number of times a block entry must be reached before it is translated */
+#define JIT_THRESHOLD 16
+
+/* Longest run of instructions translated into a single block */
+#define JIT_MAX_BLOCK 128
+
+/* Size of the code buffer, and the room kept free for one more block */
+#define JIT_CODE_SIZE (64 * 1024 * 1024)
+#define JIT_BLOCK_ROOM (JIT_MAX_BLOCK * 256)
+
+/* Set above the pc returned by translated code when the C loop must 
+ * interpret the instruction there rather than look for a block
+ */
+#define JIT_EXIT_STEP 1u
+
+/* Host register numbers used by the emitter; UM register i lives in r8 + i 
+ * while translated code runs, and rbx holds the jit_state
+ */
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, 
+       RDI = 7 };
+#define HOST(u) (8 + (u))
+#define NO_INDEX (-1)
+
+/* Condition codes for emit_jcc */
+enum { CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+
+/* State shared between C and translated code; offsets are baked into the 
+ * generated instructions
+ */
+typedef struct jit_state {
+        uint32_t regs[8];
+        uint32_t pc;
+        uint32_t length;
+        uint32_t ***segments;
+        void **entries;
+        uint32_t (*interpret)(struct jit_state *state, uint32_t pc);
+        uint32_t (*store_program)(struct jit_state *state, uint32_t offset, 
+            uint32_t value);
+        memory mem;
+} jit_state;
+
+struct jit {
+        jit_state state;
+
+        uint8_t *code;
+        uint32_t used;
+        uint64_t (*enter)(jit_state *state, void *block);
+        uint8_t *exit;
+        uint32_t flushed;
+
+        uint32_t *hits;
+        uint8_t *covered;
+};
+
+static inline void emit8(jit j, uint8_t byte)
+{
+        j->code[j->used++] = byte;
+}
+
+static inline void emit32(jit j, uint32_t word)
+{
+        memcpy(j->code + j->used, &word, sizeof(word));
+        j->used += sizeof(word);
+}
+
+/* Function: emit_rex
+ * Does: Emits a REX prefix when a 64-bit operand or an extended register 
+ *       needs one
+ * Paramters: jit, int, int, int, int
+ * Returns: None
+ */
+static inline void emit_rex(jit j, int wide, int reg, int index, int base)
+{
+        uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | 
+            ((index >> 3) << 1) | (base >> 3);
+
+        if (rex != 0x40)
+                emit8(j, rex);
+}
+
+/* Function: emit_rr
+ * Does: Emits a register-to-register instruction with the given opcode 
+ *       bytes, or an opcode extension in reg
+ * Paramters: jit, int, uint8_t, uint8_t, int, int
+ * Returns: None
+ */
+static inline void emit_rr(jit j, int wide, uint8_t op1, uint8_t op2, 
+    int reg, int rm)
+{
+        emit_rex(j, wide, reg, 0, rm);
+        emit8(j, op1);
+        if (op2 != 0)
+                emit8(j, op2);
+        emit8(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Function: emit_mem
+ * Does: Emits an instruction whose r/m operand is 
+ *       [base + index * 2^scale + disp], always through a SIB byte and a 
+ *       32-bit displacement so that no base register needs special casing
+ * Paramters: jit, int, uint8_t, int, int, int, int, int32_t
+ * Returns: None
+ */
+static inline void emit_mem(jit j, int wide, uint8_t op, int reg, int base, 
+    int index, int scale, int32_t disp)
+{
+        int sib_index = (index == NO_INDEX) ? RSP : index;
+
+        emit_rex(j, wide, reg, (index == NO_INDEX) ? 0 : index, base);
+        emit8(j, op);
+        emit8(j, 0x80 | ((reg & 7) << 3) | RSP);
+        emit8(j, (scale << 6) | ((sib_index & 7) << 3) | (base & 7));
+        emit32(j, (uint32_t)disp);
+}
+
+/* Function: emit_jcc
+ * Does: Emits a conditional jump with a 32-bit displacement to be filled 
+ *       in by patch_jump
+ * Paramters: jit, int
+ * Returns: position of the displacement
+ */
+static inline uint32_t emit_jcc(jit j, int cc)
+{
+        emit8(j, 0x0f);
+        emit8(j, 0x80 | cc);
+        emit32(j, 0);
+        return j->used - 4;
+}
+
+/* Function: emit_jmp
+ * Does: Emits an unconditional jump with a 32-bit displacement to be 
+ *       filled in by patch_jump
+ * Paramters: jit
+ * Returns: position of the displacement
+ */
+static inline uint32_t emit_jmp(jit j)
+{
+        emit8(j, 0xe9);
+        emit32(j, 0);
+        return j->used - 4;
+}
+
+/* Function: patch_jump
+ * Does: Points the jump whose displacement is at pos to the current end 
+ *       of the code
+ * Paramters: jit, uint32_t
+ * Returns: None
+ */
+static inline void patch_jump(jit j, uint32_t pos)
+{
+        uint32_t disp = j->used - (pos + 4);
+        memcpy(j->code + pos, &disp, sizeof(disp));
+}
+
+/* Function: emit_exit_jump
+ * Does: Emits a jump to the shared exit path, which returns rax to C
+ * Paramters: jit
+ * Returns: None
+ */
+static inline void emit_exit_jump(jit j)
+{
+        emit8(j, 0xe9);
+        emit32(j, (uint32_t)(j->exit - (j->code + j->used + 4)));
+}
+
+/* Function: emit_exit_step
+ * Does: Emits an exit that has the C loop interpret the instruction at pc
+ * Paramters: jit, uint32_t
+ * Returns: None
+ */
+static inline void emit_exit_step(jit j, uint32_t pc)
+{
+        emit8(j, 0x48);
+        emit8(j, 0xb8);
+        emit32(j, pc);
+        emit32(j, JIT_EXIT_STEP);
+        emit_exit_jump(j);
+}
+
+/* Function: emit_regs
+ * Does: Spills the UM registers to the jit_state (op 0x89) or reloads them 
+ *       from it (op 0x8b)
+ * Paramters: jit, uint8_t
+ * Returns: None
+ */
+static inline void emit_regs(jit j, uint8_t op)
+{
+        for (unsigned u = 0; u < 8; u++)
+                emit_mem(j, 0, op, HOST(u), RBX, NO_INDEX, 0, 
+                    offsetof(jit_state, regs) + 4 * u);
+}
+
+/* Function: emit_chain
+ * Does: Emits a jump to the block whose address is in rax, or an exit 
+ *       through the C loop at the pc in ecx if that block is missing
+ * Paramters: jit
+ * Returns: None
+ */
+static inline void emit_chain(jit j)
+{
+        emit_rr(j, 1, 0x85, 0, RAX, RAX);
+        uint32_t missing = emit_jcc(j, CC_E);
+        emit_rr(j, 0, 0xff, 0, 4, RAX);
+        patch_jump(j, missing);
+        emit_rr(j, 0, 0x89, 0, RCX, RAX);
+        emit_exit_jump(j);
+}
+
+/* Function: emit_interpret
+ * Does: Emits a call to the interpreter for the single instruction at pc, 
+ *       leaving the block if that dropped the translations
+ * Paramters: jit, uint32_t
+ * Returns: None
+ */
+static inline void emit_interpret(jit j, uint32_t pc)
+{
+        emit_regs(j, 0x89);
+        emit_rr(j, 1, 0x89, 0, RBX, RDI);
+        emit8(j, 0xbe);
+        emit32(j, pc);
+        emit_mem(j, 0, 0xff, 2, RBX, NO_INDEX, 0, 
+            offsetof(jit_state, interpret));
+        emit_regs(j, 0x8b);
+
+        emit_rr(j, 0, 0x85, 0, RAX, RAX);
+        uint32_t kept = emit_jcc(j, CC_E);
+        emit_mem(j, 0, 0x8b, RAX, RBX, NO_INDEX, 0, 
+            offsetof(jit_state, pc));
+        emit_exit_jump(j);
+        patch_jump(j, kept);
+}
+
+/* Function: emit_store_program
+ * Does: Emits a call that stores register c at offset register b of 
+ *       segment 0, leaving the block for pc + 1 if that dropped the 
+ *       translations. Only the caller-saved UM registers are preserved, 
+ *       since the store changes none of them.
+ * Paramters: jit, uint32_t, unsigned, unsigned
+ * Returns: None
+ */
+static inline void emit_store_program(jit j, uint32_t pc, unsigned b, 
+    unsigned c)
+{
+        for (int r = 0; r < 4; r++) {
+                emit8(j, 0x41);
+                emit8(j, 0x50 + r);
+        }
+        emit_rr(j, 1, 0x89, 0, RBX, RDI);
+        emit_rr(j, 0, 0x89, 0, HOST(b), RSI);
+        emit_rr(j, 0, 0x89, 0, HOST(c), RDX);
+        emit_mem(j, 0, 0xff, 2, RBX, NO_INDEX, 0, 
+            offsetof(jit_state, store_program));
+        for (int r = 3; r >= 0; r--) {
+                emit8(j, 0x41);
+                emit8(j, 0x58 + r);
+        }
+
+        emit_rr(j, 0, 0x85, 0, RAX, RAX);
+        uint32_t kept = emit_jcc(j, CC_E);
+        emit8(j, 0xb8);
+        emit32(j, pc + 1);
+        emit_exit_jump(j);
+        patch_jump(j, kept);
+}
+
+/* Function: emit_segment_base
+ * Does: Loads the address of segment reg_seg into rax
+ * Paramters: jit, unsigned
+ * Returns: None
+ */
+static inline void emit_segment_base(jit j, unsigned reg_seg)
+{
+        emit_mem(j, 1, 0x8b, RAX, RBX, NO_INDEX, 0, 
+            offsetof(jit_state, segments));
+        emit_mem(j, 1, 0x8b, RAX, RAX, NO_INDEX, 0, 0);
+        emit_rr(j, 0, 0x89, 0, HOST(reg_seg), RCX);
+        emit_mem(j, 1, 0x8b, RAX, RAX, RCX, 3, 0);
+}
+
+/* Function: emit_glue
+ * Does: Emits the entry trampoline and the shared exit path at the start 
+ *       of the code buffer
+ * Paramters: jit
+ * Returns: None
+ */
+static inline void emit_glue(jit j)
+{
+        j->used = 0;
+
+        /* ISO C has no cast from data to function pointers */
+        memcpy(&j->enter, &j->code, sizeof(j->enter));
+
+        /* push rbx, rbp, r12-r15 and keep the stack 16-byte aligned */
+        emit8(j, 0x53);
+        emit8(j, 0x55);
+        for (int r = 0; r < 4; r++) {
+                emit8(j, 0x41);
+                emit8(j, 0x54 + r);
+        }
+        emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xec); emit8(j, 0x08);
+
+        emit_rr(j, 1, 0x89, 0, RDI, RBX);
+        emit_regs(j, 0x8b);
+        emit_rr(j, 0, 0xff, 0, 4, RSI);
+
+        /* Translated code arrives here with the next pc in rax */
+        j->exit = j->code + j->used;
+        emit_regs(j, 0x89);
+        emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xc4); emit8(j, 0x08);
+        for (int r = 3; r >= 0; r--) {
+                emit8(j, 0x41);
+                emit8(j, 0x5c + r);
+        }
+        emit8(j, 0x5d);
+        emit8(j, 0x5b);
+        emit8(j, 0xc3);
+}
+
+/* Function: jit_interpret
+ * Does: Runs one instruction for translated code through the interpreter
+ * Paramters: jit_state*, uint32_t
+ * Returns: nonzero if the translations were dropped, in which case the 
+ *          caller must leave for state->pc
+ */
+static uint32_t jit_interpret(jit_state *state, uint32_t pc)
+{
+        jit j = state->mem->jit;
+        uint32_t flushed = j->flushed;
+
+        exec_instr(state->mem, state->regs, &pc);
+        state->pc = pc;
+
+        return j->flushed != flushed;
+}
+
+/* Function: jit_store_program
+ * Does: Performs a store into segment 0 for translated code
+ * Paramters: jit_state*, uint32_t, uint32_t
+ * Returns: nonzero if the store dropped the translations
+ */
+static uint32_t jit_store_program(jit_state *state, uint32_t offset, 
+    uint32_t value)
+{
+        memory mem = state->mem;
+        jit j = mem->jit;
+        uint32_t flushed = j->flushed;
+
+        put_word(mem, 0, offset, value);
+        decode_entry(mem, offset);
+        jit_invalidate(j, mem, offset);
+
+        return j->flushed != flushed;
+}
+
+/* Function: jit_new
+ * Does: Allocates an executable code buffer and the per-pc tables for the 
+ *       current segment 0
+ * Paramters: memory
+ * Returns: jit, or NULL if executable memory is unavailable
+ */
+static jit jit_new(memory mem)
+{
+        void *code = mmap(NULL, JIT_CODE_SIZE, 
+            PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, 
+            -1, 0);
+
+        if (code == MAP_FAILED)
+                return NULL;
+
+        jit j = calloc(1, sizeof(*j));
+        j->code = code;
+        j->state.segments = &mem->segments;
+        j->state.interpret = jit_interpret;
+        j->state.store_program = jit_store_program;
+        j->state.mem = mem;
+        jit_reset(j, mem);
+
+        return j;
+}
+
+/* Function: jit_free
+ * Does: Releases the code buffer and tables
+ * Paramters: jit
+ * Returns: None
+ */
+static void jit_free(jit j)
+{
+        munmap(j->code, JIT_CODE_SIZE);
+        free(j->state.entries);
+        free(j->hits);
+        free(j->covered);
+        free(j);
+}
+
+/* Function: jit_reset
+ * Does: Drops every translation and resizes the tables to the length of 
+ *       segment 0. Hit counts start again, so hot code is translated anew.
+ * Paramters: jit, memory
+ * Returns: None
+ */
+static void jit_reset(jit j, memory mem)
+{
+        uint32_t length = mem->segments[0][1];
+
+        if (length != j->state.length || j->state.entries == NULL) {
+                free(j->state.entries);
+                free(j->hits);
+                free(j->covered);
+                j->state.entries = calloc(length + 1, sizeof(void *));
+                j->hits = calloc(length + 1, sizeof(uint32_t));
+                j->covered = calloc(length + 1, sizeof(uint8_t));
+                j->state.length = length;
+        } else {
+                memset(j->state.entries, 0, length * sizeof(void *));
+                memset(j->hits, 0, length * sizeof(uint32_t));
+                memset(j->covered, 0, length);
+        }
+
+        emit_glue(j);
+        j->flushed++;
+}
+
+/* Function: jit_invalidate
+ * Does: Drops all translations if the word just written to segment 0 is 
+ *       part of one
+ * Paramters: jit, memory, uint32_t
+ * Returns: None
+ */
+static inline void jit_invalidate(jit j, memory mem, uint32_t offset)
+{
+        if (offset < j->state.length && j->covered[offset])
+                jit_reset(j, mem);
+}
+
+/* Function: jit_compiles
+ * Does: Tells whether an opcode can appear in a block; halt and invalid 
+ *       opcodes are left to the C loop
+ * Paramters: uint32_t
+ * Returns: bool
+ */
+static inline bool jit_compiles(uint32_t opcode)
+{
+        return opcode != 7 && opcode < 14;
+}
+
+/* Function: jit_translate
+ * Does: Compiles the basic block starting at pc into native code and 
+ *       records it in the entry table. Arithmetic, loads, stores outside 
+ *       segment 0 and jumps within segment 0 are compiled inline; every 
+ *       other op calls back into the interpreter.
+ * Paramters: jit, memory, uint32_t
+ * Returns: address of the block, or NULL if pc holds an op that is always 
+ *          interpreted
+ */
+static void *jit_translate(jit j, memory mem, uint32_t pc)
+{
+        const instr *prog = mem->decoded;
+
+        if (!jit_compiles(prog[pc].opcode & OPCODE_MASK))
+                return NULL;
+
+        if (JIT_CODE_SIZE - j->used < JIT_BLOCK_ROOM)
+                jit_reset(j, mem);
+
+        uint8_t *block = j->code + j->used;
+        uint32_t start = pc;
+        uint32_t count = 0;
+        bool jumped = false;
+
+        while (pc < j->state.length && count < JIT_MAX_BLOCK && !jumped) {
+                const instr *in = &prog[pc];
+                unsigned a = in->a, b = in->b, c = in->c;
+                uint32_t slow, done, shared;
+
+                if (!jit_compiles(in->opcode & OPCODE_MASK))
+                        break;
+
+                j->covered[pc] = 1;
+                count++;
+
+                switch (in->opcode & OPCODE_MASK) {
+                case 0:
+                        emit_rr(j, 0, 0x85, 0, HOST(c), HOST(c));
+                        emit_rr(j, 0, 0x0f, 0x45, HOST(a), HOST(b));
+                        break;
+                case 1:
+                        emit_segment_base(j, b);
+                        emit_rr(j, 0, 0x89, 0, HOST(c), RCX);
+                        emit_mem(j, 0, 0x8b, HOST(a), RAX, RCX, 2, 8);
+                        break;
+                case 2:
+                        /* Stores into segment 0 go through C so that the 
+                         * decoded program and translations follow them, 
+                         * and stores into shared storage are interpreted 
+                         * so that it is copied first
+                         */
+                        emit_rr(j, 0, 0x85, 0, HOST(a), HOST(a));
+                        slow = emit_jcc(j, CC_E);
+                        emit_segment_base(j, a);
+                        emit_mem(j, 0, 0x83, 7, RAX, NO_INDEX, 0, 0);
+                        emit8(j, 1);
+                        shared = emit_jcc(j, CC_NE);
+                        emit_rr(j, 0, 0x89, 0, HOST(b), RCX);
+                        emit_mem(j, 0, 0x89, HOST(c), RAX, RCX, 2, 8);
+                        done = emit_jmp(j);
+                        patch_jump(j, shared);
+                        emit_interpret(j, pc);
+                        shared = emit_jmp(j);
+                        patch_jump(j, slow);
+                        emit_store_program(j, pc, b, c);
+                        patch_jump(j, done);
+                        patch_jump(j, shared);
+                        break;
+                case 3:
+                        emit_rr(j, 0, 0x89, 0, HOST(b), RAX);
+                        emit_rr(j, 0, 0x01, 0, HOST(c), RAX);
+                        emit_rr(j, 0, 0x89, 0, RAX, HOST(a));
+                        break;
+                case 4:
+                        emit_rr(j, 0, 0x89, 0, HOST(b), RAX);
+                        emit_rr(j, 0, 0x0f, 0xaf, RAX, HOST(c));
+                        emit_rr(j, 0, 0x89, 0, RAX, HOST(a));
+                        break;
+                case 5:
+                        emit_rr(j, 0, 0x89, 0, HOST(b), RAX);
+                        emit_rr(j, 0, 0x31, 0, RDX, RDX);
+                        emit_rr(j, 0, 0xf7, 0, 6, HOST(c));
+                        emit_rr(j, 0, 0x89, 0, RAX, HOST(a));
+                        break;
+                case 6:
+                        emit_rr(j, 0, 0x89, 0, HOST(b), RAX);
+                        emit_rr(j, 0, 0x21, 0, HOST(c), RAX);
+                        emit_rr(j, 0, 0xf7, 0, 2, RAX);
+                        emit_rr(j, 0, 0x89, 0, RAX, HOST(a));
+                        break;
+                case 12:
+                        /* Jumps within segment 0 chain through the entry 
+                         * table; loading another segment is interpreted 
+                         * and always leaves the block
+                         */
+                        emit_rr(j, 0, 0x85, 0, HOST(b), HOST(b));
+                        slow = emit_jcc(j, CC_NE);
+                        emit_rr(j, 0, 0x89, 0, HOST(c), RCX);
+                        emit_mem(j, 0, 0x3b, RCX, RBX, NO_INDEX, 0, 
+                            offsetof(jit_state, length));
+                        done = emit_jcc(j, CC_AE);
+                        emit_mem(j, 1, 0x8b, RAX, RBX, NO_INDEX, 0, 
+                            offsetof(jit_state, entries));
+                        emit_mem(j, 1, 0x8b, RAX, RAX, RCX, 3, 0);
+                        emit_chain(j);
+                        patch_jump(j, done);
+                        emit_rr(j, 0, 0x89, 0, RCX, RAX);
+                        emit_exit_jump(j);
+                        patch_jump(j, slow);
+                        emit_interpret(j, pc);
+                        emit_mem(j, 0, 0x8b, RAX, RBX, NO_INDEX, 0, 
+                            offsetof(jit_state, pc));
+                        emit_exit_jump(j);
+                        jumped = true;
+                        break;
+                case 13:
+                        emit_rex(j, 0, 0, 0, HOST(a));
+                        emit8(j, 0xb8 + (HOST(a) & 7));
+                        emit32(j, in->lvalue);
+                        break;
+                default:
+                        emit_interpret(j, pc);
+                        break;
+                }
+
+                pc++;
+        }
+
+        /* Exits to interpret the op that ended the block, or falls through 
+         * into the next block
+         */
+        if (!jumped) {
+                if (pc < j->state.length && 
+                    !jit_compiles(prog[pc].opcode & OPCODE_MASK)) {
+                        emit_exit_step(j, pc);
+                } else {
+                        emit_mem(j, 1, 0x8b, RAX, RBX, NO_INDEX, 0, 
+                            offsetof(jit_state, entries));
+                        emit_mem(j, 1, 0x8b, RAX, RAX, NO_INDEX, 0, 
+                            (int32_t)(pc * sizeof(void *)));
+                        emit8(j, 0xb9);
+                        emit32(j, pc);
+                        emit_chain(j);
+                }
+        }
+
+        j->state.entries[start] = block;
+        return block;
+}
+
+/* Function: run_prog_jit
+ * Does: Runs all instructions, interpreting cold code one instruction at 
+ *       a time and running blocks of segment 0 that become hot as native 
+ *       code; falls back to the threaded engine if code cannot be mapped 
+ *       executable
+ * Paramters: memory, uint32_t[], uint32_t*
+ * Returns: none
+ */
+static void run_prog_jit(memory mem, uint32_t registers[], 
+    uint32_t *prog_count)
+{
+        jit j = jit_new(mem);
+
+        if (j == NULL) {
+                fprintf(stderr, "Warning: JIT unavailable, interpreting\n");
+                run_prog_threaded(mem, registers, prog_count, false, NULL);
+                return;
+        }
+
+        mem->jit = j;
+        memcpy(j->state.regs, registers, sizeof(j->state.regs));
+
+        uint32_t pc = *prog_count;
+
+        while (true) {
+                if (pc < j->state.length) {
+                        void *block = j->state.entries[pc];
+
+                        if (block == NULL && ++j->hits[pc] == JIT_THRESHOLD)
+                                block = jit_translate(j, mem, pc);
+
+                        if (block != NULL) {
+                                uint64_t next = j->enter(&j->state, block);
+                                pc = (uint32_t)next;
+                                if ((next >> 32) != JIT_EXIT_STEP)
+                                        continue;
+                        }
+                }
+
+                if (!exec_instr(mem, j->state.regs, &pc))
+                        break;
+        }
+
+        memcpy(registers, j->state.regs, sizeof(j->state.regs));
+        *prog_count = pc;
+
+        mem->jit = NULL;
+        jit_free(j);
+}
+
+#endif /* UM_JIT */
+
+/******************************************************
+*
+* Functions from image_loader
+*
+******************************************************/
+
+/* Function: swap_words_scalar
+ * Does: Converts n big-endian words at src to host order at dst
+ * Paramters: uint32_t*, const uint8_t*, size_t
+ * Returns: None
+ */
+static void swap_words_scalar(uint32_t *dst, const uint8_t *src, size_t n)
+{
+        memcpy(dst, src, n * sizeof(uint32_t));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        for (size_t i = 0; i < n; i++)
+                dst[i] = __builtin_bswap32(dst[i]);
+#endif
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/* Function: swap_words_ssse3
+ * Does: swap_words_scalar, 4 words at a time with pshufb
+ * Paramters: uint32_t*, const uint8_t*, size_t
+ * Returns: None
+ */
+__attribute__((target("ssse3")))
+static void swap_words_ssse3(uint32_t *dst, const uint8_t *src, size_t n)
+{
+        const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 
+            11, 10, 9, 8, 15, 14, 13, 12);
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+                _mm_storeu_si128((__m128i *)(dst + i), 
+                    _mm_shuffle_epi8(v, mask));
+        }
+
+        swap_words_scalar(dst + i, src + 4 * i, n - i);
+}
+
+/* Function: swap_words_avx2
+ * Does: swap_words_scalar, 8 words at a time with vpshufb
+ * Paramters: uint32_t*, const uint8_t*, size_t
+ * Returns: None
+ */
+__attribute__((target("avx2")))
+static void swap_words_avx2(uint32_t *dst, const uint8_t *src, size_t n)
+{
+        const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 
+            11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 
+            11, 10, 9, 8, 15, 14, 13, 12);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+                _mm256_storeu_si256((__m256i *)(dst + i), 
+                    _mm256_shuffle_epi8(v, mask));
+        }
+
+        swap_words_scalar(dst + i, src + 4 * i, n - i);
+}
+
+#endif
+
+/* Function: swap_words
+ * Does: Converts n big-endian words to host order with the widest byte 
+ *       shuffle the CPU supports
+ * Paramters: uint32_t*, const uint8_t*, size_t
+ * Returns: None
+ */
+static void swap_words(uint32_t *dst, const uint8_t *src, size_t n)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                swap_words_avx2(dst, src, n);
+        else if (__builtin_cpu_supports("ssse3"))
+                swap_words_ssse3(dst, src, n);
+        else
+                swap_words_scalar(dst, src, n);
+#else
+        swap_words_scalar(dst, src, n);
+#endif
+}
+
+/******************************************************
+*
+* Functions from snapshot
+*
+******************************************************/
+
+/* Function: run_to_input
+ * Does: Runs the program one instruction at a time up to its first input 
+ *       instruction, leaving the program counter on it
+ * Paramters: memory, uint32_t[], uint32_t*
+ * Returns: false if the program halts first
+ */
+static bool run_to_input(memory mem, uint32_t registers[], 
+    uint32_t *prog_count)
+{
+        while ((mem->decoded[*prog_count].opcode & OPCODE_MASK) != 11) {
+                if (!exec_instr(mem, registers, prog_count))
+                        return false;
+        }
+
+        return true;
+}
+
+/* Function: save_snapshot
+ * Does: Writes the registers, program counter, segment table, free 
+ *       identifiers, the output so far and every segment with its header 
+ *       to a file restore_snapshot can map. Storage that a segment shares 
+ *       with segment 0 is written once.
+ * Paramters: memory, uint32_t[], uint32_t, const char*
+ * Returns: None
+ */
+static void save_snapshot(memory mem, uint32_t registers[], 
+    uint32_t prog_count, const char *filename)
+{
+        static const unsigned char padding[sizeof(uint32_t)];
+        FILE *out = fopen(filename, "wb");
+        snapshot_header header;
+
+        if (out == NULL) {
+                fprintf(stderr, "Error: Could not open %s for writing\n", 
+                    filename);
+                exit(EXIT_FAILURE);
+        }
+
+        io_flush();
+        if (io.transcriptlen > UINT32_MAX) {
+                fprintf(stderr, "Error: Too much output to snapshot\n");
+                exit(EXIT_FAILURE);
+        }
+
+        memset(&header, 0, sizeof(header));
+        header.magic = SNAPSHOT_MAGIC;
+        header.prog_count = prog_count;
+        memcpy(header.registers, registers, sizeof(header.registers));
+        header.memlength = mem->memlength;
+        header.freecount = mem->unmaplastindex;
+        header.outputbytes = io.transcriptlen;
+
+        uint32_t **segments = mem->segments;
+        uint64_t *offsets = malloc(sizeof(uint64_t) * mem->memlength);
+        size_t pad = -io.transcriptlen % sizeof(uint32_t);
+        uint64_t words = sizeof(header) / sizeof(uint32_t) + 
+            2 * (uint64_t)mem->memlength + header.freecount + 
+            (io.transcriptlen + pad) / sizeof(uint32_t);
+
+        for (uint32_t i = 0; i < mem->memlength; i++) {
+                if (segments[i] == NULL) {
+                        offsets[i] = 0;
+                } else if (i > 0 && segments[i] == segments[0]) {
+                        offsets[i] = offsets[0];
+                } else {
+                        offsets[i] = words;
+                        words += 2 + (uint64_t)segments[i][1];
+                }
+        }
+        header.words = words;
+
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1 && 
+            fwrite(offsets, sizeof(uint64_t), mem->memlength, out) == 
+            mem->memlength && 
+            fwrite(mem->unmapidentifiers + 1, sizeof(uint32_t), 
+            header.freecount, out) == header.freecount && 
+            (io.transcriptlen == 0 || fwrite(io.transcript, 1, 
+            io.transcriptlen, out) == io.transcriptlen) && 
+            fwrite(padding, 1, pad, out) == pad;
+
+        for (uint32_t i = 0; i < mem->memlength && ok; i++) {
+                uint32_t *seg = segments[i];
+                size_t length = seg == NULL ? 0 : 2 + (size_t)seg[1];
+
+                if (seg != NULL && (i == 0 || seg != segments[0]))
+                        ok = fwrite(seg, sizeof(uint32_t), length, out) == 
+                            length;
+        }
+
+        free(offsets);
+
+        if (!ok || fclose(out) != 0) {
+                fprintf(stderr, "Error: Could not write %s\n", filename);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Function: restore_snapshot
+ * Does: Maps a snapshot and points the segment table into it, so segments 
+ *       are read in as they are used and copied a page at a time as they 
+ *       are written. Restores the registers, program counter and free 
+ *       identifiers, and queues the saved output to be shown again.
+ * Paramters: memory, uint32_t[], uint32_t*, int, const char*
+ * Returns: None
+ */
+static void restore_snapshot(memory mem, uint32_t registers[], 
+    uint32_t *prog_count, int fd, const char *filename)
+{
+        struct stat sb;
+
+        if (fstat(fd, &sb) != 0 || 
+            (size_t)sb.st_size < sizeof(snapshot_header)) {
+                fprintf(stderr, "Error: %s is not a snapshot\n", filename);
+                exit(EXIT_FAILURE);
+        }
+
+        size_t bytes = sb.st_size;
+        uint32_t *image = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE, fd, 0);
+
+        if (image == MAP_FAILED) {
+                fprintf(stderr, "Error: Could not map %s\n", filename);
+                exit(EXIT_FAILURE);
+        }
+
+        snapshot_header *header = (snapshot_header *)(void *)image;
+        uint64_t words = header->words;
+        uint32_t memlength = header->memlength;
+        uint32_t freecount = header->freecount;
+
+        if (header->magic != SNAPSHOT_MAGIC) {
+                fprintf(stderr, "Error: %s is not a snapshot from this "
+                    "host\n", filename);
+                exit(EXIT_FAILURE);
+        }
+
+        /* Where the segments start: past the header, offsets, free list 
+         * and saved output */
+        uint64_t data = sizeof(*header) / sizeof(uint32_t) + 
+            2 * (uint64_t)memlength + freecount + 
+            ((uint64_t)header->outputbytes + 3) / 4;
+
+        if (words != bytes / sizeof(uint32_t) || bytes % sizeof(uint32_t) 
+            != 0 || memlength == 0 || data > words) {
+                fprintf(stderr, "Error: %s is truncated\n", filename);
+                exit(EXIT_FAILURE);
+        }
+
+        uint64_t *offsets = (uint64_t *)(void *)(header + 1);
+        uint32_t *freelist = (uint32_t *)(void *)(offsets + memlength);
+        const unsigned char *text = (const unsigned char *)
+            (freelist + freecount);
+
+        while (mem->memcapacity < memlength)
+                mem->memcapacity *= 2;
+        mem->segments = realloc(mem->segments, 
+            mem->memcapacity * sizeof(uint32_t *));
+        mem->memlength = memlength;
+
+        for (uint32_t i = 0; i < memlength; i++) {
+                uint64_t offset = offsets[i];
+
+                if (offset == 0) {
+                        mem->segments[i] = NULL;
+                        continue;
+                }
+
+                if (offset < data || offset > words - 2 || 
+                    image[offset + 1] > words - 2 - offset) {
+                        fprintf(stderr, "Error: %s has segment %u outside "
+                            "its data\n", filename, i);
+                        exit(EXIT_FAILURE);
+                }
+
+                mem->segments[i] = image + offset;
+                if (i == 0 || mem->segments[i] != mem->segments[0])
+                        mem->imagerefs++;
+        }
+
+        if (mem->segments[0] == NULL || 
+            header->prog_count > mem->segments[0][1]) {
+                fprintf(stderr, "Error: %s has no program to resume\n", 
+                    filename);
+                exit(EXIT_FAILURE);
+        }
+
+        for (uint32_t i = 0; i < freecount; i++) {
+                if (freelist[i] == 0 || freelist[i] >= memlength || 
+                    mem->segments[freelist[i]] != NULL) {
+                        fprintf(stderr, "Error: %s frees segment %u, which "
+                            "is not an unmapped identifier\n", filename, 
+                            freelist[i]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        while (mem->unmaplistlength <= freecount)
+                mem->unmaplistlength *= 2;
+        mem->unmapidentifiers = realloc(mem->unmapidentifiers, 
+            sizeof(uint32_t) * mem->unmaplistlength);
+        memcpy(mem->unmapidentifiers + 1, freelist, 
+            sizeof(uint32_t) * freecount);
+        mem->unmaplastindex = freecount;
+
+        mem->image = image;
+        mem->imagebytes = bytes;
+
+        memcpy(registers, header->registers, sizeof(header->registers));
+        *prog_count = header->prog_count;
+
+        for (uint32_t i = 0; i < header->outputbytes; i++)
+                io_output(text[i]);
+
+        decode_prog(mem);
+}
+
+/******************************************************
+*
+* Functions from libum
+*
+******************************************************/
+
+struct um_machine {
+        memory mem;
+        uint32_t registers[8];
+        uint32_t prog_count;
+
+        um_io io;
+        um_status status;
+        um_error error;
+        uint64_t retired;
+        run_slice slice;
+};
+
+/* Function: load_image
+ * Does: Copies an image into segment 0, converting it from big-endian 
+ *       unless it is a native image
+ * Paramters: memory, const void*, size_t
+ * Returns: None
+ */
+static void load_image(memory mem, const void *image, size_t bytes)
+{
+        uint32_t header[2] = { 0, 0 };
+
+        if (bytes % 4 != 0 || bytes / 4 > UINT32_MAX)
+                um_fail(mem, UM_ERROR_IMAGE, "Image of %zu bytes is not a "
+                    "whole number of words", bytes);
+
+        if (bytes >= 8)
+                memcpy(header, image, sizeof(header));
+
+        if (header[0] == NATIVE_MAGIC) {
+                if (header[1] != bytes / 4 - 2)
+                        um_fail(mem, UM_ERROR_IMAGE, "Native image header "
+                            "gives %u words, image holds %zu", header[1], 
+                            bytes / 4 - 2);
+                mem->segments[0] = seg_alloc(mem, header[1]);
+                memcpy(mem->segments[0] + 2, (const uint32_t *)image + 2, 
+                    sizeof(uint32_t) * header[1]);
+        } else {
+                mem->segments[0] = seg_alloc(mem, bytes / 4);
+                swap_words(mem->segments[0] + 2, image, bytes / 4);
+        }
+
+        decode_prog(mem);
+}
+
+/* Function: machine_load
+ * Does: Runs load_image for a new machine, catching its faults
+ * Paramters: um_machine*, const void*, size_t
+ * Returns: false if the image could not be loaded
+ */
+static bool machine_load(um_machine *machine, const void *image, 
+    size_t bytes)
+{
+        memory mem = machine->mem;
+        jmp_buf fault;
+
+        mem->fault = &fault;
+        mem->error = &machine->error;
+        if (setjmp(fault) != 0)
+                return false;
+
+        load_image(mem, image, bytes);
+
+        mem->fault = NULL;
+        mem->error = NULL;
+        return true;
+}
+
+/* Function: um_create
+ * Does: Makes a machine whose segment 0 is a copy of the image
+ * Paramters: const void*, size_t, const um_io*, um_error*
+ * Returns: the machine, or NULL with error filled in
+ */
+um_machine *um_create(const void *image, size_t bytes, const um_io *io, 
+    um_error *error)
+{
+        um_machine *machine = calloc(1, sizeof(*machine));
+
+        if (machine == NULL) {
+                if (error != NULL)
+                        *error = (um_error){ UM_ERROR_MEMORY, 0, 
+                            "Out of memory making a machine" };
+                return NULL;
+        }
+
+        machine->mem = init_mem();
+        machine->mem->segments[0] = NULL;
+        if (io != NULL)
+                machine->io = *io;
+
+        if (!machine_load(machine, image, bytes)) {
+                if (error != NULL)
+                        *error = machine->error;
+                um_free(machine);
+                return NULL;
+        }
+
+        machine->status = UM_BUDGET;
+        return machine;
+}
+
+/* Function: um_run
+ * Does: Runs up to max_instructions instructions on the checked threaded 
+ *       engine, passing input and output to the callbacks. A fault 
+ *       reports the pc of the instruction that raised it.
+ * Paramters: um_machine*, uint64_t
+ * Returns: why the run stopped
+ */
+um_status um_run(um_machine *machine, uint64_t max_instructions)
+{
+        memory mem = machine->mem;
+        run_slice *slice = &machine->slice;
+        jmp_buf fault;
+
+        if (machine->status == UM_HALTED || machine->status == UM_FAILED)
+                return machine->status;
+
+        slice->io = &machine->io;
+        slice->budget = max_instructions;
+        slice->pc = machine->prog_count;
+        slice->status = UM_BUDGET;
+
+        mem->fault = &fault;
+        mem->error = &machine->error;
+        if (setjmp(fault) != 0) {
+                mem->fault = NULL;
+                mem->error = NULL;
+                machine->prog_count = slice->pc;
+                machine->error.pc = slice->pc;
+                /* The instruction that faulted did not retire */
+                machine->retired += max_instructions - slice->budget - 1;
+                machine->status = UM_FAILED;
+                return UM_FAILED;
+        }
+
+#if UM_THREADED
+        run_prog_threaded(mem, machine->registers, &machine->prog_count, 
+            true, slice);
+#else
+        uint32_t *r = machine->registers;
+
+        while (slice->status == UM_BUDGET && slice->budget > 0) {
+                const instr *in = &mem->decoded[machine->prog_count];
+
+                slice->budget--;
+                slice->pc = machine->prog_count;
+                check_instr(mem, r, machine->prog_count);
+
+                switch (in->opcode & OPCODE_MASK) {
+                case 7:
+                        slice->status = UM_HALTED;
+                        break;
+                case 10:
+                        if (slice->io->output != NULL)
+                                slice->io->output(slice->io->context, 
+                                    r[in->c]);
+                        machine->prog_count++;
+                        break;
+                case 11: {
+                        int c = slice->io->input == NULL ? UM_INPUT_EOF : 
+                            slice->io->input(slice->io->context);
+
+                        if (c == UM_INPUT_BLOCKED) {
+                                slice->budget++;
+                                slice->status = UM_BLOCKED;
+                                continue;
+                        }
+                        r[in->c] = c == UM_INPUT_EOF ? ~0u : 
+                            (uint32_t)(c & 0xff);
+                        machine->prog_count++;
+                        break;
+                }
+                default:
+                        exec_instr(mem, r, &machine->prog_count);
+                        break;
+                }
+        }
+#endif
+
+        mem->fault = NULL;
+        mem->error = NULL;
+        machine->retired += max_instructions - slice->budget;
+        machine->status = slice->status;
+
+        return machine->status;
+}
+
+const um_error *um_last_error(const um_machine *machine)
+{
+        return &machine->error;
+}
+
+uint64_t um_instructions(const um_machine *machine)
+{
+        return machine->retired;
+}
+
+uint32_t *const *um_segments(um_machine *machine)
+{
+        return machine->mem->segments;
+}
+
+/* Function: um_map
+ * Does: Maps a segment of zeros for a translated program, as map_segment
+ * Paramters: um_machine*, uint32_t
+ * Returns: the new segment's identifier
+ */
+uint32_t um_map(um_machine *machine, uint32_t words)
+{
+        uint32_t registers[2] = { 0, words };
+
+        map_segment(registers, machine->mem, 0, 1);
+        return registers[0];
+}
+
+void um_unmap(um_machine *machine, uint32_t segment)
+{
+        uint32_t registers[1] = { segment };
+
+        unmap_segment(registers, machine->mem, 0);
+}
+
+uint32_t *um_own(um_machine *machine, uint32_t segment)
+{
+        return seg_own(machine->mem, segment);
+}
+
+/* Function: um_stored
+ * Does: Decodes a word of segment 0 again after a translated program has 
+ *       stored to it directly
+ * Paramters: um_machine*, uint32_t
+ * Returns: None
+ */
+void um_stored(um_machine *machine, uint32_t offset)
+{
+        decode_entry(machine->mem, offset);
+}
+
+void um_get_state(const um_machine *machine, uint32_t registers[8],
+    uint32_t *pc)
+{
+        memcpy(registers, machine->registers, sizeof(machine->registers));
+        *pc = machine->prog_count;
+}
+
+void um_set_state(um_machine *machine, const uint32_t registers[8],
+    uint32_t pc)
+{
+        memcpy(machine->registers, registers, sizeof(machine->registers));
+        machine->prog_count = pc;
+}
+
+void um_free(um_machine *machine)
+{
+        if (machine == NULL)
+                return;
+
+        free_mem(machine->mem);
+        free(machine);
 }
 
 /******************************************************
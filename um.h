@@ -0,0 +1,99 @@
+/* um.h: runs Universal Machines inside another program. A machine is made
+ * from a program image held in memory and runs a bounded number of
+ * instructions per call, so one process can host many machines and decide
+ * how they share the CPU. Input and output go through callbacks, and a
+ * machine that faults reports a structured error instead of exiting.
+ *
+ * Built as libum.a and libum.so from um.c without its main.
+ */
+
+#ifndef UM_H
+#define UM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct um_machine um_machine;
+
+/* Returned by an input callback at end of input, or when no byte is ready
+ * yet. A blocked machine stops on the input instruction and retries it on
+ * the next um_run.
+ */
+#define UM_INPUT_EOF (-1)
+#define UM_INPUT_BLOCKED (-2)
+
+/* Either callback may be NULL: input is then at end, output discarded */
+typedef struct um_io {
+        int (*input)(void *context);
+        void (*output)(void *context, unsigned char byte);
+        void *context;
+} um_io;
+
+typedef enum um_status { UM_HALTED, UM_BLOCKED, UM_BUDGET,
+    UM_FAILED } um_status;
+
+typedef enum um_error_code {
+        UM_ERROR_NONE,
+        UM_ERROR_IMAGE,
+        UM_ERROR_MEMORY,
+        UM_ERROR_OPCODE,
+        UM_ERROR_SEGMENT,
+        UM_ERROR_BOUNDS,
+        UM_ERROR_DIVIDE,
+        UM_ERROR_UNMAP,
+        UM_ERROR_OUTPUT
+} um_error_code;
+
+typedef struct um_error {
+        um_error_code code;
+        uint32_t pc;
+        char message[128];
+} um_error;
+
+/* Makes a machine from a big-endian .um image or a native image of bytes
+ * bytes, which are copied. Returns NULL and fills error if the image is
+ * malformed or memory runs out.
+ */
+um_machine *um_create(const void *image, size_t bytes, const um_io *io,
+    um_error *error);
+
+/* Runs at most max_instructions instructions. Returns UM_HALTED once the
+ * program halts, UM_BLOCKED when input is not ready, UM_BUDGET when the
+ * budget runs out first, and UM_FAILED if the program faults. A halted or
+ * failed machine stays that way.
+ */
+um_status um_run(um_machine *machine, uint64_t max_instructions);
+
+/* The fault that failed the machine, with code UM_ERROR_NONE if none */
+const um_error *um_last_error(const um_machine *machine);
+
+/* Instructions retired over all runs */
+uint64_t um_instructions(const um_machine *machine);
+
+void um_free(um_machine *machine);
+
+/* For programs translated to C by um2c, which run segment 0 as native code
+ * against a machine's memory and hand the machine to um_run for what the
+ * translation cannot do. A segment's words start two words past its
+ * pointer in the table, after its share count and its length. Mapping or
+ * unmapping a segment can move the table, and a store to a segment whose
+ * share count is above 1 must first give it its own storage with um_own,
+ * which moves it. None of these check their arguments.
+ */
+uint32_t *const *um_segments(um_machine *machine);
+uint32_t um_map(um_machine *machine, uint32_t words);
+void um_unmap(um_machine *machine, uint32_t segment);
+uint32_t *um_own(um_machine *machine, uint32_t segment);
+
+/* Tells the machine a word of segment 0 was stored to directly, so the
+ * instruction um_run goes on to run there is the one stored
+ */
+void um_stored(um_machine *machine, uint32_t offset);
+
+/* The registers and program counter um_run starts from and stopped at */
+void um_get_state(const um_machine *machine, uint32_t registers[8],
+    uint32_t *pc);
+void um_set_state(um_machine *machine, const uint32_t registers[8],
+    uint32_t pc);
+
+#endif
@@ -0,0 +1,972 @@
+/* um2c: translates a UM program to C ahead of time. Segment 0 of the image
+ * is decoded with the fields of decode_word and written out as C functions
+ * of a chunk of instructions each, with a label per instruction and the
+ * registers as locals. A load_program whose segment and target are worked
+ * out from the load_values and conditional moves just before it becomes a
+ * direct goto; any other load_program of segment 0 goes through a dense
+ * table of the labels. The program links against libum, which holds its
+ * segments and does the mapping, unmapping and copy-on-write of segments.
+ *
+ * A store to segment 0 is done natively, and the translated words it
+ * changes are marked stale. Native code leaves for the interpreter when a
+ * store changes a word later in the block it is running, or when it jumps
+ * into a block holding a changed word. A load_program of any other
+ * segment or to a pc past the end, and an invalid opcode, also go back to
+ * the interpreter. The interpreter, um_run, carries on from there, and
+ * whenever segment 0 comes to hold one of the translated programs again
+ * the run goes back to native code.
+ *
+ * Besides the image, programs to translate can be taken from the segment
+ * 0 of other images and snapshots, such as one from um --snapshot of a
+ * .umz image, whose boot decompresses the real program into another
+ * segment and loads it. Every word of a program is translated, data
+ * included, so a large one should be written with -o, which splits the
+ * translation into a directory of files of CHUNKS_PER_FILE chunks that
+ * the compiler takes one at a time.
+ *
+ * Native code runs unchecked, like um's own engines; the interpreter
+ * checks everything it runs.
+ *
+ * Usage: um2c image [program ...] > out.c
+ *        cc -O2 -I. out.c libum.a -o out
+ *        um2c -o dir image [program ...]
+ *        cc -O2 -I. dir/main.c dir/run*.c libum.a -o out
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "um-format.h"
+
+/* Instructions copied after an instruction to reach a load_program whose
+ * target they give
+ */
+#define MAX_CHAIN 4
+
+/* Instructions in each function written. The compiler's time grows faster
+ * than the size of a function, and a jump between chunks costs a return
+ * and a call.
+ */
+#define CHUNK_WORDS 1024
+
+/* Chunks in each file written with -o */
+#define CHUNKS_PER_FILE 16
+
+#define WORDS_PER_LINE 6
+
+typedef struct program {
+        const char *filename;
+        uint32_t *words;
+        uint32_t length;
+        bool snapshot;
+
+        /* The last instruction of each instruction's block, as code_reset
+         * works it out in the generated program
+         */
+        uint32_t *ends;
+} program;
+
+/* What the translation knows a register holds where control falls
+ * through: a constant, or one of two constants picked by whether another
+ * register is nonzero, as a conditional move leaves it
+ */
+typedef enum known_kind { UNKNOWN, CONSTANT, SELECT } known_kind;
+
+typedef struct known {
+        known_kind kind;
+        uint32_t value;
+        uint32_t other;
+        unsigned cond;
+} known;
+
+/* The generated program's support code, before and after the programs */
+static const char *const prologue[] = {
+"#include <stdio.h>\n",
+"#include <stdlib.h>\n",
+"#include <stdint.h>\n",
+"#include <stdbool.h>\n",
+"#include <string.h>\n",
+"\n",
+"#include \"um.h\"\n",
+"\n",
+"/* Instructions fall through from case to case, and not every chunk uses\n",
+" * every label and local, nor every file every helper\n",
+" */\n",
+"#pragma GCC diagnostic ignored \"-Wimplicit-fallthrough\"\n",
+"#pragma GCC diagnostic ignored \"-Wunused-label\"\n",
+"#pragma GCC diagnostic ignored \"-Wunused-variable\"\n",
+"#pragma GCC diagnostic ignored \"-Wunused-but-set-variable\"\n",
+"#pragma GCC diagnostic ignored \"-Wunused-function\"\n",
+"\n",
+"/* How a chunk stopped */\n",
+"enum { GO, OUT, HALT };\n",
+"\n",
+"/* A translated program, and which of its words stores to segment 0 have\n",
+" * changed from it. Each instruction's block runs to the next halt or\n",
+" * load_program, and stale counts the changed words of the block ending\n",
+" * at each instruction.\n",
+" */\n",
+"typedef struct code {\n",
+"        const uint32_t *words;\n",
+"        uint32_t length;\n",
+"        uint32_t *ends;\n",
+"        uint32_t *stale;\n",
+"        unsigned char *changed;\n",
+"        uint32_t changes;\n",
+"} code;\n",
+"\n",
+"/* Hands the machine to the interpreter at instruction n */\n",
+"#define EXIT(n) do { *pc = (n); goto out; } while (0)\n",
+"\n",
+"/* Leaves the chunk to carry on at instruction n */\n",
+"#define NEXT(n) do { *pc = (n); goto next; } while (0)\n",
+"\n",
+"/* Goes to instruction t, whose block ends at e, unless a store has\n",
+" * changed an instruction from t to e\n",
+" */\n",
+"#define JUMP(t, e)                                                      \\\n",
+"        do {                                                            \\\n",
+"                if (__builtin_expect(p->stale[e] != 0, 0) &&            \\\n",
+"                    stale_from(p, t))                                   \\\n",
+"                        EXIT(t);                                        \\\n",
+"                target = (t);                                           \\\n",
+"                goto enter;                                             \\\n",
+"        } while (0)\n",
+"\n",
+"/* Goes to instruction t, in this chunk or another, checking it as JUMP\n",
+" * does\n",
+" */\n",
+"#define DISPATCH(t) do { target = (t); goto dispatch; } while (0)\n",
+"\n",
+"/* Stores to a segment other than 0 */\n",
+"#define STORE(a, b, c)                                                  \\\n",
+"        do {                                                            \\\n",
+"                s = seg[a];                                             \\\n",
+"                if (__builtin_expect(s[0] > 1, 0))                      \\\n",
+"                        s = um_own(m, a);                               \\\n",
+"                s[(b) + 2] = (c);                                       \\\n",
+"        } while (0)\n",
+"\n",
+"#define SAVE()                                                          \\\n",
+"        do {                                                            \\\n",
+"                r[0] = r0; r[1] = r1; r[2] = r2; r[3] = r3;             \\\n",
+"                r[4] = r4; r[5] = r5; r[6] = r6; r[7] = r7;             \\\n",
+"        } while (0)\n",
+"\n",
+"/* Sets a program up to run with none of its words changed */\n",
+"static void code_reset(code *p)\n",
+"{\n",
+"        if (p->ends == NULL) {\n",
+"                uint32_t end = p->length - 1;\n",
+"\n",
+"                p->ends = malloc(sizeof(uint32_t) * p->length);\n",
+"                p->stale = malloc(sizeof(uint32_t) * p->length);\n",
+"                p->changed = malloc(p->length);\n",
+"                if (p->ends == NULL || p->stale == NULL ||\n",
+"                    p->changed == NULL) {\n",
+"                        fprintf(stderr, \"Error: out of memory\\n\");\n",
+"                        exit(EXIT_FAILURE);\n",
+"                }\n",
+"                for (uint32_t i = p->length; i-- > 0; ) {\n",
+"                        if (p->words[i] >> 28 == 7 ||\n",
+"                            p->words[i] >> 28 == 12)\n",
+"                                end = i;\n",
+"                        p->ends[i] = end;\n",
+"                }\n",
+"        }\n",
+"\n",
+"        memset(p->stale, 0, sizeof(uint32_t) * p->length);\n",
+"        memset(p->changed, 0, p->length);\n",
+"        p->changes = 0;\n",
+"}\n",
+"\n",
+"__attribute__((noinline))\n",
+"static bool stale_from(const code *p, uint32_t pc)\n",
+"{\n",
+"        for (uint32_t i = pc; i <= p->ends[pc]; i++)\n",
+"                if (p->changed[i])\n",
+"                        return true;\n",
+"        return false;\n",
+"}\n",
+"\n",
+"/* Stores to segment 0 from the instruction at pc. Returns true if the\n",
+" * store changed an instruction later in the running block, which must\n",
+" * then be left.\n",
+" */\n",
+"static inline bool store0(um_machine *m, uint32_t *const *seg, code *p,\n",
+"    uint32_t offset, uint32_t value, uint32_t pc)\n",
+"{\n",
+"        uint32_t *s = seg[0];\n",
+"        bool changed = value != p->words[offset];\n",
+"\n",
+"        if (__builtin_expect(s[0] > 1, 0))\n",
+"                s = um_own(m, 0);\n",
+"        s[offset + 2] = value;\n",
+"\n",
+"        if (__builtin_expect(changed != p->changed[offset], 0)) {\n",
+"                p->changed[offset] = changed;\n",
+"                if (changed) {\n",
+"                        p->stale[p->ends[offset]]++;\n",
+"                        p->changes++;\n",
+"                } else {\n",
+"                        p->stale[p->ends[offset]]--;\n",
+"                        p->changes--;\n",
+"                }\n",
+"        }\n",
+"        return changed && offset > pc && p->ends[offset] == p->ends[pc];\n",
+"}\n",
+"\n",
+"/* Brings the interpreter up to date with the words native code changed,\n",
+" * before handing it the machine\n",
+" */\n",
+"static void code_sync(um_machine *m, const code *p)\n",
+"{\n",
+"        for (uint32_t i = 0; p->changes != 0 && i < p->length; i++)\n",
+"                if (p->changed[i])\n",
+"                        um_stored(m, i);\n",
+"}\n",
+"\n",
+"__attribute__((unused))\n",
+"static uint32_t read_byte(void)\n",
+"{\n",
+"        int c;\n",
+"\n",
+"        fflush(stdout);\n",
+"        c = getchar();\n",
+"        return c == EOF ? ~0u : (uint32_t)c;\n",
+"}\n",
+"\n",
+"static int io_input(void *context)\n",
+"{\n",
+"        (void)context;\n",
+"        fflush(stdout);\n",
+"        int c = getchar();\n",
+"        return c == EOF ? UM_INPUT_EOF : c;\n",
+"}\n",
+"\n",
+"static void io_output(void *context, unsigned char byte)\n",
+"{\n",
+"        (void)context;\n",
+"        putchar(byte);\n",
+"}\n",
+"\n",
+"static void past_end(void)\n",
+"{\n",
+"        fflush(stdout);\n",
+"        fprintf(stderr, \"Error: ran past the end of segment 0\\n\");\n",
+"        exit(EXIT_FAILURE);\n",
+"}\n",
+NULL
+};
+
+static const char *const epilogue[] = {
+"\n",
+"/* Interpreter runs grow to this many instructions between checks of\n",
+" * segment 0\n",
+" */\n",
+"#define MAX_BUDGET (1u << 20)\n",
+"\n",
+"/* Runs the machine in the interpreter from the given state until it\n",
+" * halts, or until segment 0 holds a translated program again, whose\n",
+" * number is returned with the state to carry on from\n",
+" */\n",
+"static int interpret(um_machine *m, uint32_t r[8], uint32_t *pc)\n",
+"{\n",
+"        const uint32_t *checked = um_segments(m)[0];\n",
+"        uint64_t budget = 1;\n",
+"        um_status status;\n",
+"\n",
+"        um_set_state(m, r, *pc);\n",
+"        while ((status = um_run(m, budget)) == UM_BUDGET) {\n",
+"                const uint32_t *prog = um_segments(m)[0];\n",
+"\n",
+"                if (prog != checked) {\n",
+"                        checked = prog;\n",
+"                        um_get_state(m, r, pc);\n",
+"                        for (int k = 0; k < PROGRAMS; k++) {\n",
+"                                code *p = &codes[k];\n",
+"\n",
+"                                if (prog[1] == p->length &&\n",
+"                                    *pc < p->length &&\n",
+"                                    memcmp(prog + 2, p->words,\n",
+"                                    sizeof(uint32_t) * p->length) == 0) {\n",
+"                                        code_reset(p);\n",
+"                                        return k;\n",
+"                                }\n",
+"                        }\n",
+"                }\n",
+"                if (budget < MAX_BUDGET)\n",
+"                        budget *= 2;\n",
+"        }\n",
+"\n",
+"        if (status != UM_HALTED) {\n",
+"                fflush(stdout);\n",
+"                fprintf(stderr, \"Error: %s\\n\", um_last_error(m)->message);\n",
+"                exit(EXIT_FAILURE);\n",
+"        }\n",
+"        return -1;\n",
+"}\n",
+"\n",
+"int main(void)\n",
+"{\n",
+"        um_io io = { io_input, io_output, NULL };\n",
+"        um_error error;\n",
+"        um_machine *m = um_create(image, sizeof(image), &io, &error);\n",
+"        uint32_t r[8] = { 0 };\n",
+"        uint32_t pc = 0;\n",
+"        int k = 0;\n",
+"\n",
+"        if (m == NULL) {\n",
+"                fprintf(stderr, \"Error: %s\\n\", error.message);\n",
+"                return EXIT_FAILURE;\n",
+"        }\n",
+"\n",
+"        code_reset(&codes[0]);\n",
+"        while (k >= 0 && !run[k](m, r, &pc))\n",
+"                k = interpret(m, r, &pc);\n",
+"\n",
+"        fflush(stdout);\n",
+"        um_free(m);\n",
+"        return EXIT_SUCCESS;\n",
+"}\n",
+NULL
+};
+
+/* Function: read_file
+ * Does: Reads a whole file into memory
+ * Paramters: const char*, size_t*
+ * Returns: the bytes, which the caller frees
+ */
+static unsigned char *read_file(const char *filename, size_t *bytes)
+{
+        FILE *in = fopen(filename, "rb");
+        unsigned char *data = NULL;
+        size_t length = 0, capacity = 0, n;
+
+        if (in == NULL) {
+                perror(filename);
+                exit(EXIT_FAILURE);
+        }
+
+        do {
+                if (length == capacity) {
+                        capacity = capacity == 0 ? 65536 : 2 * capacity;
+                        data = realloc(data, capacity);
+                }
+                n = fread(data + length, 1, capacity - length, in);
+                length += n;
+        } while (n > 0);
+
+        fclose(in);
+        *bytes = length;
+        return data;
+}
+
+/* Function: load_program
+ * Does: Finds segment 0 in an image, native image or snapshot
+ * Paramters: const char*
+ * Returns: the program, its words in host order
+ */
+static program load_program(const char *filename)
+{
+        size_t bytes;
+        unsigned char *data = read_file(filename, &bytes);
+        size_t words = bytes / 4;
+        uint32_t first = 0;
+        program prog = { filename, NULL, 0, false, NULL };
+
+        if (bytes % 4 != 0) {
+                fprintf(stderr, "%s: not a UM program\n", filename);
+                exit(EXIT_FAILURE);
+        }
+        if (words > 0)
+                memcpy(&first, data, sizeof(first));
+
+        if (first == NATIVE_MAGIC && words >= 2) {
+                uint32_t header[2];
+
+                memcpy(header, data, sizeof(header));
+                prog.length = header[1] <= words - 2 ? header[1] : words - 2;
+                prog.words = malloc(sizeof(uint32_t) * (prog.length + 1));
+                memcpy(prog.words, data + 8, sizeof(uint32_t) * prog.length);
+        } else if (first == SNAPSHOT_MAGIC &&
+            bytes >= sizeof(snapshot_header) + sizeof(uint64_t)) {
+                uint64_t offset;
+                uint32_t header[2];
+
+                memcpy(&offset, data + sizeof(snapshot_header),
+                    sizeof(offset));
+                if (offset == 0 || offset > words - 2) {
+                        fprintf(stderr, "%s: snapshot has no program\n",
+                            filename);
+                        exit(EXIT_FAILURE);
+                }
+                memcpy(header, data + 4 * offset, sizeof(header));
+                prog.length = header[1] <= words - 2 - offset ? header[1] :
+                    (uint32_t)(words - 2 - offset);
+                prog.words = malloc(sizeof(uint32_t) * (prog.length + 1));
+                memcpy(prog.words, data + 4 * (offset + 2),
+                    sizeof(uint32_t) * prog.length);
+                prog.snapshot = true;
+        } else {
+                /* UM images are big-endian */
+                prog.length = words;
+                prog.words = malloc(sizeof(uint32_t) * (words + 1));
+                for (size_t i = 0; i < words; i++)
+                        prog.words[i] = (uint32_t)data[4 * i] << 24 |
+                            (uint32_t)data[4 * i + 1] << 16 |
+                            (uint32_t)data[4 * i + 2] << 8 |
+                            data[4 * i + 3];
+        }
+
+        free(data);
+        if (prog.length == 0) {
+                fprintf(stderr, "%s: program is empty\n", filename);
+                exit(EXIT_FAILURE);
+        }
+
+        uint32_t end = prog.length - 1;
+
+        prog.ends = malloc(sizeof(uint32_t) * prog.length);
+        for (uint32_t i = prog.length; i-- > 0; ) {
+                if (prog.words[i] >> 28 == 7 || prog.words[i] >> 28 == 12)
+                        end = i;
+                prog.ends[i] = end;
+        }
+
+        return prog;
+}
+
+/* Function: fields
+ * Does: Splits an instruction word as decode_word does in um.c
+ * Paramters: uint32_t, unsigned*, unsigned*, unsigned*, unsigned*,
+ *            uint32_t*
+ * Returns: None
+ */
+static void fields(uint32_t word, unsigned *opcode, unsigned *a,
+    unsigned *b, unsigned *c, uint32_t *value)
+{
+        *opcode = word >> 28;
+
+        if (*opcode == 13) {
+                *a = (word >> 25) & 7;
+                *b = 0;
+                *c = 0;
+                *value = word & 0x1ffffff;
+        } else {
+                *a = (word >> 6) & 7;
+                *b = (word >> 3) & 7;
+                *c = word & 7;
+                *value = 0;
+        }
+}
+
+/* Function: forget
+ * Does: Drops what is known of a register that is written, and of the
+ *       registers whose conditional moves it decided
+ * Paramters: known[], unsigned
+ * Returns: None
+ */
+static void forget(known regs[8], unsigned reg)
+{
+        for (unsigned i = 0; i < 8; i++)
+                if (regs[i].kind == SELECT && regs[i].cond == reg)
+                        regs[i].kind = UNKNOWN;
+        regs[reg].kind = UNKNOWN;
+}
+
+/* Function: follow
+ * Does: Updates what is known of the registers past an instruction that
+ *       control falls through
+ * Paramters: known[], uint32_t
+ * Returns: None
+ */
+static void follow(known regs[8], uint32_t word)
+{
+        unsigned opcode, a, b, c;
+        uint32_t value;
+
+        fields(word, &opcode, &a, &b, &c, &value);
+
+        switch (opcode) {
+        case 0: {
+                known result = { UNKNOWN, 0, 0, 0 };
+
+                if (regs[c].kind == CONSTANT) {
+                        result = regs[c].value != 0 ? regs[b] : regs[a];
+                } else if (regs[a].kind == CONSTANT &&
+                    regs[b].kind == CONSTANT && c != a) {
+                        result = (known){ SELECT, regs[b].value,
+                            regs[a].value, c };
+                }
+                forget(regs, a);
+                if (!(result.kind == SELECT && result.cond == a))
+                        regs[a] = result;
+                break;
+        }
+        case 13:
+                forget(regs, a);
+                regs[a] = (known){ CONSTANT, value, 0, 0 };
+                break;
+        case 8:
+                forget(regs, b);
+                break;
+        case 11:
+                forget(regs, c);
+                break;
+        case 1: case 3: case 4: case 5: case 6:
+                forget(regs, a);
+                break;
+        default:
+                break;
+        }
+}
+
+/* Function: emit_code
+ * Does: Writes the C for one instruction, without its label
+ * Paramters: FILE*, uint32_t, uint32_t, uint32_t
+ * Returns: None
+ */
+static void emit_code(FILE *out, uint32_t word, uint32_t pc, uint32_t length)
+{
+        unsigned opcode, a, b, c;
+        uint32_t value;
+
+        fields(word, &opcode, &a, &b, &c, &value);
+
+        switch (opcode) {
+        case 0:
+                fprintf(out, "if (r%u) r%u = r%u;", c, a, b);
+                break;
+        case 1:
+                fprintf(out, "r%u = seg[r%u][r%u + 2];", a, b, c);
+                break;
+        case 2:
+                fprintf(out, "if (r%u != 0) STORE(r%u, r%u, r%u); "
+                    "else if (r%u >= %u) EXIT(%u); "
+                    "else if (store0(m, seg, p, r%u, r%u, %u)) EXIT(%u);",
+                    a, a, b, c, b, length, pc, b, c, pc, pc + 1);
+                break;
+        case 3:
+                fprintf(out, "r%u = r%u + r%u;", a, b, c);
+                break;
+        case 4:
+                fprintf(out, "r%u = r%u * r%u;", a, b, c);
+                break;
+        case 5:
+                fprintf(out, "r%u = r%u / r%u;", a, b, c);
+                break;
+        case 6:
+                fprintf(out, "r%u = ~(r%u & r%u);", a, b, c);
+                break;
+        case 7:
+                fprintf(out, "goto halt;");
+                break;
+        case 8:
+                fprintf(out, "r%u = um_map(m, r%u); seg = um_segments(m);",
+                    b, c);
+                break;
+        case 9:
+                fprintf(out, "um_unmap(m, r%u); seg = um_segments(m);", c);
+                break;
+        case 10:
+                fprintf(out, "putchar((unsigned char)r%u);", c);
+                break;
+        case 11:
+                fprintf(out, "r%u = read_byte();", c);
+                break;
+        case 12:
+                fprintf(out, "if (r%u != 0 || r%u >= %u) EXIT(%u); "
+                    "DISPATCH(r%u);", b, c, length, pc, c);
+                break;
+        case 13:
+                fprintf(out, "r%u = 0x%xu;", a, value);
+                break;
+        default:
+                fprintf(out, "EXIT(%u);", pc);
+                break;
+        }
+}
+
+/* Function: emit_jump
+ * Does: Writes a jump to a known instruction: straight to its case if it
+ *       is in the chunk being written, else back out to run the chunk
+ *       that holds it
+ * Paramters: FILE*, const program*, uint32_t, uint32_t
+ * Returns: None
+ */
+static void emit_jump(FILE *out, const program *prog, uint32_t target,
+    uint32_t chunk)
+{
+        if (target / CHUNK_WORDS == chunk)
+                fprintf(out, "JUMP(%u, %u);\n", target, prog->ends[target]);
+        else
+                fprintf(out, "NEXT(%u);\n", target);
+}
+
+/* Function: emit_chain
+ * Does: Where control falls through into from with the registers as
+ *       known, looks for a load_program a few instructions on whose
+ *       segment is 0 and whose target is known. If there is one, writes
+ *       copies of the instructions before it and a direct goto.
+ * Paramters: FILE*, const program*, uint32_t, const known[]
+ * Returns: None
+ */
+static void emit_chain(FILE *out, const program *prog, uint32_t from,
+    const known start[8], uint32_t chunk)
+{
+        known regs[8];
+        uint32_t end;
+
+        memcpy(regs, start, sizeof(regs));
+
+        for (end = from; end < prog->length && end - from <= MAX_CHAIN;
+            end++) {
+                unsigned opcode, a, b, c;
+                uint32_t value;
+
+                fields(prog->words[end], &opcode, &a, &b, &c, &value);
+                if (opcode == 12)
+                        break;
+                if (opcode == 2 || (opcode >= 7 && opcode <= 12) ||
+                    opcode > 13)
+                        return;
+                follow(regs, prog->words[end]);
+        }
+        if (end == prog->length || end - from > MAX_CHAIN)
+                return;
+
+        unsigned opcode, a, b, c;
+        uint32_t value;
+
+        fields(prog->words[end], &opcode, &a, &b, &c, &value);
+        if (regs[b].kind == CONSTANT && regs[b].value != 0)
+                return;
+
+        bool select = regs[c].kind == SELECT;
+
+        if (!(regs[c].kind == CONSTANT && regs[c].value < prog->length) &&
+            !(select && regs[c].value < prog->length &&
+            regs[c].other < prog->length))
+                return;
+
+        for (uint32_t pc = from; pc < end; pc++) {
+                fprintf(out, "                     ");
+                emit_code(out, prog->words[pc], pc, prog->length);
+                fprintf(out, "\n");
+        }
+
+        /* A segment register not known to be 0 is tested on the way */
+        if (regs[b].kind != CONSTANT)
+                fprintf(out, "                     if (r%u != 0) EXIT(%u);\n",
+                    b, end);
+        if (select) {
+                fprintf(out, "                     if (r%u) ", regs[c].cond);
+                emit_jump(out, prog, regs[c].value, chunk);
+                fprintf(out, "                     ");
+                emit_jump(out, prog, regs[c].other, chunk);
+        } else {
+                fprintf(out, "                     ");
+                emit_jump(out, prog, regs[c].value, chunk);
+        }
+}
+
+/* Function: emit_chunk
+ * Does: Writes the instructions of one chunk of a program as the cases of
+ *       a function, which runs from *pc with the registers in r until it
+ *       halts, leaves the chunk or hands the machine to the interpreter
+ * Paramters: FILE*, const program*, int, uint32_t, const char*
+ * Returns: None
+ */
+static void emit_chunk(FILE *out, const program *prog, int number,
+    uint32_t chunk, const char *linkage)
+{
+        uint32_t first = chunk * CHUNK_WORDS;
+        uint32_t last = prog->length - first > CHUNK_WORDS ?
+            first + CHUNK_WORDS - 1 : prog->length - 1;
+
+        fprintf(out, "\n%sint run%d_%u(um_machine *m, uint32_t r[8], "
+            "uint32_t *pc)\n{\n", linkage, number, chunk);
+        fprintf(out,
+            "        code *const p = &codes[%d];\n"
+            "        uint32_t *const *seg = um_segments(m);\n"
+            "        uint32_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3];\n"
+            "        uint32_t r4 = r[4], r5 = r[5], r6 = r[6], r7 = r[7];\n"
+            "        uint32_t target = *pc, *s;\n"
+            "\n"
+            "dispatch:\n"
+            "        if (target - %uu > %uu)\n"
+            "                NEXT(target);\n"
+            "        if (__builtin_expect(p->stale[p->ends[target]] != 0, 0) &&\n"
+            "            stale_from(p, target))\n"
+            "                EXIT(target);\n"
+            "enter:\n"
+            "        switch (target) {\n", number, first, last - first);
+
+        for (uint32_t pc = first; pc <= last; pc++) {
+                known regs[8] = { { UNKNOWN, 0, 0, 0 } };
+                unsigned opcode = prog->words[pc] >> 28;
+                char label[24];
+
+                snprintf(label, sizeof(label), "case %u:", pc);
+                fprintf(out, "        %-12s ", label);
+                emit_code(out, prog->words[pc], pc, prog->length);
+                fprintf(out, "\n");
+
+                /* Only what this instruction sets is known past it, since
+                 * any instruction can be jumped to
+                 */
+                follow(regs, prog->words[pc]);
+                if (pc + 1 < prog->length && opcode != 7 && opcode != 12 &&
+                    opcode < 14)
+                        emit_chain(out, prog, pc + 1, regs, chunk);
+        }
+
+        fprintf(out, "        }\n");
+        if (last + 1 == prog->length)
+                fprintf(out, "        past_end();\n");
+        else
+                fprintf(out, "        NEXT(%u);\n", last + 1);
+        fprintf(out,
+            "halt:\n"
+            "        SAVE();\n"
+            "        return HALT;\n"
+            "out:\n"
+            "        SAVE();\n"
+            "        return OUT;\n"
+            "next:\n"
+            "        SAVE();\n"
+            "        return GO;\n"
+            "}\n");
+}
+
+static uint32_t chunk_count(const program *prog)
+{
+        return (prog->length - 1) / CHUNK_WORDS + 1;
+}
+
+/* Function: emit_function
+ * Does: Writes a function that runs a program's chunks from *pc with the
+ *       registers in r, saving the registers back when it stops
+ * Paramters: FILE*, const program*, int
+ * Returns: None
+ */
+static void emit_function(FILE *out, const program *prog, int number)
+{
+        uint32_t chunks = chunk_count(prog);
+
+        fprintf(out, "\n/* %s: %u words */\n", prog->filename, prog->length);
+        fprintf(out, "static bool run%d(um_machine *m, uint32_t r[8], "
+            "uint32_t *pc)\n{\n"
+            "        static int (*const chunks[])(um_machine *, uint32_t [8], "
+            "uint32_t *) = {", number);
+        for (uint32_t chunk = 0; chunk < chunks; chunk++)
+                fprintf(out, "%srun%d_%u,", chunk % 4 == 0 ?
+                    "\n                " : " ", number, chunk);
+        fprintf(out, "\n        };\n"
+            "        int how;\n"
+            "\n"
+            "        do\n"
+            "                how = chunks[*pc / CHUNK](m, r, pc);\n"
+            "        while (how == GO);\n"
+            "\n"
+            "        if (how == OUT)\n"
+            "                code_sync(m, &codes[%d]);\n"
+            "        return how == HALT;\n"
+            "}\n", number);
+}
+
+/* Function: emit_words
+ * Does: Writes words as the initializer of an array
+ * Paramters: FILE*, const uint32_t*, uint32_t
+ * Returns: None
+ */
+static void emit_words(FILE *out, const uint32_t *words, uint32_t length)
+{
+        for (uint32_t i = 0; i < length; i++)
+                fprintf(out, "%s0x%08xu,", i % WORDS_PER_LINE == 0 ?
+                    "\n        " : " ", words[i]);
+        fprintf(out, "\n};\n");
+}
+
+static void emit_lines(FILE *out, const char *const lines[])
+{
+        for (size_t i = 0; lines[i] != NULL; i++)
+                fputs(lines[i], out);
+}
+
+/* Function: open_output
+ * Does: Creates a file in the directory given with -o
+ * Paramters: const char*, const char*
+ * Returns: the file
+ */
+static FILE *open_output(const char *dir, const char *name)
+{
+        char path[4096];
+        FILE *out;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        out = fopen(path, "w");
+        if (out == NULL) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+
+        return out;
+}
+
+static void close_output(FILE *out)
+{
+        if (fflush(out) != 0 || ferror(out) || (out != stdout &&
+            fclose(out) != 0)) {
+                perror("um2c");
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Function: emit_support
+ * Does: Writes the support code every file of the translation needs.
+ *       Split across files with -o, the chunks and the programs' table
+ *       are shared between them.
+ * Paramters: FILE*, const program*, int, const char*
+ * Returns: None
+ */
+static void emit_support(FILE *out, const program *progs, int count,
+    const char *dir)
+{
+        fprintf(out, "/* Translated by um2c from");
+        for (int k = 0; k < count; k++)
+                fprintf(out, " %s", progs[k].filename);
+        fprintf(out, " */\n\n");
+        emit_lines(out, prologue);
+        fprintf(out, "\n#define PROGRAMS %d\n#define CHUNK %d\n", count,
+            CHUNK_WORDS);
+
+        if (dir == NULL)
+                return;
+
+        fprintf(out, "\nextern code codes[PROGRAMS];\n\n");
+        for (int k = 0; k < count; k++)
+                for (uint32_t chunk = 0; chunk < chunk_count(&progs[k]);
+                    chunk++)
+                        fprintf(out, "int run%d_%u(um_machine *m, "
+                            "uint32_t r[8], uint32_t *pc);\n", k, chunk);
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-o dir] image [program ...]\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *dir = NULL;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "o:")) != -1) {
+                switch (opt) {
+                case 'o':
+                        dir = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (optind >= argc)
+                usage(argv[0]);
+
+        int count = argc - optind;
+        program *progs = malloc(sizeof(program) * count);
+
+        for (int k = 0; k < count; k++)
+                progs[k] = load_program(argv[optind + k]);
+        if (progs[0].snapshot) {
+                fprintf(stderr, "%s: the image cannot be a snapshot; give "
+                    "it after the image\n", argv[optind]);
+                exit(EXIT_FAILURE);
+        }
+
+        /* With -o, the support code goes in a header and the chunks in
+         * files of their own beside main.c
+         */
+        FILE *out = stdout;
+        const char *linkage = "static ";
+
+        if (dir != NULL) {
+                out = open_output(dir, "um2c.h");
+                emit_support(out, progs, count, dir);
+                close_output(out);
+
+                for (int k = 0; k < count; k++) {
+                        uint32_t chunks = chunk_count(&progs[k]);
+
+                        for (uint32_t chunk = 0; chunk < chunks; chunk++) {
+                                if (chunk % CHUNKS_PER_FILE == 0) {
+                                        char name[64];
+
+                                        if (chunk != 0)
+                                                close_output(out);
+                                        snprintf(name, sizeof(name),
+                                            "run%d_%u.c", k, chunk);
+                                        out = open_output(dir, name);
+                                        fprintf(out, "#include "
+                                            "\"um2c.h\"\n");
+                                }
+                                emit_chunk(out, &progs[k], k, chunk, "");
+                        }
+                        close_output(out);
+                }
+
+                out = open_output(dir, "main.c");
+                fprintf(out, "#include \"um2c.h\"\n");
+                linkage = "";
+        } else {
+                emit_support(out, progs, count, dir);
+        }
+
+        /* The image goes to um_create as a native image */
+        fprintf(out, "\nstatic const uint32_t image[] = {\n        "
+            "0x%08xu, %uu,", NATIVE_MAGIC, progs[0].length);
+        emit_words(out, progs[0].words, progs[0].length);
+        for (int k = 1; k < count; k++) {
+                fprintf(out, "\nstatic const uint32_t program%d[] = {", k);
+                emit_words(out, progs[k].words, progs[k].length);
+        }
+
+        fprintf(out, "\n%scode codes[PROGRAMS] = {\n"
+            "        { image + 2, %uu, NULL, NULL, NULL, 0 },\n",
+            linkage, progs[0].length);
+        for (int k = 1; k < count; k++)
+                fprintf(out, "        { program%d, %uu, NULL, NULL, NULL, 0 },\n",
+                    k, progs[k].length);
+        fprintf(out, "};\n");
+
+        for (int k = 0; k < count; k++) {
+                if (dir == NULL)
+                        for (uint32_t chunk = 0;
+                            chunk < chunk_count(&progs[k]); chunk++)
+                                emit_chunk(out, &progs[k], k, chunk,
+                                    linkage);
+                emit_function(out, &progs[k], k);
+        }
+
+        fprintf(out, "\nstatic bool (*const run[PROGRAMS])(um_machine *, "
+            "uint32_t [8], uint32_t *) = {\n       ");
+        for (int k = 0; k < count; k++)
+                fprintf(out, " run%d,", k);
+        fprintf(out, "\n};\n");
+        emit_lines(out, epilogue);
+        close_output(out);
+
+        for (int k = 0; k < count; k++) {
+                free(progs[k].words);
+                free(progs[k].ends);
+        }
+        free(progs);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,451 @@
+/* umbench: runs the shipped UM images a set number of times and reports,
+ * for each one, wall time, instructions retired, instructions per second
+ * and peak resident set size. Every run's output is checked against a
+ * golden digest. Results are written as tab-separated lines and can be
+ * compared against a saved baseline, failing if any image got slower by
+ * more than a threshold.
+ *
+ * Usage: umbench [-n runs] [-u um] [-o results] [-b baseline]
+ *                [-t percent] [-- um-flags...]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "fnv.h"
+
+#define DEFAULT_RUNS 3
+#define DEFAULT_THRESHOLD 10.0
+#define MAX_FLAGS 32
+
+/* Exit status of a child that could not run the UM */
+#define EXIT_NOT_RUN 127
+
+typedef struct bench {
+        const char *name;
+        const char *image;
+        const char *input;
+        uint64_t digest;
+} bench;
+
+static const bench benches[] = {
+        { "midmark", "midmark.um", NULL, 0x692839eedd2f6cddull },
+        { "sandmark", "sandmark.umz", NULL, 0xc4882e6ad5f8fbc5ull },
+        { "advent", "advent.umz", "advent.txt", 0x8e7b4cc080bbd729ull },
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+typedef enum run_outcome { RUN_OK, RUN_NOT_RUN, RUN_FAILED } run_outcome;
+
+typedef struct result {
+        double seconds;
+        long maxrss_kb;
+        uint64_t digest;
+        uint64_t instructions;
+        int status;
+} result;
+
+/* Function: read_digest
+ * Does: Reads what fd has ready, folding it into a digest
+ * Paramters: int, uint64_t*
+ * Returns: false at end of input
+ */
+static bool read_digest(int fd, uint64_t *digest)
+{
+        unsigned char buf[65536];
+        ssize_t n = read(fd, buf, sizeof(buf));
+
+        if (n < 0)
+                return errno == EINTR || errno == EAGAIN;
+        for (ssize_t i = 0; i < n; i++) {
+                *digest ^= buf[i];
+                *digest *= FNV_PRIME;
+        }
+
+        return n > 0;
+}
+
+/* Function: read_text
+ * Does: Reads what fd has ready onto the end of a growing string
+ * Paramters: int, char**, size_t*
+ * Returns: false at end of input
+ */
+static bool read_text(int fd, char **text, size_t *length)
+{
+        char buf[4096];
+        ssize_t n = read(fd, buf, sizeof(buf));
+
+        if (n < 0)
+                return errno == EINTR || errno == EAGAIN;
+        if (n == 0)
+                return false;
+
+        *text = realloc(*text, *length + n + 1);
+        memcpy(*text + *length, buf, n);
+        *length += n;
+        (*text)[*length] = '\0';
+
+        return true;
+}
+
+/* Function: engine_flags
+ * Does: Tells how many of the flags at flags[i] pick an engine, which a
+ *       counting run leaves out since --count runs the switch loop
+ * Paramters: char**, int, int
+ * Returns: 0, or the number of flags to skip
+ */
+static int engine_flags(char **flags, int nflags, int i)
+{
+        if (strcmp(flags[i], "--profile") == 0)
+                return i + 1 < nflags ? 2 : 1;
+        if (strcmp(flags[i], "--switch") == 0 ||
+            strcmp(flags[i], "--threaded") == 0 ||
+            strcmp(flags[i], "--jit") == 0 ||
+            strcmp(flags[i], "--checked") == 0)
+                return 1;
+        return 0;
+}
+
+/* Function: run_once
+ * Does: Runs the UM on one image with its input, timing it and digesting
+ *       its output. A counting run adds --count and reads the count back
+ *       from standard error, which is drained alongside the output so
+ *       neither pipe can fill while the other is read.
+ * Paramters: const char*, char**, int, const bench*, bool, result*
+ * Returns: RUN_NOT_RUN if the UM could not be started, RUN_FAILED if it
+ *          did not exit with status 0, with its wait status in res
+ */
+static run_outcome run_once(const char *um, char **flags, int nflags,
+    const bench *b, bool counting, result *res)
+{
+        char *argv[MAX_FLAGS + 4];
+        int argc = 0;
+        int out[2], err[2] = { -1, -1 };
+        struct timespec start, stop;
+
+        argv[argc++] = (char *)um;
+        if (counting)
+                argv[argc++] = "--count";
+        for (int i = 0; i < nflags; i++) {
+                int skip = counting ? engine_flags(flags, nflags, i) : 0;
+
+                if (skip > 0)
+                        i += skip - 1;
+                else
+                        argv[argc++] = flags[i];
+        }
+        argv[argc++] = (char *)b->image;
+        argv[argc] = NULL;
+
+        if (pipe(out) != 0) {
+                perror("umbench: pipe");
+                return RUN_NOT_RUN;
+        }
+        if (counting && pipe(err) != 0) {
+                perror("umbench: pipe");
+                close(out[0]);
+                close(out[1]);
+                return RUN_NOT_RUN;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+                perror("umbench: fork");
+                close(out[0]);
+                close(out[1]);
+                if (counting) {
+                        close(err[0]);
+                        close(err[1]);
+                }
+                return RUN_NOT_RUN;
+        }
+
+        if (pid == 0) {
+                int in = open(b->input != NULL ? b->input : "/dev/null",
+                    O_RDONLY);
+
+                if (in < 0) {
+                        perror(b->input);
+                        _exit(EXIT_NOT_RUN);
+                }
+                dup2(in, STDIN_FILENO);
+                dup2(out[1], STDOUT_FILENO);
+                close(in);
+                close(out[0]);
+                close(out[1]);
+                if (counting) {
+                        dup2(err[1], STDERR_FILENO);
+                        close(err[0]);
+                        close(err[1]);
+                }
+                execv(um, argv);
+                perror(um);
+                _exit(EXIT_NOT_RUN);
+        }
+
+        close(out[1]);
+        if (counting)
+                close(err[1]);
+
+        /* poll skips the stderr entry when it is -1 */
+        struct pollfd fds[2] = { { out[0], POLLIN, 0 }, { err[0], POLLIN, 0 } };
+        char *text = NULL;
+        size_t length = 0;
+
+        res->digest = FNV_SEED;
+        while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+                if (poll(fds, 2, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("umbench: poll");
+                        break;
+                }
+                if (fds[0].revents != 0 && !read_digest(fds[0].fd, 
+                    &res->digest))
+                        fds[0].fd = -1;
+                if (fds[1].revents != 0 && !read_text(fds[1].fd, &text, 
+                    &length))
+                        fds[1].fd = -1;
+        }
+        close(out[0]);
+
+        if (counting) {
+                unsigned long long count = 0;
+                char *line = text == NULL ? NULL : 
+                    strstr(text, "instructions: ");
+
+                if (line != NULL)
+                        sscanf(line, "instructions: %llu", &count);
+                res->instructions = count;
+                close(err[0]);
+        }
+        free(text);
+
+        struct rusage usage;
+        if (wait4(pid, &res->status, 0, &usage) < 0) {
+                perror("umbench: wait4");
+                return RUN_NOT_RUN;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        res->seconds = (stop.tv_sec - start.tv_sec) +
+            (stop.tv_nsec - start.tv_nsec) / 1e9;
+        res->maxrss_kb = usage.ru_maxrss;
+
+        if (WIFEXITED(res->status) && WEXITSTATUS(res->status) == 0)
+                return RUN_OK;
+        if (WIFEXITED(res->status) && 
+            WEXITSTATUS(res->status) == EXIT_NOT_RUN)
+                return RUN_NOT_RUN;
+        return RUN_FAILED;
+}
+
+/* Function: check_run
+ * Does: Tells on stderr why a run of a benchmark went wrong, if it did:
+ *       the UM could not be run, it exited with an error or a signal, or
+ *       its output does not match the golden digest
+ * Paramters: const bench*, const char*, run_outcome, const result*
+ * Returns: true if the run is good
+ */
+static bool check_run(const bench *b, const char *um, run_outcome outcome,
+    const result *res)
+{
+        switch (outcome) {
+        case RUN_NOT_RUN:
+                fprintf(stderr, "%s: could not run %s\n", b->name, um);
+                return false;
+        case RUN_FAILED:
+                if (WIFSIGNALED(res->status))
+                        fprintf(stderr, "%s: %s was killed by signal %d\n",
+                            b->name, um, WTERMSIG(res->status));
+                else
+                        fprintf(stderr, "%s: %s exited with status %d\n",
+                            b->name, um, WEXITSTATUS(res->status));
+                return false;
+        case RUN_OK:
+                break;
+        }
+
+        if (res->digest != b->digest) {
+                fprintf(stderr, "%s: output does not match its golden "
+                    "digest\n", b->name);
+                return false;
+        }
+
+        return true;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+        double x = *(const double *)a, y = *(const double *)b;
+
+        return (x > y) - (x < y);
+}
+
+/* Function: baseline_median
+ * Does: Looks up the median time recorded for name in a results file
+ * Paramters: FILE*, const char*
+ * Returns: the median in seconds, or a negative number if absent
+ */
+static double baseline_median(FILE *baseline, const char *name)
+{
+        char line[512];
+
+        rewind(baseline);
+        while (fgets(line, sizeof(line), baseline) != NULL) {
+                char found[64];
+                int runs;
+                double best, median;
+
+                if (sscanf(line, "%63s %d %lf %lf", found, &runs, &best,
+                    &median) == 4 && strcmp(found, name) == 0)
+                        return median;
+        }
+
+        return -1;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-n runs] [-u um] [-o results] "
+            "[-b baseline] [-t percent] [-- um-flags...]\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+        int runs = DEFAULT_RUNS;
+        double threshold = DEFAULT_THRESHOLD;
+        const char *um = "./um";
+        const char *results_name = NULL;
+        const char *baseline_name = NULL;
+        char **flags = NULL;
+        int nflags = 0;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:u:o:b:t:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        runs = atoi(optarg);
+                        break;
+                case 'u':
+                        um = optarg;
+                        break;
+                case 'o':
+                        results_name = optarg;
+                        break;
+                case 'b':
+                        baseline_name = optarg;
+                        break;
+                case 't':
+                        threshold = atof(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        flags = argv + optind;
+        nflags = argc - optind;
+
+        if (runs < 1 || nflags > MAX_FLAGS)
+                usage(argv[0]);
+
+        FILE *results = stdout;
+        if (results_name != NULL && (results = fopen(results_name, "w"))
+            == NULL) {
+                perror(results_name);
+                exit(EXIT_FAILURE);
+        }
+
+        FILE *baseline = NULL;
+        if (baseline_name != NULL && (baseline = fopen(baseline_name, "r"))
+            == NULL) {
+                perror(baseline_name);
+                exit(EXIT_FAILURE);
+        }
+
+        bool failed = false;
+        double *times = malloc(sizeof(double) * runs);
+
+        fprintf(results, "# name\truns\tbest_s\tmedian_s\tinstructions\t"
+            "ips\tmaxrss_kb\tdigest\tstatus\n");
+
+        for (unsigned i = 0; i < NUM_BENCHES; i++) {
+                const bench *b = &benches[i];
+                result res;
+                long maxrss = 0;
+                bool ok = true;
+
+                /* Counts instructions once; timed runs use the given flags */
+                ok = check_run(b, um, run_once(um, flags, 0, b, true, &res),
+                    &res);
+                uint64_t instructions = res.instructions;
+
+                for (int r = 0; r < runs && ok; r++) {
+                        ok = check_run(b, um, run_once(um, flags, nflags, b,
+                            false, &res), &res);
+                        times[r] = res.seconds;
+                        if (res.maxrss_kb > maxrss)
+                                maxrss = res.maxrss_kb;
+                }
+
+                if (!ok) {
+                        fprintf(results, "%s\t0\t0\t0\t0\t0\t0\t%016llx\t"
+                            "FAIL\n", b->name,
+                            (unsigned long long)res.digest);
+                        failed = true;
+                        continue;
+                }
+
+                qsort(times, runs, sizeof(double), compare_doubles);
+                double median = times[runs / 2];
+
+                fprintf(results, "%s\t%d\t%.3f\t%.3f\t%llu\t%.0f\t%ld\t"
+                    "%016llx\tok\n", b->name, runs, times[0], median,
+                    (unsigned long long)instructions,
+                    instructions / median, maxrss,
+                    (unsigned long long)res.digest);
+
+                fprintf(stderr, "%-10s %8.3fs median %8.3fs best %7.1f "
+                    "Minst/s %8ld KB", b->name, median, times[0],
+                    instructions / median / 1e6, maxrss);
+
+                if (baseline != NULL) {
+                        double before = baseline_median(baseline, b->name);
+
+                        if (before > 0) {
+                                double change = (median - before) / before
+                                    * 100;
+                                fprintf(stderr, "  %+6.1f%% vs baseline",
+                                    change);
+                                if (change > threshold) {
+                                        fprintf(stderr, " REGRESSION");
+                                        failed = true;
+                                }
+                        }
+                }
+                fprintf(stderr, "\n");
+        }
+
+        free(times);
+        if (results != stdout)
+                fclose(results);
+        if (baseline != NULL)
+                fclose(baseline);
+
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,421 @@
+/* umcheck: the cases make check runs. It writes small hand-assembled UM
+ * programs to dir for make check to run on each engine, each printing
+ * "ok" when it sees what it should:
+ *   - smc.um stores into a later word of segment 0, once the block holding
+ *     that word is hot enough to be translated, and jumps to it;
+ *   - shared.um loads a copy of itself as segment 0 and stores through
+ *     both identifiers of the shared storage;
+ *   - echo.um maps a segment, prompts and echoes its input, for snapshot
+ *     and record/replay round trips, with echo.in to feed it.
+ * It then runs a program for each UM_ERROR_* code through libum and
+ * checks the code and the pc um_run reports, and that input that is not
+ * ready stops a run without retiring the input instruction.
+ *
+ * Usage: umcheck dir
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "um.h"
+
+/* Passes of the loop in smc.um before the store, well past JIT_THRESHOLD */
+#define SMC_PASSES 1000
+
+/* Address space left to the memory fault case, in bytes */
+#define FAULT_AS_BYTES (1ul << 30)
+
+static uint32_t prog[256];
+static unsigned prog_len = 0;
+
+static inline uint32_t encode(uint32_t opcode, unsigned a, unsigned b,
+    unsigned c)
+{
+        return (opcode << 28) | (a << 6) | (b << 3) | c;
+}
+
+static inline void emit(uint32_t opcode, unsigned a, unsigned b, unsigned c)
+{
+        prog[prog_len++] = encode(opcode, a, b, c);
+}
+
+static inline void emit_value(unsigned a, uint32_t value)
+{
+        prog[prog_len++] = (13u << 28) | (a << 25) | value;
+}
+
+/* Function: emit_output
+ * Does: Emits the output of each byte of text, through register r
+ * Paramters: unsigned, const char*
+ * Returns: None
+ */
+static void emit_output(unsigned r, const char *text)
+{
+        for (; *text != '\0'; text++) {
+                emit_value(r, (unsigned char)*text);
+                emit(10, 0, 0, r);
+        }
+}
+
+/* Function: emit_branch
+ * Does: Emits a jump to taken when register test is nonzero and to other
+ *       otherwise. The targets are patched in at the returned offset and
+ *       the one after. Uses r3 and r4.
+ * Paramters: unsigned
+ * Returns: the offset of the load_value of taken
+ */
+static unsigned emit_branch(unsigned test)
+{
+        unsigned at = prog_len;
+
+        emit_value(4, 0);
+        emit_value(3, 0);
+        emit(0, 3, 4, test);
+        emit(12, 0, 0, 3);
+        return at;
+}
+
+static void patch_branch(unsigned at, uint32_t taken, uint32_t other)
+{
+        prog[at] |= taken;
+        prog[at + 1] |= other;
+}
+
+/* Function: write_image
+ * Does: Writes the program as a big-endian image to dir/name and starts
+ *       the next one
+ * Paramters: const char*, const char*
+ * Returns: None
+ */
+static void write_image(const char *dir, const char *name)
+{
+        char path[4096];
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if ((fp = fopen(path, "wb")) == NULL) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        for (unsigned i = 0; i < prog_len; i++) {
+                uint32_t w = prog[i];
+                unsigned char bytes[4] = { w >> 24, w >> 16, w >> 8, w };
+
+                fwrite(bytes, 1, sizeof(bytes), fp);
+        }
+        if (fclose(fp) != 0) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        prog_len = 0;
+}
+
+/* Function: build_smc
+ * Does: Writes smc.um. A loop runs SMC_PASSES times over a load_value of
+ *       'n' into r1; then the store, which sits before the loop, replaces
+ *       it with a load_value of 'o' and jumps to it for one more pass.
+ *       A stale copy of the loop prints "nk".
+ * Paramters: const char*
+ * Returns: None
+ */
+static void build_smc(const char *dir)
+{
+        /* r0 = 0, r6 = -1, r2 = whether the store has run,
+         * r5 = the new instruction, built as 0xd2 << 24 | 'o' */
+        emit_value(0, 0);
+        emit_value(6, 0);
+        emit(6, 6, 6, 6);
+        emit_value(2, 0);
+        emit_value(7, SMC_PASSES);
+        emit_value(5, 0xd2);
+        emit_value(1, 1 << 24);
+        emit(4, 5, 5, 1);
+        emit_value(1, 'o');
+        emit(3, 5, 5, 1);
+
+        unsigned skip = emit_branch(2);
+        uint32_t store = prog_len;
+        emit_value(1, 0);
+        unsigned word = prog_len - 1;
+        emit(2, 0, 1, 5);
+        emit(12, 0, 0, 1);
+
+        uint32_t loop = prog_len;
+        emit_value(1, 'n');
+        emit(3, 7, 7, 6);
+        unsigned again = emit_branch(7);
+
+        uint32_t after = prog_len;
+        unsigned done = emit_branch(2);
+
+        uint32_t rerun = prog_len;
+        emit_value(2, 1);
+        emit_value(7, 1);
+        emit_value(3, store);
+        emit(12, 0, 0, 3);
+
+        uint32_t finish = prog_len;
+        emit(10, 0, 0, 1);
+        emit_output(1, "k\n");
+        emit(7, 0, 0, 0);
+
+        prog[word] |= loop;
+        patch_branch(skip, store, loop);
+        patch_branch(again, loop, after);
+        patch_branch(done, finish, rerun);
+        write_image(dir, "smc.um");
+}
+
+/* Function: build_shared
+ * Does: Writes shared.um. The program copies itself into segment 1 and
+ *       loads it, so both identifiers share its storage; then it stores a
+ *       newline into segment 1's data word and 'k' into segment 0's, and
+ *       prints segment 0's word before and after and segment 1's.
+ * Paramters: const char*
+ * Returns: None
+ */
+static void build_shared(const char *dir)
+{
+        emit_value(0, 0);
+        emit_value(6, 0);
+        emit(6, 6, 6, 6);
+        emit_value(7, 0);
+        unsigned length = prog_len - 1;
+        emit(8, 0, 2, 7);
+
+        /* Copies words length - 1 down to 0 into segment r2 */
+        uint32_t copy = prog_len;
+        emit(3, 7, 7, 6);
+        emit(1, 1, 0, 7);
+        emit(2, 2, 7, 1);
+        unsigned again = emit_branch(7);
+
+        uint32_t load = prog_len;
+        emit_value(1, 0);
+        unsigned resume = prog_len - 1;
+        emit(12, 0, 2, 1);
+
+        uint32_t shared = prog_len;
+        emit_value(7, 0);
+        unsigned data = prog_len - 1;
+        emit_value(1, '\n');
+        emit(2, 2, 7, 1);
+        emit(1, 1, 0, 7);
+        emit(10, 0, 0, 1);
+        emit_value(1, 'k');
+        emit(2, 0, 7, 1);
+        emit(1, 1, 0, 7);
+        emit(10, 0, 0, 1);
+        emit(1, 1, 2, 7);
+        emit(10, 0, 0, 1);
+        emit(7, 0, 0, 0);
+
+        prog[prog_len] = 'o';
+        prog[data] |= prog_len++;
+        prog[length] |= prog_len;
+        prog[resume] |= shared;
+        patch_branch(again, copy, load);
+        write_image(dir, "shared.um");
+}
+
+/* Function: build_echo
+ * Does: Writes echo.um, which keeps 'o' in a segment it maps before its
+ *       first input, prints a prompt, echoes its input and at the end of
+ *       input prints the saved 'o' and "k", and echo.in to feed it
+ * Paramters: const char*
+ * Returns: None
+ */
+static void build_echo(const char *dir)
+{
+        emit_value(0, 0);
+        emit_value(7, 1);
+        emit(8, 0, 1, 7);
+        emit_value(7, 'o');
+        emit(2, 1, 0, 7);
+        emit_output(7, "> ");
+
+        uint32_t read = prog_len;
+        emit(11, 0, 0, 2);
+        emit(6, 5, 2, 2);
+        unsigned more = emit_branch(5);
+
+        uint32_t echo = prog_len;
+        emit(10, 0, 0, 2);
+        emit_value(3, read);
+        emit(12, 0, 0, 3);
+
+        uint32_t end = prog_len;
+        emit(1, 7, 1, 0);
+        emit(10, 0, 0, 7);
+        emit_output(7, "k\n");
+        emit(7, 0, 0, 0);
+
+        patch_branch(more, echo, end);
+        write_image(dir, "echo.um");
+
+        char path[4096];
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/echo.in", dir);
+        if ((fp = fopen(path, "w")) == NULL || fputs("hello\n", fp) < 0 ||
+            fclose(fp) != 0) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Function: make_machine
+ * Does: Makes a machine from the program built so far and starts the
+ *       next one
+ * Paramters: const um_io*
+ * Returns: the machine
+ */
+static um_machine *make_machine(const um_io *io)
+{
+        unsigned char image[sizeof(prog)];
+        um_error error;
+
+        for (unsigned i = 0; i < prog_len; i++) {
+                image[4 * i] = prog[i] >> 24;
+                image[4 * i + 1] = prog[i] >> 16;
+                image[4 * i + 2] = prog[i] >> 8;
+                image[4 * i + 3] = prog[i];
+        }
+
+        um_machine *machine = um_create(image, 4 * prog_len, io, &error);
+
+        prog_len = 0;
+        if (machine == NULL) {
+                fprintf(stderr, "umcheck: %s\n", error.message);
+                exit(EXIT_FAILURE);
+        }
+        return machine;
+}
+
+/* Function: check_fault
+ * Does: Runs the program built so far and checks that it fails with code
+ *       at pc, having retired the instructions before it
+ * Paramters: const char*, um_error_code, uint32_t
+ * Returns: whether it did
+ */
+static bool check_fault(const char *name, um_error_code code, uint32_t pc)
+{
+        um_machine *machine = make_machine(NULL);
+        um_status status = um_run(machine, 100);
+        const um_error *error = um_last_error(machine);
+        bool ok = status == UM_FAILED && error->code == code &&
+            error->pc == pc && um_instructions(machine) == pc;
+
+        printf("fault %-8s %s: code %d at pc %u, %llu retired (%s)\n", name,
+            ok ? "ok" : "FAILED", (int)error->code, error->pc,
+            (unsigned long long)um_instructions(machine), error->message);
+        um_free(machine);
+        return ok;
+}
+
+static bool check_faults(void)
+{
+        bool ok = true;
+        um_error error;
+
+        ok &= um_create("UM", 3, NULL, &error) == NULL &&
+            error.code == UM_ERROR_IMAGE;
+        printf("fault image    %s: %s\n", ok ? "ok" : "FAILED",
+            error.message);
+
+        emit_value(1, 5);
+        emit_value(2, 0);
+        emit(5, 3, 1, 2);
+        ok &= check_fault("divide", UM_ERROR_DIVIDE, 2);
+
+        emit_value(1, 7);
+        emit(1, 2, 1, 0);
+        ok &= check_fault("segment", UM_ERROR_SEGMENT, 1);
+
+        emit_value(1, 100);
+        emit(2, 0, 1, 1);
+        ok &= check_fault("bounds", UM_ERROR_BOUNDS, 1);
+
+        emit_value(1, 0);
+        emit(9, 0, 0, 1);
+        ok &= check_fault("unmap", UM_ERROR_UNMAP, 1);
+
+        emit_value(1, 300);
+        emit(10, 0, 0, 1);
+        ok &= check_fault("output", UM_ERROR_OUTPUT, 1);
+
+        emit_value(1, 1);
+        emit(14, 0, 0, 0);
+        ok &= check_fault("opcode", UM_ERROR_OPCODE, 1);
+
+        /* A segment of 2^30 words cannot fit in what is left */
+        struct rlimit limit = { FAULT_AS_BYTES, FAULT_AS_BYTES };
+        setrlimit(RLIMIT_AS, &limit);
+        emit_value(1, 64);
+        emit_value(2, 1 << 24);
+        emit(4, 2, 2, 1);
+        emit(8, 0, 1, 2);
+        ok &= check_fault("memory", UM_ERROR_MEMORY, 3);
+
+        return ok;
+}
+
+/* Every other call has no byte ready */
+static int blocking_input(void *context)
+{
+        unsigned *calls = context;
+
+        return (*calls)++ % 2 == 0 ? UM_INPUT_BLOCKED : 'x';
+}
+
+/* Function: check_blocked
+ * Does: Runs two inputs and a halt one instruction at a time against input
+ *       that is ready every other time, and checks that a blocked input
+ *       is run again and only counted once it reads
+ * Paramters: None
+ * Returns: whether it was
+ */
+static bool check_blocked(void)
+{
+        unsigned calls = 0;
+        um_io io = { blocking_input, NULL, &calls };
+
+        emit(11, 0, 0, 1);
+        emit(11, 0, 0, 1);
+        emit(7, 0, 0, 0);
+
+        um_machine *machine = make_machine(&io);
+        static const um_status expect[] = { UM_BLOCKED, UM_BUDGET,
+            UM_BLOCKED, UM_BUDGET, UM_HALTED };
+        bool ok = true;
+
+        for (unsigned i = 0; i < sizeof(expect) / sizeof(expect[0]); i++)
+                ok &= um_run(machine, 1) == expect[i];
+        ok &= um_instructions(machine) == 3;
+
+        printf("blocked input  %s: %llu retired\n", ok ? "ok" : "FAILED",
+            (unsigned long long)um_instructions(machine));
+        um_free(machine);
+        return ok;
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc != 2) {
+                fprintf(stderr, "usage: %s dir\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+
+        build_smc(argv[1]);
+        build_shared(argv[1]);
+        build_echo(argv[1]);
+
+        bool ok = check_blocked();
+        ok &= check_faults();
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}